@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#define BIT64(nr) (1ULL << (nr))
+
+typedef int gpio_num_t;
+
+typedef enum { GPIO_MODE_INPUT = 1, GPIO_MODE_OUTPUT = 2 } gpio_mode_t;
+typedef enum { GPIO_PULLUP_DISABLE, GPIO_PULLUP_ENABLE } gpio_pullup_t;
+typedef enum { GPIO_PULLDOWN_DISABLE, GPIO_PULLDOWN_ENABLE } gpio_pulldown_t;
+typedef enum { GPIO_INTR_DISABLE } gpio_int_type_t;
+typedef enum { GPIO_HYS_SOFT_DISABLE = 2 } gpio_hys_ctrl_mode_t;
+
+typedef struct {
+    uint64_t pin_bit_mask;
+    gpio_mode_t mode;
+    gpio_pullup_t pull_up_en;
+    gpio_pulldown_t pull_down_en;
+    gpio_int_type_t intr_type;
+    gpio_hys_ctrl_mode_t hys_ctrl_mode;
+} gpio_config_t;
+
+esp_err_t gpio_config(const gpio_config_t *config);
+// the level of the output pin (the handshake line) is what host_spi_handshake() reports
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level);
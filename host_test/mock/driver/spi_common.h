@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+// host build of the bus types both SPI slave drivers share
+typedef enum {
+    SPI1_HOST,
+    SPI2_HOST,
+    SPI3_HOST,
+} spi_host_device_t;
+
+typedef enum {
+    ESP_INTR_CPU_AFFINITY_AUTO,
+    ESP_INTR_CPU_AFFINITY_0,
+    ESP_INTR_CPU_AFFINITY_1,
+} esp_intr_cpu_affinity_t;
+
+#define SPI_DMA_CH_AUTO 3
+#define SPICOMMON_BUSFLAG_QUAD (1u << 9)
+
+typedef struct {
+    int mosi_io_num;
+    int miso_io_num;
+    int sclk_io_num;
+    int quadwp_io_num;
+    int quadhd_io_num;
+    int data4_io_num;
+    int data5_io_num;
+    int data6_io_num;
+    int data7_io_num;
+    bool data_io_default_level;
+    int max_transfer_sz;
+    uint32_t flags;
+    esp_intr_cpu_affinity_t isr_cpu_id;
+    int intr_flags;
+} spi_bus_config_t;
+
+void *spi_bus_dma_memory_alloc(spi_host_device_t host, size_t size, uint32_t extra_heap_caps);
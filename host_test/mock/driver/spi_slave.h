@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "driver/spi_common.h"
+
+// host build of the SPI slave driver calls spi_api.c makes, the master side is in host_spi.h
+typedef struct spi_slave_transaction_t spi_slave_transaction_t;
+typedef void (*slave_transaction_cb_t)(spi_slave_transaction_t *trans);
+
+struct spi_slave_transaction_t {
+    size_t length;      // bits
+    size_t trans_len;   // bits clocked, set by the driver
+    const void *tx_buffer;
+    void *rx_buffer;
+    void *user;
+};
+
+typedef struct {
+    int spics_io_num;
+    uint32_t flags;
+    int queue_size;
+    uint8_t mode;
+    slave_transaction_cb_t post_setup_cb;
+    slave_transaction_cb_t post_trans_cb;
+} spi_slave_interface_config_t;
+
+esp_err_t spi_slave_initialize(spi_host_device_t host, const spi_bus_config_t *bus_config,
+                               const spi_slave_interface_config_t *slave_config, int dma_chan);
+// queued transactions are clocked in order by host_spi_transfer() / host_spi_clock()
+esp_err_t spi_slave_queue_trans(spi_host_device_t host, const spi_slave_transaction_t *trans_desc, TickType_t ticks_to_wait);
+esp_err_t spi_slave_get_trans_result(spi_host_device_t host, spi_slave_transaction_t **trans_desc, TickType_t ticks_to_wait);
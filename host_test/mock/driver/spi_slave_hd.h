@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "driver/spi_common.h"
+
+// host build of the half duplex SPI slave driver calls spi_api.c makes with CONFIG_SPI_API_QUAD, the master side is in
+// host_spi.h
+typedef enum {
+    SPI_SLAVE_CHAN_TX = 0,
+    SPI_SLAVE_CHAN_RX = 1,
+} spi_slave_chan_t;
+
+// hal/spi_types.h
+typedef enum {
+    SPI_EV_BUF_TX = 1 << 0,
+    SPI_EV_BUF_RX = 1 << 1,
+    SPI_EV_SEND_DMA_READY = 1 << 2,
+    SPI_EV_SEND = 1 << 3,
+    SPI_EV_RECV_DMA_READY = 1 << 4,
+    SPI_EV_RECV = 1 << 5,
+} spi_event_t;
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t trans_len;   // bytes received, set by the driver
+    void *arg;
+} spi_slave_hd_data_t;
+
+typedef struct {
+    spi_event_t event;
+    spi_slave_hd_data_t *trans;
+} spi_slave_hd_event_t;
+
+typedef bool (*slave_cb_t)(void *arg, spi_slave_hd_event_t *event, BaseType_t *awoken);
+
+typedef struct {
+    slave_cb_t cb_buffer_tx;
+    slave_cb_t cb_buffer_rx;
+    slave_cb_t cb_send_dma_ready;
+    slave_cb_t cb_sent;
+    slave_cb_t cb_recv_dma_ready;
+    slave_cb_t cb_recv;
+    slave_cb_t cb_cmd9;
+    slave_cb_t cb_cmdA;
+    void *arg;
+} spi_slave_hd_callback_config_t;
+
+typedef struct {
+    int spics_io_num;
+    uint32_t flags;
+    uint8_t mode;
+    int command_bits;
+    int address_bits;
+    int dummy_bits;
+    int queue_size;
+    int dma_chan;
+    spi_slave_hd_callback_config_t cb_config;
+} spi_slave_hd_slot_config_t;
+
+esp_err_t spi_slave_hd_init(spi_host_device_t host_id, const spi_bus_config_t *bus_config,
+                            const spi_slave_hd_slot_config_t *config);
+// per channel, queued transactions are taken in order by host_spi_transfer() / host_spi_clock()
+esp_err_t spi_slave_hd_queue_trans(spi_host_device_t host_id, spi_slave_chan_t chan, spi_slave_hd_data_t *trans,
+                                   TickType_t timeout);
+esp_err_t spi_slave_hd_get_trans_res(spi_host_device_t host_id, spi_slave_chan_t chan, spi_slave_hd_data_t **out_trans,
+                                     TickType_t timeout);
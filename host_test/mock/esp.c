@@ -0,0 +1,171 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_app_desc.h"
+#include "nvs.h"
+
+int host_log_enabled(void)
+{
+    static int enabled = -1;
+    if (enabled < 0) {
+        enabled = getenv("SPI_HOST_LOG") != NULL;
+    }
+    return enabled;
+}
+
+const char *esp_err_to_name(esp_err_t err)
+{
+    return err == ESP_OK ? "ESP_OK" : "ESP_FAIL";
+}
+
+static uint32_t crc_table[256];
+
+static void crc_table_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, crc_table_init);
+    crc = ~crc;
+    for (uint32_t i = 0; i < len; i++) {
+        crc = crc_table[(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/* system and timers */
+
+int host_restarts;
+
+void esp_restart(void)
+{
+    __atomic_add_fetch(&host_restarts, 1, __ATOMIC_SEQ_CST);
+}
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct host_timer {
+    esp_timer_create_args_t args;
+};
+
+// the firmware never deletes its timers, a static pool keeps LeakSanitizer quiet
+#define HOST_TIMERS 8
+static struct host_timer timers[HOST_TIMERS];
+static int timer_count;
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args, esp_timer_handle_t *out_handle)
+{
+    const int n = __atomic_fetch_add(&timer_count, 1, __ATOMIC_SEQ_CST);
+    if (n >= HOST_TIMERS) {
+        return ESP_ERR_NO_MEM;
+    }
+    timers[n].args = *create_args;
+    *out_handle = &timers[n];
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    return ESP_OK;
+}
+
+const esp_app_desc_t *esp_app_get_description(void)
+{
+    static const esp_app_desc_t desc = {
+        .version = "host", .project_name = "tusb_msc", .time = "00:00:00", .date = "Jan  1 2024", .idf_ver = "host",
+    };
+    return &desc;
+}
+
+/* NVS */
+
+#define NVS_BLOBS 8
+
+static struct {
+    char key[16];
+    uint8_t *value;
+    size_t length;
+} nvs_blobs[NVS_BLOBS];
+static pthread_mutex_t nvs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    *out_handle = 1;
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+{
+    esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+    pthread_mutex_lock(&nvs_lock);
+    for (int i = 0; i < NVS_BLOBS; i++) {
+        if (nvs_blobs[i].value && strcmp(nvs_blobs[i].key, key) == 0) {
+            memcpy(out_value, nvs_blobs[i].value, *length < nvs_blobs[i].length ? *length : nvs_blobs[i].length);
+            *length = nvs_blobs[i].length;
+            err = ESP_OK;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return err;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    uint8_t *copy = malloc(length ? length : 1);
+    if (copy == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(copy, value, length);
+    pthread_mutex_lock(&nvs_lock);
+    int slot = -1;
+    for (int i = 0; i < NVS_BLOBS; i++) {
+        if (nvs_blobs[i].value && strcmp(nvs_blobs[i].key, key) == 0) {
+            slot = i;
+            break;
+        }
+        if (nvs_blobs[i].value == NULL && slot < 0) {
+            slot = i;
+        }
+    }
+    if (slot >= 0) {
+        free(nvs_blobs[slot].value);
+        snprintf(nvs_blobs[slot].key, sizeof(nvs_blobs[slot].key), "%s", key);
+        nvs_blobs[slot].value = copy;
+        nvs_blobs[slot].length = length;
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    if (slot < 0) {
+        free(copy);
+        return ESP_ERR_NVS_NO_FREE_PAGES;
+    }
+    return ESP_OK;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdio.h>
+
+// host build of the ESP-IDF log macros, quiet unless SPI_HOST_LOG is set in the environment
+int host_log_enabled(void);
+
+#define HOST_LOG(level, tag, fmt, ...) do { \
+        if (host_log_enabled()) fprintf(stderr, level " (%s) " fmt "\n", tag, ##__VA_ARGS__); \
+    } while (0)
+#define ESP_LOGE(tag, fmt, ...) HOST_LOG("E", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) HOST_LOG("W", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) HOST_LOG("I", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) HOST_LOG("D", tag, fmt, ##__VA_ARGS__)
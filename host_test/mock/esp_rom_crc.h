@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdint.h>
+
+// same result as the ROM function: crc32 with the zlib polynomial, crc is the running value (0 to start)
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len);
@@ -0,0 +1,5 @@
+#pragma once
+
+// does not restart on the host, it counts and returns
+void esp_restart(void);
+extern int host_restarts;
@@ -0,0 +1,140 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_ota_ops.h"
+#include "esp_image_format.h"
+#include "host_ota.h"
+
+/* flash, app slots and image check */
+
+uint8_t host_flash[HOST_SLOT_SIZE];
+static bool erased[HOST_SLOT_SIZE];
+static const esp_partition_t host_running = {
+    .type = ESP_PARTITION_TYPE_APP, .subtype = ESP_PARTITION_SUBTYPE_APP_OTA_0, .address = 0x10000,
+    .size = HOST_SLOT_SIZE, .label = "ota_0",
+};
+const esp_partition_t host_slot = {
+    .type = ESP_PARTITION_TYPE_APP, .subtype = ESP_PARTITION_SUBTYPE_APP_OTA_1, .address = 0x110000,
+    .size = HOST_SLOT_SIZE, .label = "ota_1",
+};
+static const esp_partition_t *const host_apps[] = { &host_running, &host_slot };
+#define HOST_APPS (sizeof(host_apps) / sizeof(host_apps[0]))
+int host_flash_overwrites;
+uint32_t host_flash_fail_at = UINT32_MAX;
+uint32_t host_flash_erase_us;
+int host_boot_selects;
+
+void host_reset(void)
+{
+    for (int i = 0; i < HOST_SLOT_SIZE; i++) {
+        host_flash[i] = rand();
+    }
+    memset(erased, 0, sizeof(erased));
+    host_flash_overwrites = 0;
+    host_flash_fail_at = UINT32_MAX;
+    host_flash_erase_us = 0;
+    host_boot_selects = 0;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    if (offset % 4096 || size % 4096 || offset + size > partition->size) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (host_flash_erase_us) {
+        usleep(host_flash_erase_us);
+    }
+    memset(host_flash + offset, 0xFF, size);
+    memset(erased + offset, true, size);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size)
+{
+    if (dst_offset + size > partition->size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (dst_offset + size > host_flash_fail_at) {
+        return ESP_FAIL;
+    }
+    for (size_t i = dst_offset; i < dst_offset + size; i++) {
+        if (!erased[i]) {
+            host_flash_overwrites++;
+        }
+        erased[i] = false;
+    }
+    memcpy(host_flash + dst_offset, src, size);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+    if (src_offset + size > partition->size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(dst, host_flash + src_offset, size);
+    return ESP_OK;
+}
+
+// iterators are an index + 1 into host_apps
+static esp_partition_iterator_t find_from(size_t i, esp_partition_type_t type, esp_partition_subtype_t subtype)
+{
+    for (; i < HOST_APPS; i++) {
+        if (host_apps[i]->type == type && (subtype == ESP_PARTITION_SUBTYPE_ANY || host_apps[i]->subtype == subtype)) {
+            return (esp_partition_iterator_t)(i + 1);
+        }
+    }
+    return NULL;
+}
+
+esp_partition_iterator_t esp_partition_find(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label)
+{
+    return find_from(0, type, subtype);
+}
+
+const esp_partition_t *esp_partition_get(esp_partition_iterator_t iterator)
+{
+    return host_apps[(uintptr_t)iterator - 1];
+}
+
+esp_partition_iterator_t esp_partition_next(esp_partition_iterator_t iterator)
+{
+    const esp_partition_t *p = esp_partition_get(iterator);
+    return find_from((uintptr_t)iterator, p->type, ESP_PARTITION_SUBTYPE_ANY);
+}
+
+void esp_partition_iterator_release(esp_partition_iterator_t iterator)
+{
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                const char *label)
+{
+    esp_partition_iterator_t it = esp_partition_find(type, subtype, label);
+    return it ? esp_partition_get(it) : NULL;
+}
+
+const esp_partition_t *esp_ota_get_running_partition(void)
+{
+    return &host_running;
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from)
+{
+    return &host_slot;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition)
+{
+    host_boot_selects++;
+    return ESP_OK;
+}
+
+esp_err_t esp_image_verify(esp_image_load_mode_t mode, const esp_partition_pos_t *part, esp_image_metadata_t *data)
+{
+    if (part->offset != host_slot.address || host_flash[0] != 0xE9) {
+        return ESP_ERR_IMAGE_INVALID;
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,148 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+struct host_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    uint8_t *items;
+    UBaseType_t length;
+    UBaseType_t item_size; // 0 for semaphores
+    UBaseType_t head;
+    UBaseType_t count;
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    QueueHandle_t queue = calloc(1, sizeof(*queue));
+    queue->items = calloc(length, item_size ? item_size : 1);
+    queue->length = length;
+    queue->item_size = item_size;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->changed, NULL);
+    return queue;
+}
+
+// waits for the queue to change, false once wait ticks (ms) passed since deadline was set up
+static bool wait_changed(QueueHandle_t queue, TickType_t wait, struct timespec *deadline)
+{
+    if (wait == portMAX_DELAY) {
+        pthread_cond_wait(&queue->changed, &queue->lock);
+        return true;
+    }
+    if (deadline->tv_sec == 0 && deadline->tv_nsec == 0) {
+        clock_gettime(CLOCK_REALTIME, deadline);
+        deadline->tv_sec += wait / 1000;
+        deadline->tv_nsec += (long)(wait % 1000) * 1000000;
+        if (deadline->tv_nsec >= 1000000000) {
+            deadline->tv_sec++;
+            deadline->tv_nsec -= 1000000000;
+        }
+    }
+    return pthread_cond_timedwait(&queue->changed, &queue->lock, deadline) == 0;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t wait)
+{
+    struct timespec deadline = {0};
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->length && wait != 0) {
+        if (!wait_changed(queue, wait, &deadline)) {
+            break;
+        }
+    }
+    const bool room = queue->count < queue->length;
+    if (room) {
+        if (queue->item_size) {
+            memcpy(queue->items + (queue->head + queue->count) % queue->length * queue->item_size, item,
+                   queue->item_size);
+        }
+        queue->count++;
+        pthread_cond_broadcast(&queue->changed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return room ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t wait)
+{
+    struct timespec deadline = {0};
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && wait != 0) {
+        if (!wait_changed(queue, wait, &deadline)) {
+            break;
+        }
+    }
+    const bool got = queue->count > 0;
+    if (got) {
+        if (queue->item_size) {
+            memcpy(item, queue->items + queue->head * queue->item_size, queue->item_size);
+        }
+        queue->head = (queue->head + 1) % queue->length;
+        queue->count--;
+        pthread_cond_broadcast(&queue->changed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return got ? pdTRUE : pdFALSE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    const UBaseType_t count = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    SemaphoreHandle_t sem = xQueueCreate(1, 0);
+    sem->count = 1; // given
+    return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return xQueueCreate(1, 0);
+}
+
+typedef struct {
+    TaskFunction_t task;
+    void *arg;
+} host_task_t;
+
+static void *task_main(void *arg)
+{
+    host_task_t task = *(host_task_t *)arg;
+    free(arg);
+    task.task(task.arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char *name, uint32_t stack, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *handle, BaseType_t core)
+{
+    host_task_t *start = malloc(sizeof(*start));
+    start->task = task;
+    start->arg = arg;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, task_main, start) != 0) {
+        free(start);
+        return pdFALSE;
+    }
+    pthread_detach(thread);
+    if (handle) {
+        *handle = (TaskHandle_t)thread;
+    }
+    return pdPASS;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    usleep(ticks * portTICK_PERIOD_MS * 1000);
+}
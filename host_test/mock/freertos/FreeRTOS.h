@@ -0,0 +1,27 @@
+#pragma once
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include "esp_attr.h"
+#include "esp_system.h"
+
+// host build of the FreeRTOS types the SPI interface uses, tasks are threads and queues block on a condition variable
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS pdTRUE
+#define portMAX_DELAY ((TickType_t)0xFFFFFFFFu)
+#define portTICK_PERIOD_MS 1 // queue and semaphore waits count ticks as ms
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+// critical sections are a mutex, from a task and from the (mock) interrupt alike
+typedef pthread_mutex_t portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED PTHREAD_MUTEX_INITIALIZER
+#define portENTER_CRITICAL(mux) pthread_mutex_lock(mux)
+#define portEXIT_CRITICAL(mux) pthread_mutex_unlock(mux)
+#define portENTER_CRITICAL_ISR(mux) pthread_mutex_lock(mux)
+#define portEXIT_CRITICAL_ISR(mux) pthread_mutex_unlock(mux)
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "freertos/queue.h"
+
+// queues without items like in FreeRTOS: a mutex starts given, a binary semaphore taken
+typedef QueueHandle_t SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+#define xSemaphoreTake(sem, wait) xQueueReceive((sem), NULL, (wait))
+#define xSemaphoreGive(sem) xQueueSend((sem), NULL, 0)
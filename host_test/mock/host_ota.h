@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_partition.h"
+
+// the app slot esp_ota_get_next_update_partition hands out, backed by host_flash
+#define HOST_SLOT_SIZE (512 * 1024)
+extern uint8_t host_flash[HOST_SLOT_SIZE];
+extern const esp_partition_t host_slot;
+
+// writes to bytes that were not erased, fails the test
+extern int host_flash_overwrites;
+// esp_partition_write fails once it reaches this offset, UINT32_MAX never
+extern uint32_t host_flash_fail_at;
+// time esp_partition_erase_range takes, the writer task is in the middle of an erase for that long
+extern uint32_t host_flash_erase_us;
+// esp_ota_set_boot_partition calls
+extern int host_boot_selects;
+
+// flash back to random contents, nothing erased, counters cleared
+void host_reset(void);
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Master side of the mock SPI slave driver
+ *
+ * The transactions spi_task queued with spi_slave_queue_trans() are clocked in order, one per call, the way the RP2350
+ * clocks a frame with CS asserted: the master's bytes land in the rx buffer, the armed tx buffer goes out, post_trans_cb
+ * runs and the transaction comes back from spi_slave_get_trans_result(). The calls block until the slave has a
+ * transaction queued, so the master can be at most SPI_QUEUE_DEPTH frames ahead of spi_task, like on the wire.
+ * spi_slave_hd.c implements the same calls for the half duplex driver (CONFIG_SPI_API_QUAD), a transfer is the write of
+ * the master's frame and the read of the slave's.
+ */
+
+// one frame: the clocked length follows the protocol (header, then the longer payload of both frames, rounded up to 4),
+// miso gets what the slave clocked out. Returns the bytes clocked.
+size_t host_spi_transfer(const uint8_t *mosi, uint8_t *miso);
+
+// len raw bytes, the slave gets them in a receive buffer of exactly len bytes so AddressSanitizer catches reads past
+// what came in. What the slave clocked out is not looked at.
+void host_spi_clock(const uint8_t *mosi, size_t len);
+
+// flips bits on the wire in both directions of host_spi_transfer(), NULL for a clean line
+void host_spi_set_noise(void (*noise)(void *ctx, uint8_t *data, size_t len), void *ctx);
+
+// waits until spi_task queued every clocked transaction again, returns the frame armed last
+const uint8_t *host_spi_settle(void);
+
+// level of the handshake line
+bool host_spi_handshake(void);
+
+// time spi_task took per transaction, from spi_slave_get_trans_result() returning it to queueing it again
+typedef struct {
+    uint64_t steps;
+    uint64_t ns_total;
+    uint64_t ns_max;
+    uint64_t ns_last;
+} host_spi_stats_t;
+void host_spi_stats(host_spi_stats_t *stats, bool reset);
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+// custom_sdmmc_error_count() reports this
+extern uint32_t host_sd_errors;
+// storage_shutdown() calls, each one reports the USB, unmount and flush steps done
+extern int host_shutdowns;
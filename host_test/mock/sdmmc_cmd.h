@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+
+// the card fields the firmware info reports
+typedef struct {
+    struct {
+        char name[8];
+    } cid;
+    struct {
+        int capacity;
+        int sector_size;
+    } csd;
+    int real_freq_khz;
+} sdmmc_card_t;
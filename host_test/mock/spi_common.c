@@ -0,0 +1,29 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include "driver/gpio.h"
+#include "driver/spi_common.h"
+#include "host_spi.h"
+
+// shared by both slave driver mocks: DMA buffers and the handshake line, the only output spi_api.c drives
+static bool handshake;
+
+void *spi_bus_dma_memory_alloc(spi_host_device_t host, size_t size, uint32_t extra_heap_caps)
+{
+    return calloc(1, size);
+}
+
+esp_err_t gpio_config(const gpio_config_t *config)
+{
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level)
+{
+    __atomic_store_n(&handshake, level != 0, __ATOMIC_SEQ_CST);
+    return ESP_OK;
+}
+
+bool host_spi_handshake(void)
+{
+    return __atomic_load_n(&handshake, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,209 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "driver/spi_slave.h"
+#include "spi_proto.h"
+#include "host_spi.h"
+
+#define HOST_SPI_QUEUE 16 // more than any queue_size
+
+typedef struct {
+    spi_slave_transaction_t *trans[HOST_SPI_QUEUE];
+    int head;
+    int count;
+} fifo_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static slave_transaction_cb_t post_trans_cb;
+static fifo_t armed; // queued by the slave, clocked next
+static fifo_t done;  // clocked, for spi_slave_get_trans_result
+static int in_flight; // clocked and not queued again yet
+static const uint8_t *last_armed;
+
+// host_spi_clock() swaps in a receive buffer of the exact length until the transaction is queued again
+static struct {
+    spi_slave_transaction_t *trans;
+    void *rx_buffer;
+} swapped[HOST_SPI_QUEUE];
+
+// spi_task's time per transaction
+static spi_slave_transaction_t *taken;
+static uint64_t taken_ns;
+static host_spi_stats_t stats;
+
+static void (*noise_cb)(void *ctx, uint8_t *data, size_t len);
+static void *noise_ctx;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void push(fifo_t *fifo, spi_slave_transaction_t *trans)
+{
+    if (fifo->count == HOST_SPI_QUEUE) {
+        abort(); // more transactions than the slave has
+    }
+    fifo->trans[(fifo->head + fifo->count++) % HOST_SPI_QUEUE] = trans;
+}
+
+static spi_slave_transaction_t *pop(fifo_t *fifo)
+{
+    spi_slave_transaction_t *trans = fifo->trans[fifo->head];
+    fifo->head = (fifo->head + 1) % HOST_SPI_QUEUE;
+    fifo->count--;
+    return trans;
+}
+
+/* slave side */
+
+esp_err_t spi_slave_initialize(spi_host_device_t host, const spi_bus_config_t *bus_config,
+                               const spi_slave_interface_config_t *slave_config, int dma_chan)
+{
+    post_trans_cb = slave_config->post_trans_cb;
+    return ESP_OK;
+}
+
+esp_err_t spi_slave_queue_trans(spi_host_device_t host, const spi_slave_transaction_t *trans_desc, TickType_t ticks_to_wait)
+{
+    spi_slave_transaction_t *trans = (spi_slave_transaction_t *)trans_desc;
+    pthread_mutex_lock(&lock);
+    if (trans == taken) {
+        const uint64_t ns = now_ns() - taken_ns;
+        stats.steps++;
+        stats.ns_total += ns;
+        stats.ns_max = ns > stats.ns_max ? ns : stats.ns_max;
+        stats.ns_last = ns;
+        taken = NULL;
+    }
+    for (int i = 0; i < HOST_SPI_QUEUE; i++) {
+        if (swapped[i].trans == trans) {
+            free(trans->rx_buffer);
+            trans->rx_buffer = swapped[i].rx_buffer;
+            swapped[i].trans = NULL;
+        }
+    }
+    push(&armed, trans);
+    last_armed = trans->tx_buffer;
+    if (in_flight > 0) {
+        in_flight--;
+    }
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+    return ESP_OK;
+}
+
+esp_err_t spi_slave_get_trans_result(spi_host_device_t host, spi_slave_transaction_t **trans_desc, TickType_t ticks_to_wait)
+{
+    pthread_mutex_lock(&lock);
+    while (done.count == 0) {
+        pthread_cond_wait(&changed, &lock);
+    }
+    *trans_desc = pop(&done);
+    taken = *trans_desc;
+    taken_ns = now_ns();
+    pthread_mutex_unlock(&lock);
+    return ESP_OK;
+}
+
+/* master side */
+
+static spi_slave_transaction_t *next_armed(void)
+{
+    pthread_mutex_lock(&lock);
+    while (armed.count == 0) {
+        pthread_cond_wait(&changed, &lock);
+    }
+    spi_slave_transaction_t *trans = pop(&armed);
+    in_flight++;
+    pthread_mutex_unlock(&lock);
+    return trans;
+}
+
+// the transfer is over: post_trans_cb runs like from the interrupt, then the slave can take the result
+static void finish(spi_slave_transaction_t *trans, size_t clocked)
+{
+    trans->trans_len = clocked * 8;
+    if (post_trans_cb) {
+        post_trans_cb(trans);
+    }
+    pthread_mutex_lock(&lock);
+    push(&done, trans);
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+}
+
+static size_t payload(const uint8_t *frame)
+{
+    spi_frame_header_t hdr;
+    memcpy(&hdr, frame, SPI_HEADER_SIZE);
+    return hdr.length <= SPI_MAX_PAYLOAD ? hdr.length : SPI_MAX_PAYLOAD;
+}
+
+size_t host_spi_transfer(const uint8_t *mosi, uint8_t *miso)
+{
+    spi_slave_transaction_t *trans = next_armed();
+    const size_t out_len = payload(trans->tx_buffer);
+    const size_t in_len = payload(mosi);
+    size_t clocked = SPI_HEADER_SIZE + (out_len > in_len ? out_len : in_len);
+    clocked = (clocked + 3) & ~(size_t)3;
+    if (clocked > SPI_MAX_FRAME_SIZE) {
+        clocked = SPI_MAX_FRAME_SIZE;
+    }
+    memcpy(miso, trans->tx_buffer, clocked);
+    memcpy(trans->rx_buffer, mosi, clocked);
+    if (noise_cb) {
+        noise_cb(noise_ctx, miso, clocked);
+        noise_cb(noise_ctx, trans->rx_buffer, clocked);
+    }
+    finish(trans, clocked);
+    return clocked;
+}
+
+void host_spi_clock(const uint8_t *mosi, size_t len)
+{
+    spi_slave_transaction_t *trans = next_armed();
+    uint8_t *exact = malloc(len ? len : 1);
+    memcpy(exact, mosi, len);
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < HOST_SPI_QUEUE; i++) {
+        if (swapped[i].trans == NULL) {
+            swapped[i].trans = trans;
+            swapped[i].rx_buffer = trans->rx_buffer;
+            break;
+        }
+    }
+    trans->rx_buffer = exact;
+    pthread_mutex_unlock(&lock);
+    finish(trans, len);
+}
+
+void host_spi_set_noise(void (*noise)(void *ctx, uint8_t *data, size_t len), void *ctx)
+{
+    noise_cb = noise;
+    noise_ctx = ctx;
+}
+
+const uint8_t *host_spi_settle(void)
+{
+    pthread_mutex_lock(&lock);
+    while (in_flight > 0) {
+        pthread_cond_wait(&changed, &lock);
+    }
+    const uint8_t *frame = last_armed;
+    pthread_mutex_unlock(&lock);
+    return frame;
+}
+
+void host_spi_stats(host_spi_stats_t *out, bool reset)
+{
+    pthread_mutex_lock(&lock);
+    *out = stats;
+    if (reset) {
+        memset(&stats, 0, sizeof(stats));
+    }
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,227 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "driver/spi_slave_hd.h"
+#include "spi_proto.h"
+#include "host_spi.h"
+
+/* Half duplex driver for the CONFIG_SPI_API_QUAD build: host_spi_transfer() is the master's WRDMA of its frame into
+ * the oldest receive transaction, then the RDDMA of the oldest send transaction. The receive transaction is done
+ * before the send transaction is read, like on the wire. How many data lines carry them makes no difference here.
+ */
+
+#define HOST_SPI_QUEUE 16 // more than any queue_size
+
+typedef struct {
+    spi_slave_hd_data_t *trans[HOST_SPI_QUEUE];
+    int head;
+    int count;
+} fifo_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static slave_cb_t cb_sent;
+static void *cb_arg;
+static fifo_t armed[2]; // per spi_slave_chan_t, queued by the slave, clocked next
+static fifo_t done[2];  // clocked, for spi_slave_hd_get_trans_res
+static int in_flight; // exchanges clocked whose send transaction is not queued again yet
+static const uint8_t *last_armed;
+
+// host_spi_clock() swaps in a receive buffer of the exact length until the transaction is queued again
+static struct {
+    spi_slave_hd_data_t *trans;
+    uint8_t *data;
+} swapped[HOST_SPI_QUEUE];
+
+// spi_task's time per exchange, from taking the receive transaction to queueing the send transaction again
+static void *taken;
+static uint64_t taken_ns;
+static host_spi_stats_t stats;
+
+static void (*noise_cb)(void *ctx, uint8_t *data, size_t len);
+static void *noise_ctx;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void push(fifo_t *fifo, spi_slave_hd_data_t *trans)
+{
+    if (fifo->count == HOST_SPI_QUEUE) {
+        abort(); // more transactions than the slave has
+    }
+    fifo->trans[(fifo->head + fifo->count++) % HOST_SPI_QUEUE] = trans;
+}
+
+static spi_slave_hd_data_t *pop(fifo_t *fifo)
+{
+    spi_slave_hd_data_t *trans = fifo->trans[fifo->head];
+    fifo->head = (fifo->head + 1) % HOST_SPI_QUEUE;
+    fifo->count--;
+    return trans;
+}
+
+/* slave side */
+
+esp_err_t spi_slave_hd_init(spi_host_device_t host_id, const spi_bus_config_t *bus_config,
+                            const spi_slave_hd_slot_config_t *config)
+{
+    cb_sent = config->cb_config.cb_sent;
+    cb_arg = config->cb_config.arg;
+    return ESP_OK;
+}
+
+esp_err_t spi_slave_hd_queue_trans(spi_host_device_t host_id, spi_slave_chan_t chan, spi_slave_hd_data_t *trans,
+                                   TickType_t timeout)
+{
+    pthread_mutex_lock(&lock);
+    if (chan == SPI_SLAVE_CHAN_RX) {
+        for (int i = 0; i < HOST_SPI_QUEUE; i++) {
+            if (swapped[i].trans == trans) {
+                free(trans->data);
+                trans->data = swapped[i].data;
+                swapped[i].trans = NULL;
+            }
+        }
+    } else {
+        if (trans->arg == taken) {
+            const uint64_t ns = now_ns() - taken_ns;
+            stats.steps++;
+            stats.ns_total += ns;
+            stats.ns_max = ns > stats.ns_max ? ns : stats.ns_max;
+            stats.ns_last = ns;
+            taken = NULL;
+        }
+        last_armed = trans->data;
+        if (in_flight > 0) {
+            in_flight--;
+        }
+    }
+    push(&armed[chan], trans);
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+    return ESP_OK;
+}
+
+esp_err_t spi_slave_hd_get_trans_res(spi_host_device_t host_id, spi_slave_chan_t chan, spi_slave_hd_data_t **out_trans,
+                                     TickType_t timeout)
+{
+    pthread_mutex_lock(&lock);
+    while (done[chan].count == 0) {
+        pthread_cond_wait(&changed, &lock);
+    }
+    *out_trans = pop(&done[chan]);
+    if (chan == SPI_SLAVE_CHAN_RX) {
+        taken = (*out_trans)->arg;
+        taken_ns = now_ns();
+    }
+    pthread_mutex_unlock(&lock);
+    return ESP_OK;
+}
+
+/* master side */
+
+// the master writes only once the slave has both transactions of the exchange queued
+static void next_armed(spi_slave_hd_data_t **rx, spi_slave_hd_data_t **tx)
+{
+    pthread_mutex_lock(&lock);
+    while (armed[SPI_SLAVE_CHAN_RX].count == 0 || armed[SPI_SLAVE_CHAN_TX].count == 0) {
+        pthread_cond_wait(&changed, &lock);
+    }
+    *rx = pop(&armed[SPI_SLAVE_CHAN_RX]);
+    *tx = pop(&armed[SPI_SLAVE_CHAN_TX]);
+    in_flight++;
+    pthread_mutex_unlock(&lock);
+}
+
+static void finish(spi_slave_chan_t chan, spi_slave_hd_data_t *trans, size_t clocked)
+{
+    trans->trans_len = clocked;
+    if (chan == SPI_SLAVE_CHAN_TX && cb_sent) {
+        spi_slave_hd_event_t event = { .event = SPI_EV_SEND, .trans = trans };
+        BaseType_t awoken = 0;
+        cb_sent(cb_arg, &event, &awoken);
+    }
+    pthread_mutex_lock(&lock);
+    push(&done[chan], trans);
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+}
+
+// header and payload rounded up to 4, what the master writes or reads of a frame
+static size_t frame_len(const uint8_t *frame)
+{
+    spi_frame_header_t hdr;
+    memcpy(&hdr, frame, SPI_HEADER_SIZE);
+    const size_t len = (SPI_HEADER_SIZE + hdr.length + 3) & ~(size_t)3;
+    return len <= SPI_MAX_FRAME_SIZE ? len : SPI_MAX_FRAME_SIZE;
+}
+
+size_t host_spi_transfer(const uint8_t *mosi, uint8_t *miso)
+{
+    spi_slave_hd_data_t *rx, *tx;
+    next_armed(&rx, &tx);
+    const size_t in_len = frame_len(mosi);
+    memcpy(rx->data, mosi, in_len);
+    if (noise_cb) {
+        noise_cb(noise_ctx, rx->data, in_len);
+    }
+    finish(SPI_SLAVE_CHAN_RX, rx, in_len);
+    const size_t out_len = frame_len(tx->data);
+    memcpy(miso, tx->data, out_len);
+    if (noise_cb) {
+        noise_cb(noise_ctx, miso, out_len);
+    }
+    finish(SPI_SLAVE_CHAN_TX, tx, out_len);
+    return in_len + out_len;
+}
+
+void host_spi_clock(const uint8_t *mosi, size_t len)
+{
+    spi_slave_hd_data_t *rx, *tx;
+    next_armed(&rx, &tx);
+    uint8_t *exact = malloc(len ? len : 1);
+    memcpy(exact, mosi, len);
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < HOST_SPI_QUEUE; i++) {
+        if (swapped[i].trans == NULL) {
+            swapped[i].trans = rx;
+            swapped[i].data = rx->data;
+            break;
+        }
+    }
+    rx->data = exact;
+    pthread_mutex_unlock(&lock);
+    finish(SPI_SLAVE_CHAN_RX, rx, len);
+    finish(SPI_SLAVE_CHAN_TX, tx, SPI_HEADER_SIZE);
+}
+
+void host_spi_set_noise(void (*noise)(void *ctx, uint8_t *data, size_t len), void *ctx)
+{
+    noise_cb = noise;
+    noise_ctx = ctx;
+}
+
+const uint8_t *host_spi_settle(void)
+{
+    pthread_mutex_lock(&lock);
+    while (in_flight > 0) {
+        pthread_cond_wait(&changed, &lock);
+    }
+    const uint8_t *frame = last_armed;
+    pthread_mutex_unlock(&lock);
+    return frame;
+}
+
+void host_spi_stats(host_spi_stats_t *out, bool reset)
+{
+    pthread_mutex_lock(&lock);
+    *out = stats;
+    if (reset) {
+        memset(&stats, 0, sizeof(stats));
+    }
+    pthread_mutex_unlock(&lock);
+}
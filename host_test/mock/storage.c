@@ -0,0 +1,36 @@
+#include <string.h>
+#include "custom_sdmmc_cmd.h"
+#include "msc_stats.h"
+#include "storage_shutdown.h"
+#include "host_storage.h"
+
+// stand-ins for the parts of main/ behind the SPI interface that need the card and the USB stack
+
+uint32_t host_sd_errors;
+int host_shutdowns;
+
+uint32_t custom_sdmmc_error_count(void)
+{
+    return host_sd_errors;
+}
+
+void msc_stats_summary(msc_stats_summary_t *summary)
+{
+    memset(summary, 0, sizeof(*summary));
+}
+
+void msc_stats_reset(void)
+{
+}
+
+esp_err_t storage_shutdown(const sdmmc_card_t *card, int64_t deadline_us, spi_shutdown_rsp_t *rsp)
+{
+    __atomic_add_fetch(&host_shutdowns, 1, __ATOMIC_SEQ_CST);
+    rsp->steps = SPI_SHUTDOWN_USB | SPI_SHUTDOWN_UNMOUNT | SPI_SHUTDOWN_FLUSH;
+    return ESP_OK;
+}
+
+bool storage_shutdown_started(void)
+{
+    return __atomic_load_n(&host_shutdowns, __ATOMIC_SEQ_CST) > 0;
+}
@@ -0,0 +1,29 @@
+#include "tusb_msc_storage.h"
+
+static bool s_in_use_by_usb_host;
+static tusb_msc_callback_t s_premount_cb;
+
+bool tinyusb_msc_storage_in_use_by_usb_host(void)
+{
+    return s_in_use_by_usb_host;
+}
+
+esp_err_t tinyusb_msc_register_callback(tinyusb_msc_event_type_t event_type, tusb_msc_callback_t callback)
+{
+    if (event_type == TINYUSB_MSC_EVENT_PREMOUNT_CHANGED) {
+        s_premount_cb = callback;
+    }
+    return ESP_OK;
+}
+
+void host_msc_hand_over(bool to_usb_host)
+{
+    tinyusb_msc_event_t event = {
+        .type = TINYUSB_MSC_EVENT_PREMOUNT_CHANGED,
+        .mount_changed_data.is_mounted = !to_usb_host,
+    };
+    if (s_premount_cb) {
+        s_premount_cb(&event);
+    }
+    s_in_use_by_usb_host = to_usb_host;
+}
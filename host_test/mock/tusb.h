@@ -0,0 +1,4 @@
+#pragma once
+
+// the part of the TinyUSB configuration the firmware info reports
+#define TUD_OPT_HIGH_SPEED 1
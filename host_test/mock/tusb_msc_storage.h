@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include "esp_err.h"
+
+// host build of the esp_tinyusb storage calls spi_file.c uses
+typedef enum {
+    TINYUSB_MSC_EVENT_MOUNT_CHANGED,
+    TINYUSB_MSC_EVENT_PREMOUNT_CHANGED,
+} tinyusb_msc_event_type_t;
+
+typedef struct {
+    tinyusb_msc_event_type_t type;
+    struct {
+        bool is_mounted;
+    } mount_changed_data;
+} tinyusb_msc_event_t;
+
+typedef void (*tusb_msc_callback_t)(tinyusb_msc_event_t *event);
+
+bool tinyusb_msc_storage_in_use_by_usb_host(void);
+esp_err_t tinyusb_msc_register_callback(tinyusb_msc_event_type_t event_type, tusb_msc_callback_t callback);
+
+// host only: hands the storage to the USB host (true) or back to the application, runs the premount callback first
+void host_msc_hand_over(bool to_usb_host);
@@ -0,0 +1,136 @@
+/* Functional tests of the file access for the SPI master on a temporary directory: chunks written out of order as
+ * the link resends them, appending, path checks and handles closed when the storage goes to the USB host */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "tusb_msc_storage.h"
+#include "spi_file.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static char base[] = "/tmp/spi_file_XXXXXX";
+
+static SpiStatus open_file(const char *path, SpiFileMode mode, uint8_t *handle, uint32_t *size)
+{
+    return spi_file_open(path, strlen(path), mode, handle, size);
+}
+
+static SpiStatus write_at(uint8_t handle, uint32_t offset, const char *data, uint32_t *position)
+{
+    return spi_file_write(handle, offset, data, strlen(data), position);
+}
+
+// whole file as a string, the files here are short
+static const char *contents(const char *path)
+{
+    static char buf[256];
+    char name[256];
+    snprintf(name, sizeof(name), "%s/%s", base, path);
+    FILE *f = fopen(name, "rb");
+    if (f == NULL) {
+        return "";
+    }
+    const size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    buf[n] = '\0';
+    fclose(f);
+    return buf;
+}
+
+static void test_write_out_of_order(void)
+{
+    uint8_t h;
+    uint32_t size, position, written;
+    CHECK(open_file("write.txt", SpiFileWrite, &h, &size) == SpiOk);
+    CHECK(size == 0);
+    CHECK(write_at(h, 0, "0123", &position) == SpiOk && position == 4);
+    CHECK(write_at(h, 8, "89", &position) == SpiOk && position == 10); // 4..7 got lost and is resent
+    CHECK(write_at(h, 4, "4567", &position) == SpiOk && position == 8);
+    CHECK(spi_file_close(h, &written) == SpiOk && written == 10);
+    CHECK(strcmp(contents("write.txt"), "0123456789") == 0);
+}
+
+static void test_append(void)
+{
+    uint8_t h;
+    uint32_t size, position, written;
+    // a missing file is created
+    CHECK(open_file("append.txt", SpiFileAppend, &h, &size) == SpiOk);
+    CHECK(size == 0);
+    CHECK(write_at(h, 0, "abc", &position) == SpiOk && position == 3);
+    CHECK(spi_file_close(h, &written) == SpiOk);
+
+    CHECK(open_file("append.txt", SpiFileAppend, &h, &size) == SpiOk);
+    CHECK(size == 3);
+    CHECK(write_at(h, 3, "def", &position) == SpiOk && position == 6);
+    CHECK(write_at(h, 9, "jkl", &position) == SpiOk && position == 12); // 6..8 comes again later
+    CHECK(write_at(h, 6, "ghi", &position) == SpiOk && position == 9);
+    CHECK(spi_file_close(h, &written) == SpiOk && written == 9);
+    CHECK(strcmp(contents("append.txt"), "abcdefghijkl") == 0);
+
+    // the data in front of the append position stays as it is
+    uint32_t got;
+    char buf[16];
+    CHECK(open_file("append.txt", SpiFileRead, &h, &size) == SpiOk && size == 12);
+    CHECK(spi_file_read(h, 0, buf, sizeof(buf), &got) == SpiOk && got == 12 && memcmp(buf, "abcdefghijkl", 12) == 0);
+    CHECK(spi_file_close(h, &written) == SpiOk);
+}
+
+static void test_paths(void)
+{
+    uint8_t h;
+    uint32_t size;
+    spi_file_rsp_t rsp;
+    CHECK(open_file("../escape", SpiFileWrite, &h, &size) == SpiBadRequest);
+    CHECK(open_file("a/../../escape", SpiFileWrite, &h, &size) == SpiBadRequest);
+    CHECK(open_file("missing", SpiFileRead, &h, &size) == SpiNotFound);
+    CHECK(spi_file_stat("/write.txt", strlen("/write.txt"), &rsp) == SpiOk && rsp.value == 10);
+    CHECK(spi_file_stat("", 0, &rsp) == SpiOk && (rsp.flags & SPI_FILE_FLAG_DIR));
+}
+
+static void test_usb_host_takes_storage(void)
+{
+    uint8_t h;
+    uint32_t size, position, written;
+    CHECK(open_file("usb.txt", SpiFileWrite, &h, &size) == SpiOk);
+    CHECK(write_at(h, 0, "kept", &position) == SpiOk);
+    host_msc_hand_over(true);
+    CHECK(write_at(h, 4, "lost", &position) == SpiBadHandle);
+    CHECK(spi_file_close(h, &written) == SpiBadHandle);
+    CHECK(open_file("usb.txt", SpiFileRead, &h, &size) == SpiBusy);
+    host_msc_hand_over(false);
+    CHECK(strcmp(contents("usb.txt"), "kept") == 0); // closing flushed what was written before
+}
+
+int main(void)
+{
+    if (mkdtemp(base) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    CHECK(spi_file_init(base) == ESP_OK);
+    test_write_out_of_order();
+    test_append();
+    test_paths();
+    test_usb_host_takes_storage();
+
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", base);
+    if (system(cmd) != 0) {
+        fprintf(stderr, "could not remove %s\n", base);
+    }
+    if (failures) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("spi_file: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,102 @@
+/* Throughput of the SPI interface by request size
+ *
+ * Streams FileRead answers of different sizes from the slave (spi_task, the bulk worker reading the file, main/spi_api.c)
+ * to the simulated master and reports, for spi_task only (frame checks, dispatch, picking up the staged chunk, copy
+ * into the resend ring, from spi_slave_get_trans_result() returning the transaction to queueing it again), frames per
+ * second, payload bytes per second and the time per frame. These are CPU limits of the slave code on the host, the SPI
+ * clock is not modelled. With a budget in ns as argument the run fails if the average time per frame of any size is
+ * above it, so latency regressions show up in ctest.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "host_spi.h"
+#include "sim.h"
+
+#define FILE_LEN (1024 * 1024)
+
+static uint8_t open_file(sim_master_t *master, const char *base_path, const uint8_t *data)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/bench.bin", base_path);
+    FILE *f = fopen(path, "wb");
+    if (f == NULL || fwrite(data, 1, FILE_LEN, f) != FILE_LEN) {
+        perror(path);
+        exit(1);
+    }
+    fclose(f);
+    spi_file_rsp_t rsp = {0};
+    uint32_t got = 0;
+    if (!sim_request(master, FileOpen, SpiFileRead, "bench.bin", 9, (uint8_t *)&rsp, sizeof(rsp), &got, 100000)
+        || rsp.status != SpiOk) {
+        fprintf(stderr, "FileOpen failed\n");
+        exit(1);
+    }
+    return rsp.handle;
+}
+
+int main(int argc, char **argv)
+{
+    const double budget_ns = argc > 1 ? atof(argv[1]) : 0;
+    const uint32_t sizes[] = { 16, 256, 1024, 4096, 65536, FILE_LEN };
+    const uint16_t frames[] = { 256, SPI_MAX_FRAME_SIZE };
+    uint8_t *file = malloc(FILE_LEN);
+    uint8_t *answer = malloc(FILE_LEN);
+    for (uint32_t i = 0; i < FILE_LEN; i++) {
+        file[i] = i * 31;
+    }
+    const char *base_path = sim_start();
+    sim_master_t master;
+    sim_master_init(&master, 0, 1);
+    if (sim_hello(&master, SPI_MAX_FRAME_SIZE) == 0) {
+        fprintf(stderr, "no answer to Hello\n");
+        return 1;
+    }
+    const uint8_t handle = open_file(&master, base_path, file);
+    int over = 0;
+
+    printf("%6s %9s %8s %10s %12s %10s %10s %8s\n", "frame", "request", "repeats", "frames", "frames/s", "MB/s",
+           "avg ns", "max ns");
+    for (size_t f = 0; f < sizeof(frames) / sizeof(frames[0]); f++) {
+        if (sim_hello(&master, frames[f]) != frames[f]) {
+            fprintf(stderr, "frame size %u not taken\n", frames[f]);
+            return 1;
+        }
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            // about 8MB per size, at least 16 and at most 2000 requests
+            uint32_t repeats = 8u * 1024 * 1024 / sizes[i];
+            repeats = repeats < 16 ? 16 : (repeats > 2000 ? 2000 : repeats);
+            sim_drain(&master, 100000);
+            host_spi_stats_t stats;
+            host_spi_stats(&stats, true);
+            uint64_t bytes = 0;
+            bool ok = true;
+            for (uint32_t r = 0; r < repeats && ok; r++) {
+                const spi_file_read_req_t req = { .offset = 0, .length = sizes[i] };
+                uint32_t got = 0;
+                ok = sim_request(&master, FileRead, handle, &req, sizeof(req), answer, FILE_LEN, &got, 10000000)
+                     && got == sizes[i];
+                bytes += got;
+            }
+            if (!ok) {
+                fprintf(stderr, "request of %u bytes failed\n", (unsigned)sizes[i]);
+                return 1;
+            }
+            host_spi_stats(&stats, true);
+            const double avg_ns = (double)stats.ns_total / stats.steps;
+            const double seconds = stats.ns_total / 1e9;
+            printf("%6u %9u %8u %10llu %12.0f %10.1f %10.0f %8llu\n", frames[f], (unsigned)sizes[i], (unsigned)repeats,
+                   (unsigned long long)stats.steps, stats.steps / seconds, bytes / seconds / 1e6, avg_ns,
+                   (unsigned long long)stats.ns_max);
+            if (budget_ns > 0 && avg_ns > budget_ns) {
+                fprintf(stderr, "frame %u, request %u: %.0f ns per frame, budget %.0f ns\n", frames[f],
+                        (unsigned)sizes[i], avg_ns, budget_ns);
+                over++;
+            }
+        }
+    }
+    free(file);
+    free(answer);
+    return over ? 1 : 0;
+}
@@ -0,0 +1,173 @@
+/* Fuzz target for the SPI interface: random frames from the master into the slave (spi_task, the workers and their
+ * handlers, main/spi_api.c) through the mock SPI slave driver
+ *
+ * Input is a sequence of records [flags, length (u16 le), bytes]. Every record is one frame of `length` bytes
+ * (cut to SPI_MAX_FRAME_SIZE) in a receive buffer of exactly that size, so AddressSanitizer reports any read past the
+ * bytes that were actually received. Flag bit 0 fixes up the crc, so the fuzzer gets past the crc check into request
+ * handling; bit 1 clocks a Hello first, the master starting over. After every frame the answer spi_task armed is
+ * checked: it has to be a whole frame with a valid crc inside its buffer. A frame taking spi_task longer than
+ * SPI_FUZZ_MAX_STEP_US aborts as a latency regression. At the end of an input the master clocks idle frames until
+ * the handshake falls, a request that never finishes aborts.
+ *
+ * libFuzzer: configure with -DSPI_LIBFUZZER=ON (clang). Otherwise the standalone driver runs the files given as
+ * arguments (AFL: afl-fuzz -i in -o out -- ./fuzz_spi_link @@) or, without arguments, a fixed number of random
+ * inputs (ctest smoke run).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_rom_crc.h"
+#include "host_spi.h"
+#include "sim.h"
+
+#ifndef SPI_FUZZ_MAX_STEP_US
+#define SPI_FUZZ_MAX_STEP_US 20000 // generous, sanitizers slow everything down
+#endif
+#define SPI_FUZZ_DRAIN 100000 // idle frames at the end of an input for the last requests to finish
+
+static sim_master_t master;
+
+static void check_armed(const uint8_t *tx)
+{
+    spi_frame_header_t hdr;
+    memcpy(&hdr, tx, SPI_HEADER_SIZE);
+    if (hdr.magic[0] != SPI_MAGIC_0 || hdr.magic[1] != SPI_MAGIC_1 || SPI_HEADER_SIZE + hdr.length > SPI_MAX_FRAME_SIZE) {
+        fprintf(stderr, "armed frame is broken\n");
+        abort();
+    }
+    const uint32_t crc = hdr.crc;
+    uint8_t copy[SPI_MAX_FRAME_SIZE];
+    memcpy(copy, tx, SPI_HEADER_SIZE + hdr.length);
+    ((spi_frame_header_t *)copy)->crc = 0;
+    if (esp_rom_crc32_le(0, copy, SPI_HEADER_SIZE + hdr.length) != crc) {
+        fprintf(stderr, "armed frame has a bad crc\n");
+        abort();
+    }
+}
+
+static void clock_frame(const uint8_t *rx, size_t len)
+{
+    host_spi_clock(rx, len);
+    const uint8_t *tx = host_spi_settle();
+    host_spi_stats_t stats;
+    host_spi_stats(&stats, false);
+    if (stats.ns_last / 1000 > SPI_FUZZ_MAX_STEP_US) {
+        fprintf(stderr, "frame took %llu us, limit %d us\n", (unsigned long long)(stats.ns_last / 1000),
+                SPI_FUZZ_MAX_STEP_US);
+        abort();
+    }
+    check_armed(tx);
+}
+
+static void hello(void)
+{
+    uint8_t frame[SPI_HEADER_SIZE + sizeof(spi_hello_req_t)];
+    const spi_hello_req_t req = { .max_frame = SPI_MAX_FRAME_SIZE };
+    sim_frame(frame, Hello, 0, 0, ++master.seq, 0, &req, sizeof(req));
+    clock_frame(frame, sizeof(frame));
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    sim_start();
+    while (size >= 3) {
+        const uint8_t flags = data[0];
+        size_t len = data[1] | (data[2] << 8);
+        data += 3;
+        size -= 3;
+        len = len < size ? len : size;
+        len = len < SPI_MAX_FRAME_SIZE ? len : SPI_MAX_FRAME_SIZE;
+
+        uint8_t *rx = malloc(len ? len : 1);
+        memcpy(rx, data, len);
+        data += len;
+        size -= len;
+        if ((flags & 1) && len >= SPI_HEADER_SIZE) {
+            spi_frame_header_t *hdr = (spi_frame_header_t *)rx;
+            const size_t covered = SPI_HEADER_SIZE + hdr->length <= len ? SPI_HEADER_SIZE + hdr->length : len;
+            hdr->crc = 0;
+            hdr->crc = esp_rom_crc32_le(0, rx, covered);
+        }
+        if (flags & 2) {
+            hello();
+        }
+        clock_frame(rx, len);
+        free(rx);
+    }
+    if (!sim_drain(&master, SPI_FUZZ_DRAIN)) {
+        fprintf(stderr, "handshake still up after %d idle frames\n", SPI_FUZZ_DRAIN);
+        abort();
+    }
+    return 0;
+}
+
+#ifndef SPI_LIBFUZZER
+static int run_file(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return 1;
+    }
+    static uint8_t buf[1 << 20];
+    const size_t n = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    return LLVMFuzzerTestOneInput(buf, n);
+}
+
+// random records, half of them with a valid crc and a header that looks like a request
+static void run_random(uint32_t runs)
+{
+    static uint8_t buf[16 * 1024];
+    uint32_t x = 0x9E3779B9;
+    for (uint32_t r = 0; r < runs; r++) {
+        size_t used = 0;
+        while (used + 3 + SPI_MAX_FRAME_SIZE < sizeof(buf)) {
+            x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+            const size_t len = x % (x & 1 ? 64 : SPI_MAX_FRAME_SIZE + 16);
+            buf[used] = (x >> 8) & 1;
+            buf[used + 1] = len & 0xFF;
+            buf[used + 2] = len >> 8;
+            for (size_t i = 0; i < len; i++) {
+                x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+                buf[used + 3 + i] = x;
+            }
+            if (buf[used] && len >= SPI_HEADER_SIZE) {
+                spi_frame_header_t *hdr = (spi_frame_header_t *)(buf + used + 3);
+                hdr->magic[0] = SPI_MAGIC_0;
+                hdr->magic[1] = SPI_MAGIC_1;
+                static const uint8_t types[] = {
+                    Idle, Hello, Calibrate, GetStats, GetEvents, GetFirmwareInfo, FileOpen, FileRead, FileWrite,
+                    FileClose, FileStat, FileList, OtaBegin, OtaWrite, OtaStatus, SetCalibration, GetCalibration, 0x7F,
+                };
+                hdr->type = types[(x >> 3) % sizeof(types)];
+                hdr->flags &= SPI_FLAG_NAK;
+                if ((x >> 12) & 1) {
+                    hdr->length = len - SPI_HEADER_SIZE - ((x >> 13) & 3) * ((x >> 15) & 1);
+                }
+            }
+            used += 3 + len;
+            if ((x >> 20) % 8 == 0) {
+                break;
+            }
+        }
+        LLVMFuzzerTestOneInput(buf, used);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            if (run_file(argv[i]) != 0) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    run_random(2000);
+    printf("fuzz smoke run done\n");
+    return 0;
+}
+#endif
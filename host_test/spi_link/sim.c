@@ -0,0 +1,395 @@
+#define _GNU_SOURCE // nftw with FTW_DEPTH
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "esp_rom_crc.h"
+#include "host_spi.h"
+#include "spi_api.h"
+#include "sim.h"
+
+#define SIM_NAK_TRIES 3 // per missing frame, the slave answers a NAK for a frame that left its ring with an idle frame
+#define STREAM_TYPE(type) ((type) == FileRead || (type) == FileList || (type) == GetFirmwareInfo || (type) == GetStats)
+
+uint64_t sim_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+uint16_t sim_frame(uint8_t *frame, RequestType type, uint8_t arg, uint8_t flags, uint8_t seq, uint8_t ack,
+                   const void *payload, uint16_t length)
+{
+    spi_frame_header_t *hdr = (spi_frame_header_t *)frame;
+    memset(hdr, 0, SPI_HEADER_SIZE);
+    hdr->magic[0] = SPI_MAGIC_0;
+    hdr->magic[1] = SPI_MAGIC_1;
+    hdr->type = type;
+    hdr->arg = arg;
+    hdr->length = length;
+    hdr->flags = flags;
+    hdr->seq = seq;
+    hdr->ack = ack;
+    if (length) {
+        memcpy(frame + SPI_HEADER_SIZE, payload, length);
+    }
+    hdr->crc = esp_rom_crc32_le(0, frame, SPI_HEADER_SIZE + length);
+    return SPI_HEADER_SIZE + length;
+}
+
+/* wire */
+
+static uint32_t rng_next(uint32_t *x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 17;
+    *x ^= *x << 5;
+    return *x;
+}
+
+static void flip_bits(void *ctx, uint8_t *data, size_t len)
+{
+    sim_master_t *master = ctx;
+    if (master->ber <= 0) {
+        return;
+    }
+    // distance to the next flipped bit, geometric
+    const uint32_t every = (uint32_t)(1.0 / master->ber);
+    for (uint64_t bit = rng_next(&master->rng) % (2 * every); bit < len * 8; bit += 1 + rng_next(&master->rng) % (2 * every)) {
+        data[bit / 8] ^= 1u << (bit % 8);
+    }
+}
+
+size_t sim_transmit(sim_master_t *master, const uint8_t *mosi, uint8_t *miso)
+{
+    host_spi_set_noise(master->ber > 0 ? flip_bits : NULL, master);
+    const size_t clocked = host_spi_transfer(mosi, miso);
+    master->exchanges++;
+    master->bytes_clocked += clocked;
+    return clocked;
+}
+
+/* slave */
+
+static char base_path[] = "/tmp/spi_link_XXXXXX";
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+static void remove_base_path(void)
+{
+    nftw(base_path, remove_entry, 8, FTW_DEPTH | FTW_PHYS);
+}
+
+const char *sim_start(void)
+{
+    static bool started;
+    if (!started) {
+        if (mkdtemp(base_path) == NULL) {
+            perror("mkdtemp");
+            exit(1);
+        }
+        atexit(remove_base_path);
+        spi_start(base_path, NULL);
+        started = true;
+    }
+    return base_path;
+}
+
+/* master */
+
+void sim_master_init(sim_master_t *master, double ber, uint32_t seed)
+{
+    memset(master, 0, sizeof(*master));
+    master->frame_size = SPI_MAX_FRAME_SIZE;
+    master->lines = 4;
+    master->ber = ber;
+    master->rng = seed ? seed : 1;
+}
+
+static bool frame_ok(const uint8_t *frame, size_t clocked)
+{
+    spi_frame_header_t hdr;
+    memcpy(&hdr, frame, SPI_HEADER_SIZE);
+    if (hdr.magic[0] != SPI_MAGIC_0 || hdr.magic[1] != SPI_MAGIC_1 || SPI_HEADER_SIZE + hdr.length > clocked) {
+        return false;
+    }
+    uint8_t copy[SPI_MAX_FRAME_SIZE];
+    memcpy(copy, frame, SPI_HEADER_SIZE + hdr.length);
+    ((spi_frame_header_t *)copy)->crc = 0;
+    return esp_rom_crc32_le(0, copy, SPI_HEADER_SIZE + hdr.length) == hdr.crc;
+}
+
+typedef struct {
+    uint8_t *data;
+    uint32_t max;
+    uint32_t base;      // offset of the first chunk (FileRead offset)
+    uint32_t got;
+    uint32_t end;       // of the stream, known with the last chunk
+    bool last;          // the last chunk came in
+    bool done;
+    uint32_t expect;    // where the next chunk in stream order starts
+    uint32_t holes[16][2]; // chunks lost for good, [from, to)
+    int hole_count;
+} answer_t;
+
+static void take_answer(const sim_master_t *master, const uint8_t *frame, answer_t *answer)
+{
+    const spi_frame_header_t *hdr = (const spi_frame_header_t *)frame;
+    const uint8_t *payload = frame + SPI_HEADER_SIZE;
+    if (hdr->ref != master->seq || answer->done) {
+        return;
+    }
+    if (!STREAM_TYPE(hdr->type)) {
+        answer->got = hdr->length < answer->max ? hdr->length : answer->max;
+        memcpy(answer->data, payload, answer->got);
+        answer->done = true;
+        return;
+    }
+    spi_chunk_t chunk;
+    if (hdr->length < sizeof(chunk)) {
+        return;
+    }
+    memcpy(&chunk, payload, sizeof(chunk));
+    const uint32_t len = hdr->length - sizeof(chunk);
+    if (len == 0 && (chunk.flags & SPI_CHUNK_LAST)) {
+        answer->done = true; // empty stream, e.g. a read past the end
+        return;
+    }
+    const uint32_t at = chunk.offset - answer->base;
+    if (chunk.offset < answer->base || at > answer->max || len > answer->max - at) {
+        return; // not ours, the tests size their buffers for the whole answer
+    }
+    memcpy(answer->data + at, payload + sizeof(chunk), len);
+    answer->got += len;
+    if (at > answer->expect && answer->hole_count < 16) {
+        answer->holes[answer->hole_count][0] = answer->expect;
+        answer->holes[answer->hole_count++][1] = at;
+    }
+    if (at >= answer->expect) {
+        answer->expect = at + len;
+    } else {
+        // a resent chunk, it fills (part of) a hole
+        for (int i = 0; i < answer->hole_count; i++) {
+            uint32_t *hole = answer->holes[i];
+            if (at >= hole[0] && at + len <= hole[1]) {
+                const uint32_t to = hole[1];
+                hole[1] = at;
+                if (at + len < to && answer->hole_count < 16) {
+                    answer->holes[answer->hole_count][0] = at + len;
+                    answer->holes[answer->hole_count++][1] = to;
+                }
+                if (hole[0] == hole[1]) {
+                    memcpy(hole, answer->holes[--answer->hole_count], sizeof(answer->holes[0]));
+                }
+                break;
+            }
+        }
+    }
+    if (chunk.flags & SPI_CHUNK_LAST) {
+        answer->end = at + len;
+        answer->last = true;
+        answer->done = chunk.status != SpiOk;
+    }
+    answer->done = answer->done || (answer->last && answer->got >= answer->end);
+}
+
+/* The slave resends only frames still in its ring, a burst of lost frames in a stream is gone for good: the master
+ * asks for the lost ranges of a FileRead again and for any other (short) stream the whole answer. Returns true if the
+ * answer is complete afterwards.
+ */
+static bool fetch_lost(sim_master_t *master, RequestType type, uint8_t arg, const void *payload, uint16_t length,
+                       answer_t *answer, uint32_t max_exchanges)
+{
+    uint32_t got = 0;
+    if (type != FileRead) {
+        if (!sim_request(master, type, arg, payload, length, answer->data, answer->max, &got, max_exchanges)) {
+            return false;
+        }
+        answer->got = got;
+        return answer->done = true;
+    }
+    spi_file_read_req_t req;
+    memcpy(&req, payload, sizeof(req));
+    for (int i = 0; i < answer->hole_count; i++) {
+        const uint32_t *hole = answer->holes[i];
+        const spi_file_read_req_t part = { .offset = answer->base + hole[0], .length = hole[1] - hole[0] };
+        if (!sim_request(master, FileRead, arg, &part, sizeof(part), answer->data + hole[0], answer->max - hole[0],
+                         &got, max_exchanges)) {
+            return false;
+        }
+        answer->got += got;
+    }
+    answer->hole_count = 0;
+    if (!answer->last) {
+        // the end of the stream got lost as well, the rest up to the length asked for or the end of the file
+        const spi_file_read_req_t rest = {
+            .offset = answer->base + answer->expect,
+            .length = req.length ? req.length - answer->expect : 0,
+        };
+        if (!sim_request(master, FileRead, arg, &rest, sizeof(rest), answer->data + answer->expect,
+                         answer->max - answer->expect, &got, max_exchanges)) {
+            return false;
+        }
+        answer->got += got;
+        answer->end = answer->expect + got;
+        answer->last = true;
+    }
+    return answer->done = answer->got >= answer->end;
+}
+
+// looks at one frame from the slave, returns true if it brought the answer further
+static bool master_receive(sim_master_t *master, const uint8_t *miso, size_t clocked, answer_t *answer,
+                           int *resend)
+{
+    if (!frame_ok(miso, clocked)) {
+        master->corrupted++;
+        master->nak_pending = true;
+        return false;
+    }
+    const spi_frame_header_t *hdr = (const spi_frame_header_t *)miso;
+    if (!master->synced && !(hdr->flags & SPI_FLAG_NAK)) {
+        // the slave keeps numbering its data frames across masters, an idle frame carries the last one sent
+        master->rx_next = hdr->type == Idle ? hdr->seq + 1 : hdr->seq;
+        master->synced = true;
+    }
+    if (hdr->flags & SPI_FLAG_NAK) {
+        *resend = hdr->ack;
+        return false;
+    }
+    if (hdr->type == Idle) {
+        return false;
+    }
+    const int8_t ahead = (int8_t)(hdr->seq - master->rx_next);
+    if (ahead < 0) {
+        // resent frame that was missing, or a duplicate
+        bool wanted = false;
+        for (int i = 0; i < master->missing_count; i++) {
+            if (master->missing[i] == hdr->seq) {
+                master->missing[i] = master->missing[--master->missing_count];
+                wanted = true;
+                break;
+            }
+        }
+        if (!wanted) {
+            return false;
+        }
+    } else {
+        for (uint8_t seq = master->rx_next; seq != hdr->seq && master->missing_count < 16; seq++) {
+            master->missing[master->missing_count++] = seq;
+        }
+        master->rx_next = hdr->seq + 1;
+    }
+    const uint32_t before = answer->got;
+    take_answer(master, miso, answer);
+    return answer->got != before || answer->done;
+}
+
+bool sim_request(sim_master_t *master, RequestType type, uint8_t arg, const void *payload, uint16_t length,
+                 uint8_t *answer_data, uint32_t max, uint32_t *got, uint32_t max_exchanges)
+{
+    uint8_t mosi[SPI_MAX_FRAME_SIZE];
+    uint8_t miso[SPI_MAX_FRAME_SIZE];
+    answer_t answer = { .data = answer_data, .max = max };
+    if (type == FileRead && length >= sizeof(uint32_t)) {
+        memcpy(&answer.base, payload, sizeof(uint32_t));
+    }
+
+    master->seq++;
+    uint8_t *request = master->sent[master->seq % SPI_RETX_FRAMES];
+    sim_frame(request, type, arg, 0, master->seq, master->rx_next - 1, payload, length);
+    memcpy(mosi, request, SPI_HEADER_SIZE + length);
+
+    uint32_t quiet = 0;
+    uint64_t last_nak = 0;
+    int nak_seq = -1;
+    int nak_tries = 0;
+    for (uint32_t n = 0; n < max_exchanges && !answer.done; n++) {
+        int resend = -1;
+        const size_t clocked = sim_transmit(master, mosi, miso);
+        if (master->stall_us) {
+            usleep(master->stall_us);
+            master->stall_us = 0;
+        }
+        if (master_receive(master, miso, clocked, &answer, &resend)) {
+            quiet = 0;
+        } else if (++quiet % 64 == 0) {
+            resend = master->seq; // nothing came back, the request or its NAK got lost
+        } else if (quiet > SPI_QUEUE_DEPTH) {
+            usleep(10); // the worker is still at it, poll like the master does
+        }
+        // chunks lost for good: once the stream ended, or went quiet after it started
+        if (STREAM_TYPE(type) && !answer.done && master->missing_count == 0
+            && ((answer.last && answer.hole_count) || (!answer.last && answer.got && quiet >= 256))) {
+            fetch_lost(master, type, arg, payload, length, &answer, max_exchanges - n);
+            break;
+        }
+
+        // next frame: a resend the slave asked for, a NAK for a missing frame or an idle frame
+        const uint8_t *old = master->sent[(uint8_t)resend % SPI_RETX_FRAMES];
+        if (resend >= 0 && ((const spi_frame_header_t *)old)->seq == (uint8_t)resend && (uint8_t)resend == master->seq) {
+            memcpy(mosi, old, SPI_HEADER_SIZE + ((const spi_frame_header_t *)old)->length);
+            master->resends++;
+        } else if (master->missing_count && master->exchanges - last_nak > SPI_QUEUE_DEPTH) {
+            // the resent frame shows up behind the frames armed meanwhile, ask once per queue depth
+            if (master->missing[0] != nak_seq) {
+                nak_seq = master->missing[0];
+                nak_tries = 0;
+            }
+            if (++nak_tries > SIM_NAK_TRIES) {
+                // left the slave's ring, the stream has a hole now
+                master->missing[0] = master->missing[--master->missing_count];
+                master->lost++;
+                nak_seq = -1;
+                sim_frame(mosi, Idle, 0, 0, master->seq, master->rx_next - 1, NULL, 0);
+            } else {
+                sim_frame(mosi, Idle, 0, SPI_FLAG_NAK, master->seq, master->missing[0], NULL, 0);
+                master->naks_sent++;
+            }
+            last_nak = master->exchanges;
+        } else if (master->nak_pending) {
+            sim_frame(mosi, Idle, 0, SPI_FLAG_NAK, master->seq, master->rx_next, NULL, 0);
+            master->naks_sent++;
+        } else {
+            sim_frame(mosi, Idle, 0, 0, master->seq, master->rx_next - 1, NULL, 0);
+        }
+        master->nak_pending = false;
+    }
+    *got = answer.got < max ? answer.got : max;
+    return answer.done;
+}
+
+uint16_t sim_hello(sim_master_t *master, uint16_t max_frame)
+{
+    const spi_hello_req_t req = { .max_frame = max_frame, .lines = master->lines };
+    spi_hello_rsp_t rsp = {0};
+    uint32_t got = 0;
+    if (!sim_request(master, Hello, 0, &req, sizeof(req), (uint8_t *)&rsp, sizeof(rsp), &got, 10000)
+        || got != sizeof(rsp)) {
+        return 0;
+    }
+    master->frame_size = rsp.frame;
+    master->lines = rsp.lines;
+    return rsp.frame;
+}
+
+bool sim_drain(sim_master_t *master, uint32_t max_exchanges)
+{
+    uint8_t mosi[SPI_MAX_FRAME_SIZE];
+    uint8_t miso[SPI_MAX_FRAME_SIZE];
+    for (uint32_t n = 0; n < max_exchanges; n++) {
+        host_spi_settle();
+        if (!host_spi_handshake()) {
+            return true;
+        }
+        sim_frame(mosi, Idle, 0, 0, master->seq, master->rx_next - 1, NULL, 0);
+        sim_transmit(master, mosi, miso);
+        usleep(10);
+    }
+    return false;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "spi_link.h"
+
+/* Simulated RP2350 master for host tests of the SPI interface
+ *
+ * The slave is the firmware code: sim_start() runs spi_start() (main/spi_api.c) with spi_task, the workers and their
+ * handlers on a temporary directory as storage. Frames go through the mock SPI slave driver
+ * (host_test/mock/host_spi.h), sim_transmit() is one transfer with CS asserted: the master clocks its frame and, in the same transfer, the frame
+ * armed in the oldest queued transaction (on the half duplex driver a write and a read). sim_master_t numbers requests, NAKs corrupted frames, resends what the slave
+ * NAKs and puts chunk streams together, asking again for chunks that dropped out of the slave's resend ring. Both
+ * directions can get bit errors on the wire.
+ */
+
+typedef struct {
+    uint16_t frame_size;
+    uint8_t lines;          // data lines sim_hello() asks for, then the ones the slave granted
+    uint8_t seq;            // last request sent
+    uint8_t rx_next;        // next slave data frame expected
+    bool synced;            // rx_next taken from the slave's first frame
+    uint8_t sent[SPI_RETX_FRAMES][SPI_MAX_FRAME_SIZE]; // requests kept for resend, by seq
+    uint8_t missing[16];    // slave frames to NAK
+    int missing_count;
+    bool nak_pending;       // a corrupted frame came in
+    double ber;             // bit error rate on MOSI and MISO
+    uint32_t rng;
+    uint32_t stall_us;      // the next request stops clocking this long after its first frame
+    // counters
+    uint64_t exchanges;
+    uint64_t bytes_clocked;
+    uint32_t naks_sent;
+    uint32_t resends;
+    uint32_t corrupted;
+    uint32_t lost;          // slave frames given up on, their data was asked for again
+} sim_master_t;
+
+// starts the slave, once per process. Returns the directory the file requests work below.
+const char *sim_start(void);
+
+// one transfer: mosi holds the master's frame, miso gets what the slave clocked out, returns the bytes clocked
+size_t sim_transmit(sim_master_t *master, const uint8_t *mosi, uint8_t *miso);
+
+void sim_master_init(sim_master_t *master, double ber, uint32_t seed);
+
+// sends a request and collects its answer: the payload of a single frame answer or the data of a chunk stream.
+// Returns false if the answer did not complete within max_exchanges transfers.
+bool sim_request(sim_master_t *master, RequestType type, uint8_t arg, const void *payload, uint16_t length,
+                 uint8_t *answer, uint32_t max, uint32_t *got, uint32_t max_exchanges);
+
+// Hello, the first request of every master: the slave takes the master's numbering from it. Returns the frame size
+// the slave agreed to, 0 if there was no answer.
+uint16_t sim_hello(sim_master_t *master, uint16_t max_frame);
+
+// clocks idle frames until the handshake is low, false if it did not fall within max_exchanges
+bool sim_drain(sim_master_t *master, uint32_t max_exchanges);
+
+// frame with a valid crc, returns its length
+uint16_t sim_frame(uint8_t *frame, RequestType type, uint8_t arg, uint8_t flags, uint8_t seq, uint8_t ack,
+                   const void *payload, uint16_t length);
+
+uint64_t sim_now_ns(void);
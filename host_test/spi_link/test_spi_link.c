@@ -0,0 +1,474 @@
+/* Functional tests of the SPI interface: the simulated master against spi_task, the workers and their handlers
+ * (main/spi_api.c), clean and with bit errors on the wire. test_link_rules drives the link layer directly.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_system.h"
+#include "host_storage.h"
+#include "host_spi.h"
+#include "spi_events.h"
+#include "sim.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+#define FILE_LEN (200 * 1024)
+#define EXCHANGES 100000 // guards against a request that never completes, not a latency limit
+static uint8_t file[FILE_LEN];
+static uint8_t answer[FILE_LEN];
+
+static void fill_file(const char *base_path)
+{
+    uint32_t x = 0x12345678;
+    for (int i = 0; i < FILE_LEN; i++) {
+        x = x * 1103515245u + 12345u;
+        file[i] = x >> 24;
+    }
+    char path[256];
+    snprintf(path, sizeof(path), "%s/data.bin", base_path);
+    FILE *f = fopen(path, "wb");
+    CHECK(f && fwrite(file, 1, FILE_LEN, f) == FILE_LEN);
+    if (f) {
+        fclose(f);
+    }
+}
+
+static bool request(sim_master_t *master, RequestType type, uint8_t arg, const void *payload, uint16_t length,
+                    void *dst, uint32_t max, uint32_t *got)
+{
+    uint32_t ignored;
+    return sim_request(master, type, arg, payload, length, dst, max, got ? got : &ignored, EXCHANGES);
+}
+
+// link counters from GetStats, reset afterwards with reset
+static spi_stats_t link_stats(sim_master_t *master, bool reset)
+{
+    spi_stats_t stats = {0};
+    uint32_t got = 0;
+    CHECK(request(master, GetStats, reset, NULL, 0, answer, sizeof(answer), &got));
+    CHECK(got > sizeof(stats));
+    memcpy(&stats, answer, sizeof(stats));
+    return stats;
+}
+
+static uint8_t file_open(sim_master_t *master, const char *path, SpiFileMode mode, uint32_t *size)
+{
+    spi_file_rsp_t rsp = {0};
+    CHECK(request(master, FileOpen, mode, path, strlen(path), &rsp, sizeof(rsp), NULL));
+    CHECK(rsp.status == SpiOk);
+    *size = rsp.value;
+    return rsp.handle;
+}
+
+static bool read_file(sim_master_t *master, uint8_t handle, uint32_t offset, uint32_t length, uint32_t *got)
+{
+    const spi_file_read_req_t req = { .offset = offset, .length = length };
+    return request(master, FileRead, handle, &req, sizeof(req), answer, sizeof(answer), got);
+}
+
+static void test_hello(void)
+{
+    sim_master_t master;
+    sim_master_init(&master, 0, 1);
+
+    CHECK(sim_hello(&master, 512) == 512);
+    spi_firmware_info_t info = {0};
+    CHECK(request(&master, GetFirmwareInfo, 1, NULL, 0, &info, sizeof(info), NULL));
+    CHECK(info.frame == 512);
+    CHECK(strcmp(info.ota, "ota0") == 0);
+    uint32_t got = 0;
+    memset(answer, 0, sizeof(answer));
+    CHECK(request(&master, GetFirmwareInfo, 0, NULL, 0, answer, sizeof(answer) - 1, &got));
+    CHECK(strstr((const char *)answer, "\"SPI\": {\"FRAME\": 512,") != NULL);
+
+    // data lines: never more than asked for, more than 1 only on the half duplex driver
+#ifdef CONFIG_SPI_API_QUAD
+    CHECK(master.lines == 4);
+    master.lines = 3;
+    CHECK(sim_hello(&master, 512) == 512);
+    CHECK(master.lines == 2);
+#else
+    CHECK(master.lines == 1);
+#endif
+    // a master that leaves lines out gets 1
+    const uint16_t max_frame = 512;
+    spi_hello_rsp_t rsp = {0};
+    CHECK(request(&master, Hello, 0, &max_frame, sizeof(max_frame), &rsp, sizeof(rsp), NULL));
+    CHECK(rsp.version == SPI_PROTOCOL_VERSION && rsp.frame == 512 && rsp.lines == 1);
+
+    // below the minimum the slave keeps SPI_MIN_FRAME_SIZE
+    CHECK(sim_hello(&master, 8) == SPI_MIN_FRAME_SIZE);
+    CHECK(sim_drain(&master, EXCHANGES));
+}
+
+static void test_file_read(uint16_t frame, double ber)
+{
+    sim_master_t master;
+    sim_master_init(&master, ber, 7);
+    CHECK(sim_hello(&master, frame) == frame);
+    link_stats(&master, true);
+
+    uint32_t size = 0;
+    const uint8_t handle = file_open(&master, "data.bin", SpiFileRead, &size);
+    CHECK(size == FILE_LEN);
+
+    uint32_t got = 0;
+    memset(answer, 0, sizeof(answer));
+    CHECK(read_file(&master, handle, 0, 0, &got));
+    CHECK(got == FILE_LEN);
+    CHECK(memcmp(answer, file, FILE_LEN) == 0);
+
+    memset(answer, 0, sizeof(answer));
+    CHECK(read_file(&master, handle, 1000, 5000, &got));
+    CHECK(got == 5000);
+    CHECK(memcmp(answer, file + 1000, 5000) == 0);
+
+    // past the end of the file: one empty last chunk
+    CHECK(read_file(&master, handle, FILE_LEN + 10, 100, &got));
+    CHECK(got == 0);
+
+    spi_file_rsp_t rsp = {0};
+    CHECK(request(&master, FileClose, handle, NULL, 0, &rsp, sizeof(rsp), NULL));
+    CHECK(rsp.status == SpiOk);
+
+    const spi_stats_t stats = link_stats(&master, false);
+    if (ber > 0) {
+        CHECK(master.corrupted > 0);
+        printf("frame %u, ber %g: %llu exchanges, master saw %u corrupted and lost %u, slave %u crc errors, %u resends\n",
+               frame, ber, (unsigned long long)master.exchanges, master.corrupted, master.lost, stats.crc_errors,
+               stats.resends);
+    } else {
+        CHECK(master.corrupted == 0);
+        CHECK(stats.crc_errors == 0);
+        CHECK(stats.resends == 0);
+    }
+    CHECK(sim_drain(&master, EXCHANGES));
+}
+
+static void test_calibrate(void)
+{
+    sim_master_t master;
+    sim_master_init(&master, 0, 1);
+    CHECK(sim_hello(&master, SPI_MAX_FRAME_SIZE) == SPI_MAX_FRAME_SIZE);
+
+    uint8_t req[SPI_MAX_PAYLOAD];
+    const spi_calib_req_t calib = { .seed = 42, .length = 600 };
+    memcpy(req, &calib, sizeof(calib));
+    spi_calib_pattern(calib.seed, req + sizeof(calib), 600);
+    CHECK(request(&master, Calibrate, 0, req, sizeof(calib) + 600, answer, sizeof(answer), NULL));
+    spi_calib_rsp_t rsp;
+    memcpy(&rsp, answer, sizeof(rsp));
+    CHECK(rsp.seed == 42);
+    CHECK(rsp.length == 600);
+    CHECK(rsp.mismatches == 0);
+    CHECK(memcmp(answer + sizeof(rsp), req + sizeof(calib), 600) == 0);
+
+    // a damaged pattern that got past the crc is counted
+    req[sizeof(calib) + 3] ^= 0xFF;
+    CHECK(request(&master, Calibrate, 0, req, sizeof(calib) + 600, answer, sizeof(answer), NULL));
+    memcpy(&rsp, answer, sizeof(rsp));
+    CHECK(rsp.mismatches == 1);
+
+    // the echo is cut to the frame size
+    CHECK(sim_hello(&master, 128) == 128);
+    CHECK(request(&master, Calibrate, 0, req, sizeof(calib), answer, sizeof(answer), NULL));
+    memcpy(&rsp, answer, sizeof(rsp));
+    CHECK(rsp.length == 128 - SPI_HEADER_SIZE - sizeof(rsp));
+
+    // the stored calibration comes back with GetCalibration, Hello and the firmware info
+    const spi_calib_t stored = { .clock_hz = 40000000, .mode = 3, .sample_delay = 2, .frames = 64 };
+    spi_calib_t back = {0};
+    CHECK(request(&master, SetCalibration, 0, &stored, sizeof(stored), &back, sizeof(back), NULL));
+    CHECK(memcmp(&back, &stored, sizeof(back)) == 0);
+    memset(&back, 0, sizeof(back));
+    CHECK(request(&master, GetCalibration, 0, NULL, 0, &back, sizeof(back), NULL));
+    CHECK(back.clock_hz == stored.clock_hz);
+    spi_firmware_info_t info = {0};
+    CHECK(request(&master, GetFirmwareInfo, 1, NULL, 0, &info, sizeof(info), NULL));
+    CHECK(info.spi_clock_hz == stored.clock_hz);
+    CHECK(sim_drain(&master, EXCHANGES));
+}
+
+// GetEvents until the queue is empty, returns the events taken
+static uint32_t take_events(sim_master_t *master, spi_event_entry_t *last)
+{
+    uint32_t taken = 0;
+    spi_events_rsp_t rsp = { .pending = 1 };
+    while (rsp.pending) {
+        uint32_t got = 0;
+        CHECK(request(master, GetEvents, 0, NULL, 0, answer, sizeof(answer), &got));
+        CHECK(got >= sizeof(rsp));
+        memcpy(&rsp, answer, sizeof(rsp));
+        CHECK(got == sizeof(rsp) + rsp.count * sizeof(spi_event_entry_t));
+        if (rsp.count && last) {
+            memcpy(last, answer + sizeof(rsp) + (rsp.count - 1) * sizeof(spi_event_entry_t), sizeof(*last));
+        }
+        taken += rsp.count;
+    }
+    return taken;
+}
+
+static void *post_late(void *arg)
+{
+    usleep(*(const useconds_t *)arg);
+    spi_event_post(SpiEventSdError, 0, 1);
+    return NULL;
+}
+
+// GetStats needs spi_task between two frames, a master that stops clocking gets SpiTimeout instead of a stuck worker
+static void test_stats_stall(void)
+{
+    sim_master_t master;
+    sim_master_init(&master, 0, 9);
+    CHECK(sim_hello(&master, 512) == 512);
+    master.stall_us = 300 * 1000;
+    uint32_t got = 1;
+    CHECK(request(&master, GetStats, 0, NULL, 0, answer, sizeof(answer), &got));
+    CHECK(got == 0);
+    // the withdrawn request leaves nothing behind for the next one
+    const spi_stats_t stats = link_stats(&master, false);
+    CHECK(stats.types > 0);
+    CHECK(sim_drain(&master, EXCHANGES));
+}
+
+// a post raises the handshake, it falls once the master took the events, even when GetEvents took an event no frame
+// announced yet
+static void test_events(void)
+{
+    sim_master_t master;
+    sim_master_init(&master, 0, 5);
+    CHECK(sim_hello(&master, 512) == 512);
+    take_events(&master, NULL);
+    CHECK(sim_drain(&master, EXCHANGES));
+
+    spi_event_post(SpiEventSdError, 0, 7);
+    host_spi_settle();
+    CHECK(host_spi_handshake());
+    spi_event_entry_t event = {0};
+    CHECK(take_events(&master, &event) == 1);
+    CHECK(event.type == SpiEventSdError && event.value == 7);
+    CHECK(sim_drain(&master, EXCHANGES));
+
+    uint32_t rng = 11;
+    for (int run = 0; run < 300; run++) {
+        rng = rng * 1103515245u + 12345u;
+        useconds_t delay = (rng >> 16) % 101;
+        pthread_t poster;
+        CHECK(pthread_create(&poster, NULL, post_late, &delay) == 0);
+        take_events(&master, NULL);
+        pthread_join(poster, NULL);
+        take_events(&master, NULL);
+        CHECK(!spi_events_pending());
+        if (!sim_drain(&master, 1000)) {
+            fprintf(stderr, "handshake stuck after run %d\n", run);
+            failures++;
+            break;
+        }
+    }
+}
+
+// the handlers behind the file, OTA and reboot requests, argument parsing and answers
+static void test_requests(const char *base_path)
+{
+    sim_master_t master;
+    sim_master_init(&master, 0, 3);
+    CHECK(sim_hello(&master, SPI_MAX_FRAME_SIZE) == SPI_MAX_FRAME_SIZE);
+
+    // unknown type: a single status chunk
+    spi_chunk_t chunk = {0};
+    CHECK(request(&master, (RequestType)0x7F, 0, NULL, 0, &chunk, sizeof(chunk), NULL));
+    CHECK(chunk.status == SpiBadRequest && (chunk.flags & SPI_CHUNK_LAST));
+
+    // FileWrite: [spi_chunk_t + data] at the chunk offset, second half first
+    uint32_t size = 1;
+    const uint8_t handle = file_open(&master, "written.bin", SpiFileWrite, &size);
+    CHECK(size == 0);
+    uint8_t frame[sizeof(spi_chunk_t) + 1000];
+    spi_file_rsp_t rsp = {0};
+    for (int half = 1; half >= 0; half--) {
+        const spi_chunk_t at = { .offset = half * 1000 };
+        memcpy(frame, &at, sizeof(at));
+        memcpy(frame + sizeof(at), file + half * 1000, 1000);
+        CHECK(request(&master, FileWrite, handle, frame, sizeof(frame), &rsp, sizeof(rsp), NULL));
+        CHECK(rsp.status == SpiOk);
+    }
+    CHECK(request(&master, FileWrite, handle, frame, sizeof(spi_chunk_t) - 1, &rsp, sizeof(rsp), NULL));
+    CHECK(rsp.status == SpiBadRequest);
+    CHECK(request(&master, FileClose, handle, NULL, 0, &rsp, sizeof(rsp), NULL));
+    CHECK(rsp.status == SpiOk && rsp.value == 2000);
+    char path[256];
+    snprintf(path, sizeof(path), "%s/written.bin", base_path);
+    FILE *f = fopen(path, "rb");
+    uint8_t back[2000] = {0};
+    CHECK(f && fread(back, 1, sizeof(back), f) == sizeof(back));
+    if (f) {
+        fclose(f);
+    }
+    CHECK(memcmp(back, file, sizeof(back)) == 0);
+    CHECK(request(&master, FileStat, 0, "written.bin", 11, &rsp, sizeof(rsp), NULL));
+    CHECK(rsp.status == SpiOk && rsp.value == 2000);
+
+    uint32_t got = 0;
+    memset(answer, 0, sizeof(answer));
+    CHECK(request(&master, FileList, 0, "/", 1, answer, sizeof(answer) - 1, &got));
+    CHECK(strstr((const char *)answer, "written.bin") != NULL);
+
+    // OTA: the begin arguments, a chunk, the status
+    spi_ota_rsp_t ota = {0};
+    const spi_ota_begin_req_t begin = { .size = 4096 };
+    CHECK(request(&master, OtaBegin, 0, &begin, sizeof(begin), &ota, sizeof(ota), NULL));
+    CHECK(ota.status == SpiOk && ota.state == SpiOtaReceiving && ota.size == 4096 && ota.slot == 1);
+    const spi_chunk_t at = { .offset = 0 };
+    memcpy(frame, &at, sizeof(at));
+    CHECK(request(&master, OtaWrite, 0, frame, sizeof(frame), &ota, sizeof(ota), NULL));
+    CHECK(ota.status == SpiOk && ota.received == 1000);
+    CHECK(request(&master, OtaWrite, 0, frame, 2, &ota, sizeof(ota), NULL));
+    CHECK(ota.status == SpiBadRequest);
+    CHECK(request(&master, OtaStatus, 0, NULL, 0, &ota, sizeof(ota), NULL));
+    CHECK(ota.state == SpiOtaReceiving && ota.received == 1000);
+
+    // RebootToOTAX to a slot that does not exist is answered, nothing shuts down
+    spi_shutdown_rsp_t shutdown = {0};
+    CHECK(request(&master, RebootToOTAX, 5, NULL, 0, &shutdown, sizeof(shutdown), NULL));
+    CHECK(shutdown.status == SpiBadRequest);
+    CHECK(host_shutdowns == 0);
+
+    // Reboot: storage down, answer out, then the restart
+    const spi_reboot_req_t reboot = { .deadline_ms = 2000 };
+    CHECK(request(&master, Reboot, 0, &reboot, sizeof(reboot), &shutdown, sizeof(shutdown), NULL));
+    CHECK(shutdown.status == SpiOk && (shutdown.steps & SPI_SHUTDOWN_UNMOUNT));
+    CHECK(host_shutdowns == 1);
+    CHECK(sim_drain(&master, EXCHANGES));
+    for (int i = 0; i < 1000 && host_restarts == 0; i++) {
+        usleep(1000);
+    }
+    CHECK(host_restarts == 1);
+}
+
+// frames the master sends by hand, straight into the link layer
+static void test_link_rules(void)
+{
+    spi_link_t link;
+    static uint8_t ring[SPI_MAX_FRAME_SIZE * SPI_RETX_FRAMES];
+    uint8_t rx[SPI_MAX_FRAME_SIZE];
+    uint8_t own[SPI_MAX_FRAME_SIZE];
+    const uint8_t *tx = NULL;
+    spi_link_init(&link, ring);
+
+    // NAK for a frame that was never sent
+    uint16_t len = sim_frame(rx, Idle, 0, SPI_FLAG_NAK, 0, 0, NULL, 0);
+    CHECK(spi_link_receive(&link, rx, len, own, &tx) == NULL);
+    CHECK(tx == own);
+    CHECK(link.stats.resends_gone == 1);
+
+    // new request, then the same one again: handled once
+    len = sim_frame(rx, GetStats, 0, 0, 1, 0, NULL, 0);
+    CHECK(spi_link_receive(&link, rx, len, own, &tx) != NULL);
+    len = sim_frame(rx, GetStats, 0, 0, 1, 0, NULL, 0);
+    CHECK(spi_link_receive(&link, rx, len, own, &tx) == NULL);
+    CHECK(link.stats.duplicates == 1);
+    CHECK(((const spi_frame_header_t *)tx)->type == Idle);
+
+    // rejected request is NAKed and taken when it comes again
+    const uint8_t request[3] = {1, 2, 3};
+    len = sim_frame(rx, GetStats, 0, 0, 2, 0, request, sizeof(request));
+    const spi_frame_header_t *hdr = spi_link_receive(&link, rx, len, own, &tx);
+    CHECK(hdr != NULL);
+    const uint64_t rx_bytes = link.stats.rx_bytes;
+    tx = spi_link_reject(&link, own, hdr);
+    CHECK(((const spi_frame_header_t *)tx)->flags & SPI_FLAG_NAK);
+    CHECK(((const spi_frame_header_t *)tx)->ack == 2);
+    CHECK(link.stats.rx_bytes == rx_bytes);
+    len = sim_frame(rx, GetStats, 0, 0, 2, 0, request, sizeof(request));
+    hdr = spi_link_receive(&link, rx, len, own, &tx);
+    CHECK(hdr != NULL);
+    spi_link_accept(&link, hdr);
+    CHECK(link.stats.rx_bytes == rx_bytes + sizeof(request));
+
+    // corrupted frame: NAK for the oldest master frame that is missing
+    len = sim_frame(rx, GetStats, 0, 0, 4, 0, NULL, 0);
+    CHECK(spi_link_receive(&link, rx, len, own, &tx) != NULL);
+    len = sim_frame(rx, GetStats, 0, 0, 3, 0, NULL, 0);
+    rx[SPI_HEADER_SIZE - 1] ^= 1;
+    CHECK(spi_link_receive(&link, rx, len, own, &tx) == NULL);
+    CHECK(link.stats.crc_errors == 1);
+    CHECK(((const spi_frame_header_t *)tx)->flags & SPI_FLAG_NAK);
+    CHECK(((const spi_frame_header_t *)tx)->ack == 3);
+
+    // payload announced beyond what was clocked
+    const uint8_t payload[32] = {0};
+    len = sim_frame(rx, GetStats, 0, 0, 3, 0, payload, sizeof(payload));
+    CHECK(spi_link_receive(&link, rx, len - 1, own, &tx) == NULL);
+    CHECK(link.stats.length_errors == 1);
+    CHECK(spi_link_receive(&link, rx, SPI_HEADER_SIZE - 1, own, &tx) == NULL);
+    CHECK(link.stats.length_errors == 2);
+
+    // answers go out numbered, a NAK from the master brings back the same frame until it left the ring
+    uint8_t staged[SPI_MAX_FRAME_SIZE];
+    spi_frame_header_t *answer_hdr = (spi_frame_header_t *)staged;
+    answer_hdr->type = GetStats;
+    answer_hdr->length = 4;
+    answer_hdr->ref = 2;
+    const uint8_t *first = spi_link_answer(&link, staged);
+    CHECK(((const spi_frame_header_t *)first)->seq == 1);
+    CHECK(((const spi_frame_header_t *)first)->ref == 2);
+    len = sim_frame(rx, Idle, 0, SPI_FLAG_NAK, 4, 1, NULL, 0);
+    CHECK(spi_link_receive(&link, rx, len, own, &tx) == NULL);
+    CHECK(tx == first);
+    for (int i = 0; i < SPI_RETX_FRAMES; i++) {
+        spi_link_answer(&link, staged);
+    }
+    len = sim_frame(rx, Idle, 0, SPI_FLAG_NAK, 4, 1, NULL, 0);
+    CHECK(spi_link_receive(&link, rx, len, own, &tx) == NULL);
+    CHECK(tx == own);
+    CHECK(link.stats.resends == 1);
+    CHECK(link.stats.resends_gone == 2);
+
+    // every frame carries the flow control status set by the caller
+    link.status = SPI_STATUS_BUSY | (3 << SPI_STATUS_BULK_SHIFT);
+    tx = spi_link_idle(&link, own);
+    CHECK(((const spi_frame_header_t *)tx)->status == link.status);
+    tx = spi_link_answer(&link, staged);
+    CHECK(SPI_STATUS_BULK_FREE(((const spi_frame_header_t *)tx)->status) == 3);
+    link.status = 0;
+
+    // Hello restarts the master's numbering
+    len = sim_frame(rx, Hello, 0, 0, 200, 0, NULL, 0);
+    CHECK(spi_link_receive(&link, rx, len, own, &tx) != NULL);
+    len = sim_frame(rx, GetStats, 0, 0, 201, 0, NULL, 0);
+    CHECK(spi_link_receive(&link, rx, len, own, &tx) != NULL);
+    len = sim_frame(rx, GetStats, 0, 0, 150, 0, NULL, 0);
+    CHECK(spi_link_receive(&link, rx, len, own, &tx) == NULL);
+}
+
+int main(void)
+{
+    const char *base_path = sim_start();
+    fill_file(base_path);
+    test_hello();
+    test_link_rules();
+    test_calibrate();
+    test_events();
+    test_stats_stall();
+    test_file_read(SPI_MAX_FRAME_SIZE, 0);
+    test_file_read(SPI_MIN_FRAME_SIZE, 0);
+    test_file_read(SPI_MAX_FRAME_SIZE, 1e-5);
+    test_file_read(512, 2e-5);
+    test_requests(base_path); // last, it reboots the slave
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
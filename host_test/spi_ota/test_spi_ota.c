@@ -0,0 +1,293 @@
+/* Functional tests of the application update over SPI (OtaBegin, OtaWrite, OtaEnd) against the mock flash: chunks in
+ * order and out of order as the link resends them, SHA-256 mismatch, missing data and flash errors */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mbedtls/sha256.h"
+#include "host_ota.h"
+#include "spi_events.h"
+#include "spi_ota.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+#define IMAGE_LEN (200 * 1024 + 123) // not a multiple of the buffers or of the erase block
+#define CHUNK 2020                   // data in a 2048 byte frame behind header and spi_chunk_t
+static uint8_t image[IMAGE_LEN];
+
+static void sha256(const uint8_t *data, size_t len, uint8_t *out)
+{
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+    mbedtls_sha256_update(&ctx, data, len);
+    mbedtls_sha256_finish(&ctx, out);
+    mbedtls_sha256_free(&ctx);
+}
+
+static void fill_image(void)
+{
+    uint32_t x = 0x12345678;
+    for (int i = 0; i < IMAGE_LEN; i++) {
+        x = x * 1103515245u + 12345u;
+        image[i] = x >> 24;
+    }
+    image[0] = 0xE9; // image magic, the mock esp_image_verify checks it
+}
+
+static SpiStatus begin(bool with_sha)
+{
+    spi_ota_begin_req_t req = { .size = IMAGE_LEN };
+    if (with_sha) {
+        sha256(image, IMAGE_LEN, req.sha256);
+    }
+    spi_ota_rsp_t rsp;
+    return spi_ota_begin(&req, &rsp);
+}
+
+static SpiStatus write_chunk(uint32_t index)
+{
+    const uint32_t offset = index * CHUNK;
+    const uint32_t len = IMAGE_LEN - offset < CHUNK ? IMAGE_LEN - offset : CHUNK;
+    spi_ota_rsp_t rsp;
+    return spi_ota_write(offset, image + offset, len, &rsp);
+}
+
+#define CHUNKS ((IMAGE_LEN + CHUNK - 1) / CHUNK)
+
+// takes the queued events, returns how many are application updates and the state of the last one
+static int ota_events(uint32_t *state)
+{
+    spi_event_entry_t events[16];
+    spi_events_rsp_t rsp;
+    int count = 0;
+    const size_t n = spi_events_take(events, sizeof(events) / sizeof(events[0]), &rsp);
+    for (size_t i = 0; i < n; i++) {
+        if (events[i].type == SpiEventOta && events[i].arg == 0) {
+            *state = events[i].value;
+            count++;
+        }
+    }
+    return count;
+}
+
+static void test_sha256(void)
+{
+    static const uint8_t abc[32] = {
+        0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+        0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad,
+    };
+    uint8_t out[32];
+    sha256((const uint8_t *)"abc", 3, out);
+    CHECK(memcmp(out, abc, sizeof(abc)) == 0);
+}
+
+static void test_in_order(void)
+{
+    host_reset();
+    uint32_t state = 0;
+    ota_events(&state);
+    CHECK(begin(true) == SpiOk);
+    for (uint32_t i = 0; i < CHUNKS; i++) {
+        CHECK(write_chunk(i) == SpiOk);
+    }
+    spi_ota_rsp_t rsp;
+    CHECK(spi_ota_end(true, &rsp) == SpiOk);
+    CHECK(rsp.state == SpiOtaVerified);
+    CHECK(rsp.received == IMAGE_LEN && rsp.written == IMAGE_LEN);
+    CHECK(rsp.erased >= IMAGE_LEN);
+    CHECK(memcmp(host_flash, image, IMAGE_LEN) == 0);
+    CHECK(host_flash_overwrites == 0);
+    CHECK(host_boot_selects == 1);
+    CHECK(ota_events(&state) == 1 && state == SpiOtaVerified);
+}
+
+// the link resends a lost chunk after later ones went through, the late one lands in a window written before
+static void test_out_of_order(void)
+{
+    host_reset();
+    CHECK(begin(true) == SpiOk);
+    for (uint32_t i = 0; i < CHUNKS; i++) {
+        if (i % 7 == 3 && i + 2 < CHUNKS) {
+            CHECK(write_chunk(i + 1) == SpiOk);
+            CHECK(write_chunk(i + 2) == SpiOk);
+            CHECK(write_chunk(i) == SpiOk);
+            i += 2;
+        } else {
+            CHECK(write_chunk(i) == SpiOk);
+        }
+    }
+    spi_ota_rsp_t rsp;
+    CHECK(spi_ota_end(false, &rsp) == SpiOk);
+    CHECK(rsp.state == SpiOtaVerified);
+    CHECK(memcmp(host_flash, image, IMAGE_LEN) == 0);
+    CHECK(host_flash_overwrites == 0);
+    CHECK(host_boot_selects == 0);
+}
+
+static void test_sha_mismatch(void)
+{
+    host_reset();
+    CHECK(begin(true) == SpiOk);
+    image[IMAGE_LEN / 2] ^= 1;
+    for (uint32_t i = 0; i < CHUNKS; i++) {
+        CHECK(write_chunk(i) == SpiOk);
+    }
+    image[IMAGE_LEN / 2] ^= 1;
+    spi_ota_rsp_t rsp;
+    CHECK(spi_ota_end(true, &rsp) == SpiIoError);
+    CHECK(rsp.state == SpiOtaFailed);
+    CHECK(host_boot_selects == 0);
+    // failed stays failed until the next OtaBegin
+    CHECK(write_chunk(0) == SpiIoError);
+}
+
+static void test_bad_image(void)
+{
+    host_reset();
+    CHECK(begin(false) == SpiOk);
+    image[0] = 0;
+    for (uint32_t i = 0; i < CHUNKS; i++) {
+        CHECK(write_chunk(i) == SpiOk);
+    }
+    image[0] = 0xE9;
+    spi_ota_rsp_t rsp;
+    CHECK(spi_ota_end(true, &rsp) == SpiIoError);
+    CHECK(host_boot_selects == 0);
+}
+
+static void test_incomplete(void)
+{
+    host_reset();
+    CHECK(begin(true) == SpiOk);
+    for (uint32_t i = 1; i < CHUNKS; i++) {
+        CHECK(write_chunk(i) == SpiOk);
+    }
+    spi_ota_rsp_t rsp;
+    CHECK(spi_ota_end(true, &rsp) == SpiBadRequest);
+    CHECK(rsp.state == SpiOtaReceiving);
+    // the missing chunk can still come
+    CHECK(write_chunk(0) == SpiOk);
+    CHECK(spi_ota_end(true, &rsp) == SpiOk);
+    CHECK(memcmp(host_flash, image, IMAGE_LEN) == 0);
+    CHECK(host_flash_overwrites == 0);
+}
+
+// a chunk that comes twice makes up for the size of a missing one, OtaEnd still has to find the hole
+static void test_duplicate_and_hole(void)
+{
+    host_reset();
+    CHECK(begin(true) == SpiOk);
+    const uint32_t hole = CHUNKS / 2;
+    for (uint32_t i = 0; i < CHUNKS; i++) {
+        if (i != hole) {
+            CHECK(write_chunk(i) == SpiOk);
+        }
+        if (i == 3) {
+            CHECK(write_chunk(3) == SpiOk);
+        }
+    }
+    spi_ota_rsp_t rsp;
+    CHECK(spi_ota_end(true, &rsp) == SpiBadRequest);
+    CHECK(rsp.state == SpiOtaReceiving);
+    CHECK(rsp.received == IMAGE_LEN - CHUNK);
+    // resent as one piece from the middle of the chunk before to the middle of the one after
+    const uint32_t offset = hole * CHUNK - CHUNK / 2;
+    CHECK(spi_ota_write(offset, image + offset, 2 * CHUNK, &rsp) == SpiOk);
+    CHECK(rsp.received == IMAGE_LEN);
+    CHECK(spi_ota_end(true, &rsp) == SpiOk);
+    CHECK(rsp.written == IMAGE_LEN);
+    CHECK(memcmp(host_flash, image, IMAGE_LEN) == 0);
+    CHECK(host_flash_overwrites == 0); // what came twice was programmed once
+}
+
+// OtaBegin while the writer erases ahead for the update before: nothing of the new image may land on flash that
+// was only erased for the old one, or counted as erased while the old erase was still running
+static void test_restart(void)
+{
+    host_reset();
+    host_flash_erase_us = 20000;
+    CHECK(begin(true) == SpiOk);
+    spi_ota_rsp_t rsp;
+    // two whole windows, nothing stays in the fill buffer and the writer goes on erasing ahead after them
+    CHECK(spi_ota_write(0, image, 16 * 1024, &rsp) == SpiOk);
+    CHECK(spi_ota_write(16 * 1024, image + 16 * 1024, 16 * 1024, &rsp) == SpiOk);
+    CHECK(begin(true) == SpiOk);
+    host_flash_erase_us = 0;
+    for (uint32_t i = 0; i < CHUNKS; i++) {
+        CHECK(write_chunk(i) == SpiOk);
+    }
+    CHECK(spi_ota_end(false, &rsp) == SpiOk);
+    CHECK(rsp.written == IMAGE_LEN);
+    CHECK(memcmp(host_flash, image, IMAGE_LEN) == 0);
+    CHECK(host_flash_overwrites == 0);
+}
+
+static void test_bad_requests(void)
+{
+    host_reset();
+    spi_ota_rsp_t rsp;
+    const spi_ota_begin_req_t too_big = { .size = HOST_SLOT_SIZE + 1 };
+    CHECK(spi_ota_begin(&too_big, &rsp) == SpiBadRequest);
+    CHECK(spi_ota_write(0, image, CHUNK, &rsp) == SpiBadRequest); // no update running
+    CHECK(begin(false) == SpiOk);
+    CHECK(spi_ota_write(IMAGE_LEN - 10, image, 11, &rsp) == SpiBadRequest);
+    CHECK(rsp.state == SpiOtaReceiving);
+}
+
+static void test_flash_error(void)
+{
+    host_reset();
+    host_flash_fail_at = 64 * 1024;
+    CHECK(begin(true) == SpiOk);
+    SpiStatus status = SpiOk;
+    for (uint32_t i = 0; i < CHUNKS && status == SpiOk; i++) {
+        status = write_chunk(i); // the error shows up with a later answer
+    }
+    spi_ota_rsp_t rsp;
+    if (status == SpiOk) {
+        status = spi_ota_end(true, &rsp);
+    }
+    CHECK(status == SpiIoError);
+    spi_ota_status(&rsp);
+    CHECK(rsp.state == SpiOtaFailed);
+    CHECK(host_boot_selects == 0);
+
+    // OtaBegin starts over
+    host_reset();
+    CHECK(begin(true) == SpiOk);
+    for (uint32_t i = 0; i < CHUNKS; i++) {
+        CHECK(write_chunk(i) == SpiOk);
+    }
+    CHECK(spi_ota_end(true, &rsp) == SpiOk);
+    CHECK(memcmp(host_flash, image, IMAGE_LEN) == 0);
+}
+
+int main(void)
+{
+    fill_image();
+    CHECK(spi_ota_init() == ESP_OK);
+    test_sha256();
+    test_in_order();
+    test_out_of_order();
+    test_sha_mismatch();
+    test_bad_image();
+    test_incomplete();
+    test_duplicate_and_hole();
+    test_restart();
+    test_bad_requests();
+    test_flash_error();
+    if (failures) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("spi_ota: all checks passed\n");
+    return 0;
+}
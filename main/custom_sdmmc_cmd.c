@@ -3,6 +3,14 @@
 #include "esp_heap_caps.h"
 #include "soc/soc_caps.h"
 #include "esp_memory_utils.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "ff.h"
+#include "diskio.h"
+#include "custom_sdmmc_cmd.h"
+#include "spi_events.h"
 #include <string.h>
 
 static const char* TAG = "custom_sdmmc_cmd";
@@ -34,6 +42,40 @@ extern esp_err_t sdmmc_write_sectors_dma(
 static uint8_t* sector_buffer = NULL;
 static size_t sector_buffer_actual_size = 0; // actual allocated size (may be larger due to heap alignment)
 
+// Write coalescing: hosts split large copies into back to back WRITE10 commands of 64-128KB. Sequential writes
+// are collected here and sent to the card as one multi block write (one CMD25/CMD12 pair and one busy wait
+// instead of one per command). The open write is closed on a discontinuity, when the buffer is full, before
+// an overlapping read, on custom_sdmmc_flush(), on a FatFs sync and after WRITE_COALESCE_IDLE_US without further
+// writes. This is write-back: a write is acked once it is in the buffer, so up to WRITE_COALESCE_SECTORS of acked
+// data are lost if power goes or the card is pulled before it was closed. A failure is reported afterwards as a
+// deferred error, see custom_sdmmc_take_deferred_error().
+// All card access goes through s_wc.lock, so the idle flush never interleaves with a read or write. The idle
+// timer only wakes flush_task, the esp_timer task must not wait for the lock or for the card.
+#ifndef WRITE_COALESCE_SECTORS
+#define WRITE_COALESCE_SECTORS 256 // 128KB
+#endif
+#define WRITE_COALESCE_IDLE_US 20000
+#ifndef WRITE_COALESCE_TASK_PRIORITY
+#define WRITE_COALESCE_TASK_PRIORITY 5
+#endif
+static struct {
+    SemaphoreHandle_t lock;
+    esp_timer_handle_t idle_timer;
+    TaskHandle_t flush_task;
+    int64_t last_write_us; // time of the last write added to the buffer
+    uint8_t* buffer; // NULL if coalescing is not available, writes then go straight to the card
+    size_t buffer_size;
+    sdmmc_card_t* card;
+    size_t start_block;
+    size_t block_count;
+    esp_err_t deferred_err; // first failed flush since it was last reported, the writes in it were already acked
+    uint32_t errors; // failed card reads and writes
+    bool parked; // card clock is at SDMMC_FREQ_PROBING while the USB bus is suspended
+    int parked_freq_khz; // clock and bus mode the card was set up at, restored when unparking
+    bool parked_ddr;
+} s_wc;
+static portMUX_TYPE s_wc_init_lock = portMUX_INITIALIZER_UNLOCKED;
+
 // Ensure buffer is allocated (called before first use)
 static esp_err_t ensure_buffer_allocated()
 {
@@ -51,13 +93,9 @@ static esp_err_t ensure_buffer_allocated()
     return ESP_OK;
 }
 
-// Your wrapped implementation
-esp_err_t __wrap_sdmmc_read_sectors(sdmmc_card_t* card, void* dst, size_t start_block, size_t block_count)
+// read without looking at pending writes, block_count > 0
+static esp_err_t read_sectors_direct(sdmmc_card_t* card, void* dst, size_t start_block, size_t block_count)
 {
-    if (block_count == 0) {
-        return ESP_OK;
-    }
-
     size_t block_size = card->csd.sector_size;
     // only works for block size 512
     assert(block_size == 512);
@@ -120,13 +158,10 @@ esp_err_t __wrap_sdmmc_read_sectors(sdmmc_card_t* card, void* dst, size_t start_
 
 
 
-esp_err_t __wrap_sdmmc_write_sectors(sdmmc_card_t* card, const void* src,
+// write without coalescing, block_count > 0
+static esp_err_t write_sectors_direct(sdmmc_card_t* card, const void* src,
         size_t start_block, size_t block_count)
 {
-    if (block_count == 0) {
-        return ESP_OK;
-    }
-
     size_t block_size = card->csd.sector_size;
     // only works for block size 512
     assert(block_size == 512);
@@ -185,4 +220,241 @@ esp_err_t __wrap_sdmmc_write_sectors(sdmmc_card_t* card, const void* src,
     }
 
     return err;
-}
\ No newline at end of file
+}
+
+// failed card read or write, the SPI master learns about it from an event
+static void count_error(void)
+{
+    s_wc.errors++;
+    spi_event_post(SpiEventSdError, 0, s_wc.errors);
+}
+
+// sends the pending coalesced write to the card, s_wc.lock has to be held
+static esp_err_t write_coalesce_flush_locked(void)
+{
+    if (s_wc.block_count == 0) {
+        return ESP_OK;
+    }
+    esp_timer_stop(s_wc.idle_timer);
+    esp_err_t err = sdmmc_write_sectors_dma(s_wc.card, s_wc.buffer, s_wc.start_block, s_wc.block_count, s_wc.buffer_size);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error 0x%x writing %zu coalesced blocks at sector %zu", err, s_wc.block_count, s_wc.start_block);
+        count_error();
+    }
+    s_wc.block_count = 0;
+    return err;
+}
+
+// the commands whose data was lost completed long ago, keep the error for custom_sdmmc_take_deferred_error()
+static void write_coalesce_defer_locked(esp_err_t err)
+{
+    if (err != ESP_OK && s_wc.deferred_err == ESP_OK) {
+        s_wc.deferred_err = err;
+    }
+}
+
+static void write_coalesce_idle_cb(void* arg)
+{
+    xTaskNotifyGive(s_wc.flush_task);
+}
+
+// flushes the open write once it was idle for WRITE_COALESCE_IDLE_US
+static void write_coalesce_flush_task(void* arg)
+{
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        xSemaphoreTake(s_wc.lock, portMAX_DELAY);
+        // a write that came in after the timer fired restarted it, the next notification flushes
+        if (esp_timer_get_time() - s_wc.last_write_us >= WRITE_COALESCE_IDLE_US) {
+            write_coalesce_defer_locked(write_coalesce_flush_locked());
+        }
+        xSemaphoreGive(s_wc.lock);
+    }
+}
+
+// creates lock, flush task, idle timer and buffer on first use, coalescing stays disabled if the buffer can't be allocated
+static esp_err_t write_coalesce_init(void)
+{
+    if (s_wc.lock != NULL) {
+        return ESP_OK;
+    }
+    SemaphoreHandle_t lock = xSemaphoreCreateMutex();
+    if (lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    portENTER_CRITICAL(&s_wc_init_lock);
+    bool created = (s_wc.lock == NULL);
+    if (created) {
+        s_wc.lock = lock;
+    }
+    portEXIT_CRITICAL(&s_wc_init_lock);
+    if (!created) {
+        vSemaphoreDelete(lock);
+        return ESP_OK;
+    }
+
+    xSemaphoreTake(s_wc.lock, portMAX_DELAY);
+    const esp_timer_create_args_t timer_args = {
+        .callback = write_coalesce_idle_cb,
+        .name = "sd_wr_idle",
+    };
+    if (xTaskCreate(write_coalesce_flush_task, "sd_wr_flush", 3072, NULL, WRITE_COALESCE_TASK_PRIORITY, &s_wc.flush_task) == pdPASS &&
+            esp_timer_create(&timer_args, &s_wc.idle_timer) == ESP_OK) {
+        s_wc.buffer = (uint8_t*)heap_caps_malloc(WRITE_COALESCE_SECTORS * 512, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL | MALLOC_CAP_32BIT);
+    }
+    if (s_wc.buffer == NULL) {
+        ESP_LOGW(TAG, "Write coalescing disabled, could not allocate %d bytes", WRITE_COALESCE_SECTORS * 512);
+    } else {
+        s_wc.buffer_size = heap_caps_get_allocated_size(s_wc.buffer);
+        ESP_LOGI(TAG, "Write coalescing buffer allocated at %p (%zu bytes)", s_wc.buffer, s_wc.buffer_size);
+    }
+    xSemaphoreGive(s_wc.lock);
+    return ESP_OK;
+}
+
+esp_err_t __wrap_sdmmc_read_sectors(sdmmc_card_t* card, void* dst, size_t start_block, size_t block_count)
+{
+    if (block_count == 0) {
+        return ESP_OK;
+    }
+    esp_err_t err = write_coalesce_init();
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    xSemaphoreTake(s_wc.lock, portMAX_DELAY);
+    // the card has to see pending data before it is read back
+    if (s_wc.block_count > 0 && s_wc.card == card &&
+            start_block < s_wc.start_block + s_wc.block_count && s_wc.start_block < start_block + block_count) {
+        write_coalesce_defer_locked(write_coalesce_flush_locked());
+    }
+    err = read_sectors_direct(card, dst, start_block, block_count);
+    if (err != ESP_OK) {
+        count_error();
+    }
+    xSemaphoreGive(s_wc.lock);
+    return err;
+}
+
+esp_err_t __wrap_sdmmc_write_sectors(sdmmc_card_t* card, const void* src,
+        size_t start_block, size_t block_count)
+{
+    if (block_count == 0) {
+        return ESP_OK;
+    }
+    esp_err_t err = write_coalesce_init();
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    xSemaphoreTake(s_wc.lock, portMAX_DELAY);
+    const size_t capacity = s_wc.buffer_size / card->csd.sector_size;
+
+    // close the open write if this one does not continue it, a failure belongs to the writes in the buffer
+    if (s_wc.block_count > 0 &&
+            (s_wc.card != card || s_wc.start_block + s_wc.block_count != start_block ||
+             s_wc.block_count + block_count > capacity)) {
+        write_coalesce_defer_locked(write_coalesce_flush_locked());
+    }
+
+    if (block_count > capacity) {
+        err = write_sectors_direct(card, src, start_block, block_count);
+        if (err != ESP_OK) {
+            count_error();
+        }
+    } else {
+        if (s_wc.block_count == 0) {
+            s_wc.card = card;
+            s_wc.start_block = start_block;
+        }
+        memcpy(s_wc.buffer + s_wc.block_count * card->csd.sector_size, src, block_count * card->csd.sector_size);
+        s_wc.block_count += block_count;
+        s_wc.last_write_us = esp_timer_get_time();
+        esp_timer_stop(s_wc.idle_timer);
+        esp_timer_start_once(s_wc.idle_timer, WRITE_COALESCE_IDLE_US);
+    }
+    xSemaphoreGive(s_wc.lock);
+    return err;
+}
+
+esp_err_t custom_sdmmc_flush(void)
+{
+    if (s_wc.lock == NULL) {
+        return ESP_OK;
+    }
+    xSemaphoreTake(s_wc.lock, portMAX_DELAY);
+    esp_err_t err = write_coalesce_flush_locked();
+    xSemaphoreGive(s_wc.lock);
+    return err;
+}
+
+// FatFs asks for CTRL_SYNC whenever it syncs the volume (f_sync, f_close and so fsync and fclose, directory changes),
+// the sdmmc diskio driver answers it without touching the card. With the buffered writes sent first, a file the
+// firmware synced or closed is on the card.
+extern DRESULT __real_disk_ioctl(BYTE pdrv, BYTE cmd, void* buff);
+
+DRESULT __wrap_disk_ioctl(BYTE pdrv, BYTE cmd, void* buff)
+{
+    if (cmd == CTRL_SYNC && custom_sdmmc_flush() != ESP_OK) {
+        return RES_ERROR;
+    }
+    return __real_disk_ioctl(pdrv, cmd, buff);
+}
+
+esp_err_t custom_sdmmc_take_deferred_error(void)
+{
+    if (s_wc.lock == NULL) {
+        return ESP_OK;
+    }
+    xSemaphoreTake(s_wc.lock, portMAX_DELAY);
+    esp_err_t err = s_wc.deferred_err;
+    s_wc.deferred_err = ESP_OK;
+    xSemaphoreGive(s_wc.lock);
+    return err;
+}
+
+uint32_t custom_sdmmc_error_count(void)
+{
+    return s_wc.errors;
+}
+
+esp_err_t custom_sdmmc_park_card_clk(sdmmc_card_t* card, bool park, bool* changed)
+{
+    *changed = false;
+    esp_err_t err = write_coalesce_init();
+    if (err != ESP_OK) {
+        return err;
+    }
+    xSemaphoreTake(s_wc.lock, portMAX_DELAY);
+    if (s_wc.parked == park) {
+        xSemaphoreGive(s_wc.lock);
+        return ESP_OK;
+    }
+    write_coalesce_defer_locked(write_coalesce_flush_locked());
+    if (park) {
+        // the host leaves DDR while parked and takes it up again together with the clock the card was set up at
+        s_wc.parked_freq_khz = card->real_freq_khz;
+        s_wc.parked_ddr = card->is_ddr;
+        if (s_wc.parked_ddr) {
+            err = sdmmc_host_set_bus_ddr_mode(card->host.slot, false);
+        }
+        if (err == ESP_OK) {
+            err = sdmmc_host_set_card_clk(card->host.slot, SDMMC_FREQ_PROBING);
+            if (err != ESP_OK && s_wc.parked_ddr) {
+                sdmmc_host_set_bus_ddr_mode(card->host.slot, true); // still at full clock
+            }
+        }
+    } else {
+        err = sdmmc_host_set_card_clk(card->host.slot, s_wc.parked_freq_khz);
+        if (err == ESP_OK && s_wc.parked_ddr) {
+            err = sdmmc_host_set_bus_ddr_mode(card->host.slot, true);
+        }
+    }
+    // a failed restore still leaves the parked state, there is nothing better to go back to
+    if (err == ESP_OK || !park) {
+        s_wc.parked = park;
+        *changed = true;
+    }
+    xSemaphoreGive(s_wc.lock);
+    return err;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "sdmmc_cmd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// writes sequential sectors that are still held back by the write coalescing to the card,
+// returns the error of this write only
+esp_err_t custom_sdmmc_flush(void);
+
+// a coalesced write that fails without a caller waiting for it (idle timer, a later write or read closing it)
+// belongs to commands that were acked when their data was buffered. The first such error is kept until it is
+// taken here and reported as a deferred error, buffered writes never return it. ESP_OK if nothing failed.
+esp_err_t custom_sdmmc_take_deferred_error(void);
+
+// card reads and writes that failed since boot
+uint32_t custom_sdmmc_error_count(void);
+
+// flushes pending writes and drops the card clock to SDMMC_FREQ_PROBING (park) or restores the clock and DDR mode
+// the card ran at before, serialised with all other card access. changed is set if the parked state changed with
+// this call.
+esp_err_t custom_sdmmc_park_card_clk(sdmmc_card_t* card, bool park, bool* changed);
+
+#ifdef __cplusplus
+}
+#endif
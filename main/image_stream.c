@@ -0,0 +1,187 @@
+/* Streaming check of an ESP app image
+ *
+ * The image goes through in whatever pieces the file is read in, nothing is read twice:
+ * - header: magic, segment count, chip id
+ * - segments: every header, data length word aligned, the first segment starts with the app descriptor
+ * - checksum: XOR of all segment data, in the last byte of the padding to 16 bytes
+ * - SHA-256 over everything up to the checksum, compared with the appended one if the header says there is one
+ * Bytes after the image (secure boot signature blocks) are passed over. The caller sees a bad image with the chunk
+ * it is in and can stop before the bytes go anywhere.
+ */
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_image_format.h"
+#include "image_stream.h"
+
+static const char *TAG = "image_stream";
+
+#define IMAGE_MAX_SEGMENT_LEN 0x1000000
+#define IMAGE_CHECKSUM_INITIAL 0xEF
+#define IMAGE_HASH_LEN 32
+
+void image_stream_init(image_stream_t *s, esp_chip_id_t chip)
+{
+    memset(s, 0, sizeof(*s));
+    s->state = ImageHeader;
+    s->chip = chip;
+    s->checksum = IMAGE_CHECKSUM_INITIAL;
+    mbedtls_sha256_init(&s->sha);
+    mbedtls_sha256_starts(&s->sha, 0);
+}
+
+static esp_err_t bad(image_stream_t *s, const char *what)
+{
+    ESP_LOGE(TAG, "bad image at offset %lu: %s", (unsigned long)s->offset, what);
+    s->state = ImageBad;
+    return ESP_ERR_INVALID_ARG;
+}
+
+static esp_err_t segment_done(image_stream_t *s)
+{
+    if (s->segment == 0 && s->app_desc_len < sizeof(s->app_desc)) {
+        return bad(s, "first segment too short for the app descriptor");
+    }
+    if (++s->segment < s->header.segment_count) {
+        s->state = ImageSegmentHeader;
+    } else {
+        s->image_len = (s->offset + 1 + 15) & ~15u; // checksum byte is the last of the padding
+        s->state = ImagePadding;
+    }
+    return ESP_OK;
+}
+
+// the current part (header, segment header, hash) is complete, or the last padding byte just went through
+static esp_err_t part_done(image_stream_t *s, uint8_t last)
+{
+    s->part_len = 0;
+    switch (s->state) {
+    case ImageHeader:
+        memcpy(&s->header, s->part, sizeof(s->header));
+        if (s->header.magic != ESP_IMAGE_HEADER_MAGIC) {
+            return bad(s, "no image magic");
+        }
+        if (s->header.segment_count == 0 || s->header.segment_count > ESP_IMAGE_MAX_SEGMENTS) {
+            return bad(s, "segment count");
+        }
+        if (s->header.chip_id != s->chip) {
+            ESP_LOGE(TAG, "image is for chip id %d, expected %d", s->header.chip_id, s->chip);
+            return bad(s, "wrong chip");
+        }
+        s->state = ImageSegmentHeader;
+        return ESP_OK;
+    case ImageSegmentHeader: {
+        esp_image_segment_header_t seg;
+        memcpy(&seg, s->part, sizeof(seg));
+        if (seg.data_len % 4 != 0 || seg.data_len > IMAGE_MAX_SEGMENT_LEN) {
+            return bad(s, "segment length");
+        }
+        s->remaining = seg.data_len;
+        s->state = ImageSegmentData;
+        return s->remaining == 0 ? segment_done(s) : ESP_OK;
+    }
+    case ImagePadding:
+        if (last != s->checksum) {
+            ESP_LOGE(TAG, "checksum 0x%02x, computed 0x%02x", last, s->checksum);
+            return bad(s, "checksum mismatch");
+        }
+        s->state = s->header.hash_appended ? ImageHash : ImageDone;
+        return ESP_OK;
+    case ImageHash: {
+        uint8_t sha256[IMAGE_HASH_LEN];
+        mbedtls_sha256_finish(&s->sha, sha256);
+        if (memcmp(sha256, s->part, sizeof(sha256)) != 0) {
+            return bad(s, "SHA-256 mismatch");
+        }
+        s->state = ImageDone;
+        return ESP_OK;
+    }
+    default:
+        return ESP_OK;
+    }
+}
+
+esp_err_t image_stream_feed(image_stream_t *s, const uint8_t *data, size_t len)
+{
+    while (len > 0) {
+        size_t n = 0;
+        bool complete = false;
+        switch (s->state) {
+        case ImageHeader:
+        case ImageSegmentHeader:
+        case ImageHash: {
+            const size_t want = s->state == ImageHeader ? sizeof(esp_image_header_t)
+                              : s->state == ImageSegmentHeader ? sizeof(esp_image_segment_header_t) : IMAGE_HASH_LEN;
+            n = want - s->part_len < len ? want - s->part_len : len;
+            memcpy(s->part + s->part_len, data, n);
+            s->part_len += n;
+            complete = s->part_len == want;
+            break;
+        }
+        case ImageSegmentData:
+            n = s->remaining < len ? s->remaining : len;
+            for (size_t i = 0; i < n; i++) {
+                s->checksum ^= data[i];
+            }
+            if (s->segment == 0 && s->app_desc_len < sizeof(s->app_desc)) {
+                const size_t take = sizeof(s->app_desc) - s->app_desc_len < n ? sizeof(s->app_desc) - s->app_desc_len : n;
+                memcpy((uint8_t *)&s->app_desc + s->app_desc_len, data, take);
+                s->app_desc_len += take;
+                if (s->app_desc_len == sizeof(s->app_desc) && s->app_desc.magic_word != ESP_APP_DESC_MAGIC_WORD) {
+                    return bad(s, "no app descriptor");
+                }
+            }
+            s->remaining -= n;
+            break;
+        case ImagePadding:
+            n = s->image_len - s->offset < len ? s->image_len - s->offset : len;
+            complete = s->offset + n == s->image_len;
+            break;
+        case ImageDone:
+            return ESP_OK;
+        case ImageBad:
+        default:
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        if (s->state != ImageHash) {
+            mbedtls_sha256_update(&s->sha, data, n);
+        }
+        s->offset += n;
+        esp_err_t err = ESP_OK;
+        if (complete) {
+            err = part_done(s, data[n - 1]);
+        } else if (s->state == ImageSegmentData && s->remaining == 0) {
+            err = segment_done(s);
+        }
+        if (err != ESP_OK) {
+            return err;
+        }
+        data += n;
+        len -= n;
+    }
+    return s->state == ImageBad ? ESP_ERR_INVALID_ARG : ESP_OK;
+}
+
+const esp_app_desc_t *image_stream_app_desc(const image_stream_t *s)
+{
+    return s->app_desc_len == sizeof(s->app_desc) && s->state != ImageBad ? &s->app_desc : NULL;
+}
+
+esp_err_t image_stream_finish(image_stream_t *s)
+{
+    if (s->state == ImageDone) {
+        ESP_LOGI(TAG, "image of %lu bytes checked%s", (unsigned long)s->image_len,
+                 s->header.hash_appended ? ", SHA-256 matches" : "");
+        return ESP_OK;
+    }
+    if (s->state != ImageBad) {
+        ESP_LOGE(TAG, "image incomplete, file ends after %lu bytes", (unsigned long)s->offset);
+    }
+    return ESP_ERR_INVALID_SIZE;
+}
+
+void image_stream_free(image_stream_t *s)
+{
+    mbedtls_sha256_free(&s->sha);
+}
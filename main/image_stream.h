@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_app_format.h"
+#include "esp_app_desc.h"
+#include "mbedtls/sha256.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    ImageHeader,
+    ImageSegmentHeader,
+    ImageSegmentData,
+    ImagePadding,   // up to and including the checksum byte
+    ImageHash,      // appended SHA-256
+    ImageDone,      // anything after the image (signature blocks) is passed over
+    ImageBad,
+} image_stream_state_t;
+
+// Checks an app image while it streams past, see image_stream.c. One caller at a time.
+typedef struct {
+    image_stream_state_t state;
+    esp_chip_id_t chip;
+    uint32_t offset;        // image bytes taken so far
+    uint32_t image_len;     // with padding and checksum, known once the last segment is through
+    uint32_t remaining;     // of the current segment
+    uint8_t segment;
+    uint8_t checksum;
+    uint8_t part[32];       // header, segment header or hash collected across chunks
+    size_t part_len;
+    esp_image_header_t header;
+    esp_app_desc_t app_desc;
+    size_t app_desc_len;
+    mbedtls_sha256_context sha;
+} image_stream_t;
+
+void image_stream_init(image_stream_t *s, esp_chip_id_t chip);
+// runs len more bytes of the file through the check, ESP_ERR_INVALID_ARG (logged) once the image is bad
+esp_err_t image_stream_feed(image_stream_t *s, const uint8_t *data, size_t len);
+// app descriptor from the first segment, NULL until that many bytes went through
+const esp_app_desc_t *image_stream_app_desc(const image_stream_t *s);
+// ESP_OK if the whole image went through and checksum and hash matched
+esp_err_t image_stream_finish(image_stream_t *s);
+void image_stream_free(image_stream_t *s);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,394 @@
+/* MSC instrumentation
+ *
+ * The TinyUSB MSC callbacks implemented by esp_tinyusb are wrapped at link time (see CMakeLists.txt), the same
+ * way custom_sdmmc_cmd.c wraps the sdmmc sector functions. Per command we record
+ *  - the SCSI opcode, as far as TinyUSB hands it to a callback
+ *  - the transfer size of READ10/WRITE10
+ *  - the time from CBW received to CSW sent, split into storage I/O (time spent in the callbacks) and
+ *    USB transfer (the rest)
+ * CBW and CSW are taken from the MSC class driver's transfer complete callback mscd_xfer_cb.
+ * Everything is updated from the TinyUSB task, the console only takes snapshots.
+ */
+
+#include <string.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "tinyusb.h"
+#include "msc_stats.h"
+#include "custom_sdmmc_cmd.h"
+#include "usb_power.h"
+
+#define MSC_CBW_LEN 31
+#define MSC_CSW_LEN 13
+#define SCSI_CMD_SYNCHRONIZE_CACHE_10 0x35
+#define OPCODE_UNKNOWN 0xFFFF // command handled inside TinyUSB without reaching a callback
+
+typedef enum {
+    OpTestUnitReady = 0,
+    OpInquiry,
+    OpReadCapacity,
+    OpStartStop,
+    OpPreventAllow,
+    OpSyncCache,
+    OpRead10,
+    OpWrite10,
+    OpOther,
+    OpCount
+} OpSlot;
+
+static const char *op_names[OpCount] = {
+    "TEST UNIT READY", "INQUIRY", "READ CAPACITY", "START STOP", "PREVENT ALLOW", "SYNC CACHE", "READ10", "WRITE10", "other"
+};
+
+// histogram bucket upper bounds, the last bucket takes everything above
+#define SIZE_BUCKETS 10
+static const uint32_t size_bounds[SIZE_BUCKETS - 1] = {
+    512, 1024, 2048, 4096, 8192, 16384, 32768, 65536, 131072
+};
+#define TIME_BUCKETS 10
+static const uint32_t time_bounds_us[TIME_BUCKETS - 1] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000
+};
+
+typedef struct {
+    uint32_t count;
+    uint64_t total_us;
+    uint64_t storage_us;
+    uint32_t max_us;
+    uint64_t bytes;
+} op_stats_t;
+
+typedef struct {
+    op_stats_t ops[OpCount];
+    uint32_t read_size_hist[SIZE_BUCKETS];
+    uint32_t write_size_hist[SIZE_BUCKETS];
+    uint32_t time_hist[TIME_BUCKETS];
+    uint32_t unknown_opcodes; // opcodes which went through tud_msc_scsi_cb but have no slot of their own
+    uint32_t suspends;
+    uint32_t max_park_us; // flush + clock change on suspend
+    uint32_t max_restore_us; // clock change on resume
+    uint32_t last_resume_to_io_us;
+    uint32_t max_resume_to_io_us;
+} msc_stats_t;
+
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static msc_stats_t s_stats;
+
+// command in flight, only touched by the TinyUSB task
+static struct {
+    bool active;
+    uint32_t opcode;
+    int64_t t_cbw;
+    int64_t storage_us;
+    uint32_t bytes;
+} s_cmd;
+static int64_t s_t_resume; // 0 if there was no resume since the last READ10/WRITE10
+
+// real implementations in esp_tinyusb / tinyusb
+extern bool __real_mscd_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t event, uint32_t xferred_bytes);
+extern int32_t __real_tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void *buffer, uint32_t bufsize);
+extern int32_t __real_tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t *buffer, uint32_t bufsize);
+extern int32_t __real_tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void *buffer, uint16_t bufsize);
+extern bool __real_tud_msc_test_unit_ready_cb(uint8_t lun);
+extern void __real_tud_msc_capacity_cb(uint8_t lun, uint32_t *block_count, uint16_t *block_size);
+extern void __real_tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4]);
+extern bool __real_tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject);
+
+static OpSlot op_slot(uint32_t opcode)
+{
+    switch (opcode) {
+    case SCSI_CMD_TEST_UNIT_READY: return OpTestUnitReady;
+    case SCSI_CMD_INQUIRY: return OpInquiry;
+    case SCSI_CMD_READ_CAPACITY_10: return OpReadCapacity;
+    case SCSI_CMD_START_STOP_UNIT: return OpStartStop;
+    case SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL: return OpPreventAllow;
+    case SCSI_CMD_SYNCHRONIZE_CACHE_10: return OpSyncCache;
+    case SCSI_CMD_READ_10: return OpRead10;
+    case SCSI_CMD_WRITE_10: return OpWrite10;
+    default: return OpOther;
+    }
+}
+
+static int bucket(const uint32_t *bounds, int n_buckets, uint32_t value)
+{
+    int i = 0;
+    while (i < n_buckets - 1 && value > bounds[i]) {
+        i++;
+    }
+    return i;
+}
+
+// resume to first I/O latency
+static void note_io(int64_t now)
+{
+    if (s_t_resume == 0) {
+        return;
+    }
+    const uint32_t latency = (uint32_t)(now - s_t_resume);
+    s_t_resume = 0;
+    portENTER_CRITICAL(&s_lock);
+    s_stats.last_resume_to_io_us = latency;
+    if (latency > s_stats.max_resume_to_io_us) {
+        s_stats.max_resume_to_io_us = latency;
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+static void cmd_finish(int64_t now)
+{
+    const uint32_t total_us = (uint32_t)(now - s_cmd.t_cbw);
+    const OpSlot slot = op_slot(s_cmd.opcode);
+
+    portENTER_CRITICAL(&s_lock);
+    op_stats_t *op = &s_stats.ops[slot];
+    op->count++;
+    op->total_us += total_us;
+    op->storage_us += s_cmd.storage_us;
+    op->bytes += s_cmd.bytes;
+    if (total_us > op->max_us) {
+        op->max_us = total_us;
+    }
+    if (slot == OpRead10) {
+        s_stats.read_size_hist[bucket(size_bounds, SIZE_BUCKETS, s_cmd.bytes)]++;
+    } else if (slot == OpWrite10) {
+        s_stats.write_size_hist[bucket(size_bounds, SIZE_BUCKETS, s_cmd.bytes)]++;
+    } else if (slot == OpOther && s_cmd.opcode != OPCODE_UNKNOWN) {
+        s_stats.unknown_opcodes++;
+    }
+    s_stats.time_hist[bucket(time_bounds_us, TIME_BUCKETS, total_us)]++;
+    portEXIT_CRITICAL(&s_lock);
+
+    s_cmd.active = false;
+}
+
+bool __wrap_mscd_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t event, uint32_t xferred_bytes)
+{
+    const int64_t now = esp_timer_get_time();
+    const bool is_in = (ep_addr & 0x80) != 0;
+    if (event == XFER_RESULT_SUCCESS) {
+        if (!is_in && xferred_bytes == MSC_CBW_LEN) {
+            // a new CBW also closes a command whose CSW we did not see (e.g. after a stall)
+            if (s_cmd.active) {
+                cmd_finish(now);
+            }
+            s_cmd.active = true;
+            s_cmd.opcode = OPCODE_UNKNOWN;
+            s_cmd.t_cbw = now;
+            s_cmd.storage_us = 0;
+            s_cmd.bytes = 0;
+        } else if (is_in && xferred_bytes == MSC_CSW_LEN && s_cmd.active) {
+            cmd_finish(now);
+        }
+    }
+    return __real_mscd_xfer_cb(rhport, ep_addr, event, xferred_bytes);
+}
+
+// A coalesced write that failed after its commands were acked is reported on the next command as a deferred
+// error: that command fails and REQUEST SENSE returns MEDIUM ERROR / write error with response code 0x71. The error
+// stays latched here until REQUEST SENSE, TinyUSB replaces the sense of a failed READ10/WRITE10 with MEDIUM NOT PRESENT.
+static bool s_deferred_sense;
+
+static bool report_deferred_error(uint8_t lun)
+{
+    if (custom_sdmmc_take_deferred_error() == ESP_OK) {
+        return false;
+    }
+    tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0C, 0x00); // write error
+    s_deferred_sense = true;
+    return true;
+}
+
+int32_t tud_msc_request_sense_cb(uint8_t lun, void *buffer, uint16_t bufsize)
+{
+    scsi_sense_fixed_resp_t *sense = (scsi_sense_fixed_resp_t *)buffer;
+    if (s_deferred_sense && bufsize >= sizeof(*sense)) {
+        sense->response_code = 0x71; // deferred, fixed format
+        sense->sense_key = SCSI_SENSE_MEDIUM_ERROR;
+        sense->add_sense_code = 0x0C; // write error
+        sense->add_sense_qualifier = 0x00;
+    }
+    s_deferred_sense = false;
+    return sizeof(*sense) < bufsize ? sizeof(*sense) : bufsize;
+}
+
+int32_t __wrap_tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void *buffer, uint32_t bufsize)
+{
+    const int64_t start = esp_timer_get_time();
+    usb_power_wake();
+    note_io(start);
+    s_cmd.opcode = SCSI_CMD_READ_10;
+    if (report_deferred_error(lun)) {
+        return -1;
+    }
+    const int32_t ret = __real_tud_msc_read10_cb(lun, lba, offset, buffer, bufsize);
+    s_cmd.storage_us += esp_timer_get_time() - start;
+    if (ret > 0) {
+        s_cmd.bytes += ret;
+    }
+    return ret;
+}
+
+int32_t __wrap_tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t *buffer, uint32_t bufsize)
+{
+    const int64_t start = esp_timer_get_time();
+    usb_power_wake();
+    note_io(start);
+    s_cmd.opcode = SCSI_CMD_WRITE_10;
+    if (report_deferred_error(lun)) {
+        return -1;
+    }
+    const int32_t ret = __real_tud_msc_write10_cb(lun, lba, offset, buffer, bufsize);
+    s_cmd.storage_us += esp_timer_get_time() - start;
+    if (ret > 0) {
+        s_cmd.bytes += ret;
+    }
+    return ret;
+}
+
+int32_t __wrap_tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void *buffer, uint16_t bufsize)
+{
+    const int64_t start = esp_timer_get_time();
+    int32_t ret;
+    if (report_deferred_error(lun)) {
+        ret = -1;
+    } else if (scsi_cmd[0] == SCSI_CMD_SYNCHRONIZE_CACHE_10) {
+        // esp_tinyusb rejects SYNC CACHE, but with write coalescing there is a cache to sync
+        ret = 0;
+        if (custom_sdmmc_flush() != ESP_OK) {
+            tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0C, 0x00); // write error
+            ret = -1;
+        }
+    } else {
+        ret = __real_tud_msc_scsi_cb(lun, scsi_cmd, buffer, bufsize);
+    }
+    s_cmd.storage_us += esp_timer_get_time() - start;
+    s_cmd.opcode = scsi_cmd[0];
+    return ret;
+}
+
+bool __wrap_tud_msc_test_unit_ready_cb(uint8_t lun)
+{
+    s_cmd.opcode = SCSI_CMD_TEST_UNIT_READY;
+    if (report_deferred_error(lun)) {
+        return false;
+    }
+    return __real_tud_msc_test_unit_ready_cb(lun);
+}
+
+void __wrap_tud_msc_capacity_cb(uint8_t lun, uint32_t *block_count, uint16_t *block_size)
+{
+    s_cmd.opcode = SCSI_CMD_READ_CAPACITY_10;
+    __real_tud_msc_capacity_cb(lun, block_count, block_size);
+}
+
+void __wrap_tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4])
+{
+    s_cmd.opcode = SCSI_CMD_INQUIRY;
+    __real_tud_msc_inquiry_cb(lun, vendor_id, product_id, product_rev);
+}
+
+bool __wrap_tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject)
+{
+    const int64_t t = esp_timer_get_time();
+    s_cmd.opcode = SCSI_CMD_START_STOP_UNIT;
+    if (load_eject && !start && (custom_sdmmc_flush() != ESP_OK || custom_sdmmc_take_deferred_error() != ESP_OK)) {
+        // the host must not take the medium for consistent, it can retry the eject
+        tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0C, 0x00); // write error
+        s_cmd.storage_us += esp_timer_get_time() - t;
+        return false;
+    }
+    const bool ret = __real_tud_msc_start_stop_cb(lun, power_condition, start, load_eject);
+    s_cmd.storage_us += esp_timer_get_time() - t; // eject remounts the storage to the application
+    return ret;
+}
+
+static void print_hist(const char *name, const uint32_t *hist, const uint32_t *bounds, int n_buckets, const char *unit)
+{
+    printf("%s\n", name);
+    for (int i = 0; i < n_buckets; i++) {
+        if (hist[i] == 0) {
+            continue;
+        }
+        if (i < n_buckets - 1) {
+            printf("  <= %6" PRIu32 "%-2s %8" PRIu32 "\n", bounds[i], unit, hist[i]);
+        } else {
+            printf("   > %6" PRIu32 "%-2s %8" PRIu32 "\n", bounds[i - 1], unit, hist[i]);
+        }
+    }
+}
+
+void msc_stats_print(void)
+{
+    static msc_stats_t snap; // keep the snapshot off the console task stack
+    portENTER_CRITICAL(&s_lock);
+    memcpy(&snap, &s_stats, sizeof(snap));
+    portEXIT_CRITICAL(&s_lock);
+
+    printf("%-16s %8s %10s %10s %10s %8s %12s\n", "opcode", "count", "avg us", "usb us", "storage us", "max us", "bytes");
+    for (int i = 0; i < OpCount; i++) {
+        const op_stats_t *op = &snap.ops[i];
+        if (op->count == 0) {
+            continue;
+        }
+        printf("%-16s %8" PRIu32 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %8" PRIu32 " %12" PRIu64 "\n",
+               op_names[i], op->count, op->total_us / op->count, (op->total_us - op->storage_us) / op->count,
+               op->storage_us / op->count, op->max_us, op->bytes);
+    }
+    if (snap.unknown_opcodes) {
+        printf("(%" PRIu32 " of the other commands had opcodes without a slot of their own)\n", snap.unknown_opcodes);
+    }
+    print_hist("READ10 transfer size:", snap.read_size_hist, size_bounds, SIZE_BUCKETS, "B");
+    print_hist("WRITE10 transfer size:", snap.write_size_hist, size_bounds, SIZE_BUCKETS, "B");
+    print_hist("CBW to CSW time:", snap.time_hist, time_bounds_us, TIME_BUCKETS, "us");
+    if (snap.suspends) {
+        printf("USB suspends: %" PRIu32 ", max park %" PRIu32 " us, max restore %" PRIu32 " us, "
+               "resume to first I/O last %" PRIu32 " us, max %" PRIu32 " us\n",
+               snap.suspends, snap.max_park_us, snap.max_restore_us,
+               snap.last_resume_to_io_us, snap.max_resume_to_io_us);
+    }
+}
+
+void msc_stats_summary(msc_stats_summary_t *summary)
+{
+    memset(summary, 0, sizeof(*summary));
+    portENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < OpCount; i++) {
+        summary->commands += s_stats.ops[i].count;
+    }
+    summary->reads = s_stats.ops[OpRead10].count;
+    summary->writes = s_stats.ops[OpWrite10].count;
+    summary->read_bytes = s_stats.ops[OpRead10].bytes;
+    summary->write_bytes = s_stats.ops[OpWrite10].bytes;
+    summary->max_read_us = s_stats.ops[OpRead10].max_us;
+    summary->max_write_us = s_stats.ops[OpWrite10].max_us;
+    summary->suspends = s_stats.suspends;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void msc_stats_note_suspend(uint32_t park_us)
+{
+    portENTER_CRITICAL(&s_lock);
+    s_stats.suspends++;
+    if (park_us > s_stats.max_park_us) {
+        s_stats.max_park_us = park_us;
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void msc_stats_note_resume(uint32_t restore_us)
+{
+    s_t_resume = esp_timer_get_time();
+    portENTER_CRITICAL(&s_lock);
+    if (restore_us > s_stats.max_restore_us) {
+        s_stats.max_restore_us = restore_us;
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void msc_stats_reset(void)
+{
+    portENTER_CRITICAL(&s_lock);
+    memset(&s_stats, 0, sizeof(s_stats));
+    portEXIT_CRITICAL(&s_lock);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// MSC instrumentation, hooks into the TinyUSB MSC callbacks via linker wrapping (see CMakeLists.txt)
+void msc_stats_print(void);
+void msc_stats_reset(void);
+
+// the counters the SPI master polls for device health, a subset of what msc_stats_print() shows
+typedef struct {
+    uint32_t commands;
+    uint32_t reads; // READ10
+    uint32_t writes; // WRITE10
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint32_t max_read_us; // CBW to CSW
+    uint32_t max_write_us;
+    uint32_t suspends;
+} msc_stats_summary_t;
+
+void msc_stats_summary(msc_stats_summary_t *summary);
+
+// suspend/resume bookkeeping (usb_power.c), the first READ10/WRITE10 after a resume records the resume latency
+void msc_stats_note_suspend(uint32_t park_us);
+void msc_stats_note_resume(uint32_t restore_us);
+
+#ifdef __cplusplus
+}
+#endif
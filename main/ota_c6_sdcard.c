@@ -15,17 +15,73 @@
 #include <unistd.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_timer.h"
 #include "esp_app_format.h"
 #include "esp_app_desc.h"
 #include "esp_hosted.h"
 #include "esp_hosted_api_types.h"
+#include "ff.h"
+#include "image_stream.h"
+#include "spi_events.h"
 
 static const char* TAG = "ota_c6_sd";
 
-#ifndef CHUNK_SIZE
-#define CHUNK_SIZE 1500
+/* bytes per esp_hosted_slave_ota_write (one RPC to the C6), 0: chosen at start from the RPC payload and the card
+ * read size, see c6_write_size() */
+#ifndef C6_OTA_WRITE_SIZE
+#define C6_OTA_WRITE_SIZE CONFIG_C6_OTA_CHUNK_SIZE
+#endif
+/* largest OTA write one ESP-Hosted transport buffer carries: 1600 bytes less the payload header and the RPC framing
+ * around the data. ESP-Hosted has no call that reports it, so it is a build setting here. */
+#ifndef C6_OTA_RPC_PAYLOAD
+#define C6_OTA_RPC_PAYLOAD 1500
+#endif
+
+/* bytes per card read, 0: one cluster of the FAT volume, so a read is whole sectors of one cluster straight into
+ * the ring instead of partial sectors through the FatFs window */
+#ifndef C6_OTA_READ_SIZE
+#define C6_OTA_READ_SIZE CONFIG_C6_OTA_READ_SIZE
+#endif
+#define C6_OTA_READ_MIN 4096
+
+/* the reader task reads up to this many bytes ahead of the OTA writes, the card keeps reading while an RPC to the
+ * C6 is in flight and the other way round */
+#ifndef C6_OTA_RING_SIZE
+#define C6_OTA_RING_SIZE CONFIG_C6_OTA_RING_SIZE
 #endif
 
+/* CONFIG_C6_OTA_SIZE_SWEEP: C6_OTA_SWEEP_BYTES of the image go with each of these write sizes below the write size
+ * in turn, the rest with the write size. The time in OTA writes is logged per size, one update gives the whole table. */
+#define C6_OTA_SWEEP_BYTES (64 * 1024)
+#ifdef CONFIG_C6_OTA_SIZE_SWEEP
+static const int sweep_sizes[] = { 256, 512, 1024, 2048, 4096, 8192, 16384 };
+#define SWEEP_STEPS (sizeof(sweep_sizes) / sizeof(sweep_sizes[0]) + 1)
+#else
+#define SWEEP_STEPS 1
+#endif
+
+typedef struct {
+	int size; /* bytes per esp_hosted_slave_ota_write */
+	size_t bytes;
+	int64_t write_us;
+} c6_write_step_t;
+
+typedef struct {
+	uint8_t *data;
+	int len; /* bytes in data, 0 at the end of the file, -1 on a read error */
+} c6_chunk_t;
+
+typedef struct {
+	FILE *file;
+	size_t read_size;
+	int write_size; /* bytes per esp_hosted_slave_ota_write */
+	QueueHandle_t empty; /* free chunk buffers */
+	QueueHandle_t full; /* c6_chunk_t in file order */
+	volatile bool abort; /* set by the writer, the reader stops with its next chunk */
+	image_stream_t image; /* every chunk is checked right after it was read, before it goes to the C6 */
+} c6_reader_t;
+
 static int compare_self_version_with_slave_version(uint32_t slave_version)
 {
     uint32_t host_version = ESP_HOSTED_VERSION_VAL(ESP_HOSTED_VERSION_MAJOR_1,
@@ -79,102 +135,6 @@ static int compare_host_slave_version(void)
     return compare_self_version_with_slave_version(slave_version);
 }
 
-/* Function to parse ESP32 image header and get firmware info from file */
-static esp_err_t parse_image_header_from_file(const char* file_path, size_t* firmware_size, char* app_version_str, size_t version_str_len)
-{
-	FILE* file;
-	esp_image_header_t image_header;
-	esp_image_segment_header_t segment_header;
-	esp_app_desc_t app_desc;
-	size_t offset = 0;
-	size_t total_size = 0;
-
-	file = fopen(file_path, "rb");
-	if (file == NULL) {
-		ESP_LOGE(TAG, "Failed to open firmware file for header verification: %s", file_path);
-		return ESP_FAIL;
-	}
-
-	/* Read image header */
-	if (fread(&image_header, sizeof(image_header), 1, file) != 1) {
-		ESP_LOGE(TAG, "Failed to read image header from file");
-		fclose(file);
-		return ESP_FAIL;
-	}
-
-	/* Validate magic number */
-	if (image_header.magic != ESP_IMAGE_HEADER_MAGIC) {
-		ESP_LOGE(TAG, "Invalid image magic: 0x%" PRIx8, image_header.magic);
-		fclose(file);
-		return ESP_ERR_INVALID_ARG;
-	}
-
-	ESP_LOGI(TAG, "Image header: magic=0x%" PRIx8 ", segment_count=%" PRIu8 ", hash_appended=%" PRIu8,
-			image_header.magic, image_header.segment_count, image_header.hash_appended);
-
-	/* Calculate total size by reading all segments */
-	offset = sizeof(image_header);
-	total_size = sizeof(image_header);
-
-	for (int i = 0; i < image_header.segment_count; i++) {
-		/* Read segment header */
-		if (fseek(file, offset, SEEK_SET) != 0 ||
-				fread(&segment_header, sizeof(segment_header), 1, file) != 1) {
-			ESP_LOGE(TAG, "Failed to read segment %d header", i);
-			fclose(file);
-			return ESP_FAIL;
-		}
-
-		ESP_LOGI(TAG, "Segment %d: data_len=%" PRIu32 ", load_addr=0x%" PRIx32, i, segment_header.data_len, segment_header.load_addr);
-
-		/* Add segment header size + data size */
-		total_size += sizeof(segment_header) + segment_header.data_len;
-		offset += sizeof(segment_header) + segment_header.data_len;
-
-		/* Read app description from the first segment */
-		if (i == 0) {
-			size_t app_desc_offset = sizeof(image_header) + sizeof(segment_header);
-			if (fseek(file, app_desc_offset, SEEK_SET) == 0 &&
-					fread(&app_desc, sizeof(app_desc), 1, file) == 1) {
-				strncpy(app_version_str, app_desc.version, version_str_len - 1);
-				app_version_str[version_str_len - 1] = '\0';
-				ESP_LOGI(TAG, "Found app description: version='%s', project_name='%s'",
-						app_desc.version, app_desc.project_name);
-			} else {
-				ESP_LOGW(TAG, "Failed to read app description");
-				strncpy(app_version_str, "unknown", version_str_len - 1);
-				app_version_str[version_str_len - 1] = '\0';
-			}
-		}
-	}
-
-	/* Add padding to align to 16 bytes */
-	size_t padding = (16 - (total_size % 16)) % 16;
-	if (padding > 0) {
-		ESP_LOGD(TAG, "Adding %u bytes of padding for alignment", (unsigned int)padding);
-		total_size += padding;
-	}
-
-	/* Add the checksum byte (always present) */
-	total_size += 1;
-	ESP_LOGD(TAG, "Added 1 byte for checksum");
-
-	/* Add SHA256 hash if appended */
-	bool has_hash = (image_header.hash_appended == 1);
-	if (has_hash) {
-		total_size += 32;  // SHA256 hash is 32 bytes
-		ESP_LOGD(TAG, "Added 32 bytes for SHA256 hash (hash_appended=1)");
-	} else {
-		ESP_LOGD(TAG, "No SHA256 hash appended (hash_appended=0)");
-	}
-
-	*firmware_size = total_size;
-	ESP_LOGI(TAG, "Total image size: %u bytes", (unsigned int)*firmware_size);
-
-	fclose(file);
-	return ESP_OK;
-}
-
 /* Find latest firmware file in sd card */
 static esp_err_t find_latest_firmware(char* firmware_path, size_t max_len, const char *mount_point)
 {
@@ -250,19 +210,287 @@ static esp_err_t find_latest_firmware(char* firmware_path, size_t max_len, const
 	return ESP_OK;
 }
 
+/* Reads the next chunk and runs it through the image check, len -1 on a read error or a bad image */
+static void read_chunk(c6_reader_t *reader, c6_chunk_t *chunk)
+{
+	xQueueReceive(reader->empty, &chunk->data, portMAX_DELAY);
+	size_t n = reader->abort ? 0 : fread(chunk->data, 1, reader->read_size, reader->file);
+	if (n == 0 && ferror(reader->file)) {
+		ESP_LOGE(TAG, "Failed to read firmware file");
+		chunk->len = -1;
+	} else if (image_stream_feed(&reader->image, chunk->data, n) != ESP_OK) {
+		chunk->len = -1;
+	} else {
+		chunk->len = (int)n;
+	}
+}
+
+/* Fills chunks from the card until the end of the file, a read error, a bad image or an abort, then sends a last
+ * chunk with len <= 0 and ends. */
+static void reader_task(void *arg)
+{
+	c6_reader_t *reader = arg;
+	c6_chunk_t chunk;
+	do {
+		read_chunk(reader, &chunk);
+		xQueueSend(reader->full, &chunk, portMAX_DELAY);
+	} while (chunk.len > 0);
+	vTaskDelete(NULL);
+}
+
+/* write sizes send_chunks goes through, the last one takes the rest of the image. Returns the number of steps. */
+static int write_steps(c6_write_step_t *steps, int write_size)
+{
+	int n = 0;
+#ifdef CONFIG_C6_OTA_SIZE_SWEEP
+	for (int i = 0; i < SWEEP_STEPS - 1 && sweep_sizes[i] < write_size; i++) {
+		steps[n++] = (c6_write_step_t){ .size = sweep_sizes[i] };
+	}
+#endif
+	steps[n++] = (c6_write_step_t){ .size = write_size };
+	return n;
+}
+
+/* write size for the image bytes from written on: step i of a sweep covers C6_OTA_SWEEP_BYTES, returns the bytes
+ * to send with it (up to max) */
+static int step_bytes(c6_write_step_t *steps, int count, size_t written, int max, c6_write_step_t **step)
+{
+	const int i = (int)(written / C6_OTA_SWEEP_BYTES);
+	*step = &steps[i < count - 1 ? i : count - 1];
+	int n = max < (*step)->size ? max : (*step)->size;
+	const size_t step_end = (size_t)(i + 1) * C6_OTA_SWEEP_BYTES;
+	if (i < count - 1 && step_end - written < (size_t)n) {
+		n = (int)(step_end - written);
+	}
+	return n;
+}
+
+static void log_write_steps(const c6_write_step_t *steps, int count)
+{
+	if (count < 2) {
+		return;
+	}
+	ESP_LOGI(TAG, "OTA write size sweep, time in esp_hosted_slave_ota_write per size:");
+	ESP_LOGI(TAG, "| write size | bytes | OTA write ms | KB/s |");
+	for (int i = 0; i < count; i++) {
+		ESP_LOGI(TAG, "| %d | %u | %lu | %lu |", steps[i].size, (unsigned int)steps[i].bytes,
+				(unsigned long)(steps[i].write_us / 1000),
+				(unsigned long)(steps[i].write_us ? (int64_t)steps[i].bytes * 1000 / steps[i].write_us : 0));
+	}
+}
+
+/* Takes the chunks from the reader and sends them to the C6 until the reader's last chunk. After a failed write the
+ * reader is stopped and its remaining chunks are dropped. */
+static esp_err_t send_chunks(c6_reader_t *reader)
+{
+	esp_err_t ret = ESP_OK;
+	size_t written = 0;
+	int64_t wait_us = 0, write_us = 0;
+	c6_write_step_t steps[SWEEP_STEPS];
+	const int step_count = write_steps(steps, reader->write_size);
+	const int64_t start = esp_timer_get_time();
+	c6_chunk_t chunk;
+	do {
+		int64_t t = esp_timer_get_time();
+		xQueueReceive(reader->full, &chunk, portMAX_DELAY);
+		wait_us += esp_timer_get_time() - t;
+		for (int off = 0; off < chunk.len && ret == ESP_OK; ) {
+			c6_write_step_t *step;
+			const int n = step_bytes(steps, step_count, written, chunk.len - off, &step);
+			t = esp_timer_get_time();
+			ret = esp_hosted_slave_ota_write(chunk.data + off, n);
+			t = esp_timer_get_time() - t;
+			write_us += t;
+			if (ret != ESP_OK) {
+				ESP_LOGE(TAG, "Failed to write OTA chunk: %s", esp_err_to_name(ret));
+				reader->abort = true;
+			} else {
+				written += n;
+				off += n;
+				step->bytes += n;
+				step->write_us += t;
+			}
+		}
+		if (chunk.len < 0) {
+			ESP_LOGE(TAG, "Stopped before the rest of the image went to the C6");
+			ret = ESP_FAIL;
+		}
+		xQueueSend(reader->empty, &chunk.data, 0);
+	} while (chunk.len > 0);
+
+	/* with the pipeline running, total is close to the larger of write and card time, not their sum */
+	const int64_t total_us = esp_timer_get_time() - start;
+	ESP_LOGI(TAG, "Sent %u bytes in %lu ms (%lu KB/s), OTA writes %lu ms, waiting for the card %lu ms, "
+			"reads of %u, writes of %u bytes",
+			(unsigned int)written, (unsigned long)(total_us / 1000),
+			(unsigned long)(total_us ? (int64_t)written * 1000 / total_us : 0),
+			(unsigned long)(write_us / 1000), (unsigned long)(wait_us / 1000),
+			(unsigned int)reader->read_size, (unsigned int)reader->write_size);
+	log_write_steps(steps, step_count);
+	return ret;
+}
+
+/* C6_OTA_READ_SIZE, or the cluster size of the storage (the only FAT volume, drive 0), whole 512 byte sectors and
+ * at most half the ring */
+static size_t card_read_size(void)
+{
+	size_t size = C6_OTA_READ_SIZE;
+	if (size == 0) {
+		FATFS *fs;
+		DWORD free_clusters; /* from FSINFO, the FAT is not scanned on a card with valid FSINFO */
+		if (f_getfree("0:", &free_clusters, &fs) == FR_OK) {
+#if FF_MAX_SS != FF_MIN_SS
+			size = (size_t)fs->csize * fs->ssize;
+#else
+			size = (size_t)fs->csize * FF_MAX_SS;
+#endif
+		} else {
+			ESP_LOGW(TAG, "Could not get the cluster size, reading %u bytes", C6_OTA_READ_MIN);
+		}
+	}
+	size &= ~(size_t)511;
+	if (size < C6_OTA_READ_MIN) size = C6_OTA_READ_MIN;
+	if (size > C6_OTA_RING_SIZE / 2) size = C6_OTA_RING_SIZE / 2;
+	return size;
+}
+
+/* C6_OTA_WRITE_SIZE if set, otherwise a card read split into as few writes of at most C6_OTA_RPC_PAYLOAD as
+ * possible, all the same size but the last: a cluster goes out without a short write left over at its end */
+static int c6_write_size(size_t read_size)
+{
+	if (C6_OTA_WRITE_SIZE > 0) {
+		return C6_OTA_WRITE_SIZE;
+	}
+	const size_t writes = (read_size + C6_OTA_RPC_PAYLOAD - 1) / C6_OTA_RPC_PAYLOAD;
+	return (int)((read_size + writes - 1) / writes);
+}
+
+/* true if the C6 already runs version, the OTA is skipped then */
+static bool slave_runs_version(const char *version)
+{
+	esp_hosted_coprocessor_fwver_t current_slave_version = {0};
+	esp_err_t version_ret = esp_hosted_get_coprocessor_fwversion(&current_slave_version);
+
+	if (version_ret != ESP_OK) {
+		ESP_LOGW(TAG, "Could not get current slave firmware version (error: %s), proceeding with OTA",
+				esp_err_to_name(version_ret));
+		return false;
+	}
+
+	char current_version_str[32];
+	snprintf(current_version_str, sizeof(current_version_str), "%" PRIu32 ".%" PRIu32 ".%" PRIu32,
+			current_slave_version.major1, current_slave_version.minor1, current_slave_version.patch1);
+
+	ESP_LOGI(TAG, "Current slave firmware version: %s", current_version_str);
+	ESP_LOGI(TAG, "New slave firmware version: %s", version);
+
+	if (strcmp(version, current_version_str) == 0) {
+		ESP_LOGW(TAG, "Current slave firmware version (%s) is the same as new version (%s). Skipping OTA.",
+				current_version_str, version);
+		return true;
+	}
+	ESP_LOGI(TAG, "Version differs - proceeding with OTA from %s to %s", current_version_str, version);
+	return false;
+}
+
+/* Closes the OTA session on the C6 after a failure, so the next update does not find it open. The C6 checks the image
+ * at OTA end: the chunk the image check failed on and everything after it never went out, so the incomplete image is
+ * refused there and its boot partition stays as it is. */
+static void end_failed_ota(void)
+{
+	esp_err_t err = esp_hosted_slave_ota_end();
+	if (err == ESP_OK) {
+		ESP_LOGE(TAG, "C6 accepted the incomplete image at OTA end, it is not activated");
+	} else {
+		ESP_LOGI(TAG, "C6 OTA session closed, the image was refused as expected: %s", esp_err_to_name(err));
+	}
+}
+
+/* Checks the head of the image, the C6 version and begins the OTA, then sends the file to the C6 while a reader
+ * task reads ahead. The update takes about as long as the slower of the SD card and the link to the C6 instead of
+ * both added up, the file is read once: image header, segments, checksum and SHA-256 are checked as it streams. */
+static esp_err_t send_firmware(c6_reader_t *reader)
+{
+	/* the first chunk has the image header and the app descriptor with the version */
+	c6_chunk_t chunk;
+	read_chunk(reader, &chunk);
+	const esp_app_desc_t *app_desc = image_stream_app_desc(&reader->image);
+	if (chunk.len <= 0 || app_desc == NULL) {
+		ESP_LOGE(TAG, "Firmware file is not a C6 app image");
+		return ESP_HOSTED_SLAVE_OTA_FAILED;
+	}
+	char new_app_version[sizeof(app_desc->version) + 1] = {0};
+	memcpy(new_app_version, app_desc->version, sizeof(app_desc->version));
+	ESP_LOGI(TAG, "Found app description: version='%s', project_name='%.32s'", new_app_version, app_desc->project_name);
+	if (slave_runs_version(new_app_version)) {
+		return ESP_HOSTED_SLAVE_OTA_NOT_REQUIRED;
+	}
+
+	/* Begin OTA */
+	esp_err_t ret = esp_hosted_slave_ota_begin();
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "Failed to begin OTA: %s", esp_err_to_name(ret));
+		return ESP_HOSTED_SLAVE_OTA_FAILED;
+	}
+
+	/* Write firmware in chunks, read ahead from the card, the first chunk goes first */
+	xQueueSend(reader->full, &chunk, 0);
+	/* same priority as the writer, neither side starves the other */
+	if (xTaskCreate(reader_task, "c6_ota_read", 4096, reader, uxTaskPriorityGet(NULL), NULL) != pdPASS) {
+		ESP_LOGE(TAG, "Failed to create reader task");
+		end_failed_ota();
+		return ESP_HOSTED_SLAVE_OTA_FAILED;
+	}
+	ret = send_chunks(reader); /* returns after the reader's last chunk, the task is gone then */
+	/* the whole image went through the check, a file that ends early or a SHA-256 mismatch is not activated */
+	if (ret != ESP_OK || image_stream_finish(&reader->image) != ESP_OK) {
+		end_failed_ota();
+		return ESP_HOSTED_SLAVE_OTA_FAILED;
+	}
+	return ESP_HOSTED_SLAVE_OTA_COMPLETED;
+}
+
+/* Sets up the read ahead ring for file and sends it, ESP_HOSTED_SLAVE_OTA_* */
+static esp_err_t write_firmware(FILE *file)
+{
+	c6_reader_t reader = { .file = file, .read_size = card_read_size() };
+	reader.write_size = c6_write_size(reader.read_size);
+	ESP_LOGI(TAG, "Card reads of %u bytes, OTA writes of %d bytes", (unsigned int)reader.read_size, reader.write_size);
+	const int chunks = C6_OTA_RING_SIZE / reader.read_size;
+	uint8_t *ring = malloc(reader.read_size * chunks);
+	reader.empty = xQueueCreate(chunks, sizeof(uint8_t *));
+	reader.full = xQueueCreate(chunks, sizeof(c6_chunk_t));
+	esp_err_t ret = ESP_ERR_NO_MEM;
+
+	/* no stdio buffer in between, fread hands the whole read to FatFs */
+	setvbuf(file, NULL, _IONBF, 0);
+	if (!ring || !reader.empty || !reader.full) {
+		ESP_LOGE(TAG, "Failed to allocate the read ahead ring");
+	} else {
+		for (int i = 0; i < chunks; i++) {
+			uint8_t *data = ring + i * reader.read_size;
+			xQueueSend(reader.empty, &data, 0);
+		}
+		image_stream_init(&reader.image, ESP_CHIP_ID_ESP32C6);
+		ret = send_firmware(&reader);
+		image_stream_free(&reader.image);
+	}
+
+	if (reader.full) vQueueDelete(reader.full);
+	if (reader.empty) vQueueDelete(reader.empty);
+	free(ring);
+	return ret;
+}
+
 // internal function to perform ota from sd card
 static esp_err_t ota_c6_sd_perform_(bool delete_after_use, const char* mount_point)
 {
 	char *firmware_path = malloc(256); // Use heap instead of stack
 	FILE *firmware_file;
-	uint8_t *chunk = malloc(CHUNK_SIZE); // Use heap for chunk buffer
-	size_t bytes_read;
 	esp_err_t ret = ESP_OK;
 
-	if (!firmware_path || !chunk) {
+	if (!firmware_path) {
 		ESP_LOGE(TAG, "Failed to allocate memory");
-		if (firmware_path) free(firmware_path);
-		if (chunk) free(chunk);
 		return ESP_ERR_NO_MEM;
 	}
 
@@ -275,91 +503,31 @@ static esp_err_t ota_c6_sd_perform_(bool delete_after_use, const char* mount_poi
 	if (ret != ESP_OK) {
 		ESP_LOGE(TAG, "Failed to find firmware file");
 		free(firmware_path);
-		free(chunk);
 		return ESP_HOSTED_SLAVE_OTA_FAILED;
 	}
 	ESP_LOGI(TAG, "Firmware file found: %s", firmware_path);
 
-	/* Verify image header and get firmware info */
-	size_t firmware_size;
-	char new_app_version[32];
-	ret = parse_image_header_from_file(firmware_path, &firmware_size, new_app_version, sizeof(new_app_version));
-	if (ret != ESP_OK) {
-		ESP_LOGE(TAG, "Failed to parse image header: %s", esp_err_to_name(ret));
-		free(firmware_path);
-		free(chunk);
-		return ESP_HOSTED_SLAVE_OTA_FAILED;
-	}
-
-	ESP_LOGI(TAG, "Firmware verified - Size: %u bytes, Version: %s", (unsigned int)firmware_size, new_app_version);
-
-	/* Get current running slave firmware version */
-	esp_hosted_coprocessor_fwver_t current_slave_version = {0};
-	esp_err_t version_ret = esp_hosted_get_coprocessor_fwversion(&current_slave_version);
-
-	if (version_ret == ESP_OK) {
-		char current_version_str[32];
-		snprintf(current_version_str, sizeof(current_version_str), "%" PRIu32 ".%" PRIu32 ".%" PRIu32,
-				current_slave_version.major1, current_slave_version.minor1, current_slave_version.patch1);
-
-		ESP_LOGI(TAG, "Current slave firmware version: %s", current_version_str);
-		ESP_LOGI(TAG, "New slave firmware version: %s", new_app_version);
-
-		if (strcmp(new_app_version, current_version_str) == 0) {
-			ESP_LOGW(TAG, "Current slave firmware version (%s) is the same as new version (%s). Skipping OTA.",
-					current_version_str, new_app_version);
-			free(firmware_path);
-			free(chunk);
-			return ESP_HOSTED_SLAVE_OTA_NOT_REQUIRED;
-		}
-
-		ESP_LOGI(TAG, "Version differs - proceeding with OTA from %s to %s", current_version_str, new_app_version);
-	} else {
-		ESP_LOGW(TAG, "Could not get current slave firmware version (error: %s), proceeding with OTA",
-				esp_err_to_name(version_ret));
-	}
-
 	/* Open firmware file */
 	firmware_file = fopen(firmware_path, "rb");
 	if (firmware_file == NULL) {
 		ESP_LOGE(TAG, "Failed to open firmware file: %s", firmware_path);
 		free(firmware_path);
-		free(chunk);
 		return ESP_FAIL;
 	}
 
 	ESP_LOGI(TAG, "Starting OTA from sd card: %s", firmware_path);
-
-	/* Begin OTA */
-	ret = esp_hosted_slave_ota_begin();
-	if (ret != ESP_OK) {
-		ESP_LOGE(TAG, "Failed to begin OTA: %s", esp_err_to_name(ret));
-		fclose(firmware_file);
+	ret = write_firmware(firmware_file);
+	fclose(firmware_file);
+	if (ret != ESP_HOSTED_SLAVE_OTA_COMPLETED) {
 		free(firmware_path);
-		free(chunk);
-		return ESP_HOSTED_SLAVE_OTA_FAILED;
+		return ret;
 	}
 
-	/* Write firmware in chunks */
-	while ((bytes_read = fread(chunk, 1, CHUNK_SIZE, firmware_file)) > 0) {
-		ret = esp_hosted_slave_ota_write(chunk, bytes_read);
-		if (ret != ESP_OK) {
-			ESP_LOGE(TAG, "Failed to write OTA chunk: %s", esp_err_to_name(ret));
-			fclose(firmware_file);
-			free(firmware_path);
-			free(chunk);
-			return ESP_HOSTED_SLAVE_OTA_FAILED;
-		}
-	}
-
-	fclose(firmware_file);
-
 	/* End OTA */
 	ret = esp_hosted_slave_ota_end();
 	if (ret != ESP_OK) {
 		ESP_LOGE(TAG, "Failed to end OTA: %s", esp_err_to_name(ret));
 		free(firmware_path);
-		free(chunk);
 		return ESP_HOSTED_SLAVE_OTA_FAILED;
 	}
 
@@ -377,7 +545,6 @@ static esp_err_t ota_c6_sd_perform_(bool delete_after_use, const char* mount_poi
 
 	/* Clean up allocated memory */
 	free(firmware_path);
-	free(chunk);
 
 	return ESP_HOSTED_SLAVE_OTA_COMPLETED;
 }
@@ -408,6 +575,7 @@ esp_err_t ota_c6_sd_perform(bool delete_after_use, const char* mount_point){
 
 	if (ret == ESP_HOSTED_SLAVE_OTA_COMPLETED) {
 		ESP_LOGI(TAG, "OTA completed successfully");
+		spi_event_post(SpiEventOta, 1, SpiOtaVerified);
 
 		/* Activate the new firmware */
 		ret = esp_hosted_slave_ota_activate();
@@ -421,6 +589,7 @@ esp_err_t ota_c6_sd_perform(bool delete_after_use, const char* mount_point){
 		ESP_LOGI(TAG, "OTA not required");
 	} else {
 		ESP_LOGE(TAG, "OTA failed: %s", esp_err_to_name(ret));
+		spi_event_post(SpiEventOta, 1, SpiOtaFailed);
 	}
 	return ret;
 }
\ No newline at end of file
@@ -1,37 +1,186 @@
+#include <stdlib.h>
+#include <string.h>
 #include "spi_api.h"
 #include "freertos/FreeRTOS.h"
-#include "task.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#ifdef CONFIG_SPI_API_QUAD
+#include "driver/spi_slave_hd.h"
+#else
 #include "driver/spi_slave.h"
+#endif
 #include "driver/gpio.h"
 #include "esp_log.h"
 #include "esp_ota_ops.h"
+#include "esp_app_desc.h"
+#include "tusb.h"
+#include "esp_timer.h"
+#include "custom_sdmmc_cmd.h"
+#include "msc_stats.h"
+#include "spi_proto.h"
+#include "spi_link.h"
+#include "spi_file.h"
+#include "spi_calib.h"
+#include "storage_shutdown.h"
+#include "spi_ota.h"
+#include "spi_events.h"
+
+static const char *TAG = "spi_api";
 
 static TaskHandle_t hTask;
-static spi_slave_transaction_t transaction;
-static uint8_t *send_buffer, *receive_buffer;
 
-#define RCV_HOST    SPI3_HOST // SPI2 connects to rp2350 spi1
-#define GPIO_HANDSHAKE GPIO_NUM_50 // GPIO50 is used for handshake line, P4_PICO_02 which is GPIO18 on rp2350
-#define GPIO_MOSI GPIO_NUM_23
-#define GPIO_MISO GPIO_NUM_22
-#define GPIO_SCLK GPIO_NUM_21
-#define GPIO_CS GPIO_NUM_20
+/* Task layout: spi_task only moves frames. It validates what the master clocks in, answers link level traffic (NAKs,
+ * resends), copies requests to the worker of their class and arms the answer frames the workers staged. Workers run
+ * the requests, so a slow file read never holds up a reboot or status query and neither blocks the SPI queue.
+ */
+
+/* One exchange is one frame each way. The full duplex driver clocks both in one transaction. With CONFIG_SPI_API_QUAD
+ * the half duplex driver has a receive transaction for the master's frame (WRDMA) and a send transaction for the
+ * slave's (RDDMA), the master writes first and reads second, so the pair completes in that order.
+ */
+typedef struct {
+    uint8_t* own; // idle and NAK frames, data frames live in the ring
+    const uint8_t* tx; // frame armed to go out
+#ifdef CONFIG_SPI_API_QUAD
+    spi_slave_hd_data_t rx_trans;
+    spi_slave_hd_data_t tx_trans;
+#else
+    spi_slave_transaction_t trans;
+#endif
+} spi_exchange_t;
+
+static spi_exchange_t exchanges[SPI_QUEUE_DEPTH];
+static spi_link_t link_state; // only spi_task touches it, GetStats gets a copy of the counters from spi_task
+
+// The master does not wait for an answer before sending its next request. Every worker takes up to this many requests
+// (queued or in progress), a request finding its worker full is NAKed and comes again.
+#ifndef SPI_PENDING_REQUESTS
+#define SPI_PENDING_REQUESTS 4
+#endif
+// answer frames staged by the workers, a worker streaming a long answer waits for one to go out before building more
+#ifndef SPI_TX_BUFFERS
+#define SPI_TX_BUFFERS 4
+#endif
+static QueueHandle_t tx_free; // staging buffers, header (type, length, ref) and payload
+static QueueHandle_t tx_ready; // staged answer frames in the order spi_task arms them
 
 typedef enum{
-    Reboot = 0x13, // reboots the device
-    GetFirmwareInfo = 0x19, // returns json {"HWV": hardware version, "FWV": firmware version, "OTA": active ota partition}
-    RebootToOTAX = 0x22, // reboots the device to OTAX, args [X (uint8_t)]
-} RequestType;
+    SpiClassControl, // link setup, reboots and status, short and never stuck behind file I/O
+    SpiClassBulk, // file requests
+    SPI_CLASS_COUNT
+} spi_class_t;
+
+typedef struct {
+    const char* name;
+    UBaseType_t priority;
+    BaseType_t core;
+    QueueHandle_t requests; // request frames in arrival order
+    QueueHandle_t free; // request buffers
+} spi_worker_t;
+
+static spi_worker_t workers[SPI_CLASS_COUNT] = {
+    [SpiClassControl] = { .name = "spi_control", .priority = 9, .core = tskNO_AFFINITY },
+    [SpiClassBulk] = { .name = "spi_bulk", .priority = 5, .core = tskNO_AFFINITY },
+};
+
+// Handshake is high while there is work: data frames armed, answer frames staged or requests queued or in progress.
+// It only falls once all answers went out, the master clocks on its own only when it has a new request.
+static portMUX_TYPE handshake_lock = portMUX_INITIALIZER_UNLOCKED;
+static int handshake_frames;
+static int handshake_work;
+// Events raise the handshake until a frame with SPI_STATUS_EVENTS went out that was armed after the last post, or until
+// GetEvents emptied the queue.
+// events_gen counts the posts, every exchange remembers the count it was armed at.
+static bool handshake_events;
+static uint32_t events_gen;
+static uint32_t armed_gen[SPI_QUEUE_DEPTH];
+
+// GetStats: the per request type counters, written by the workers under stats_lock
+static const uint8_t stats_types[] = {
+    Hello, Reboot, GetFirmwareInfo, GetStats, GetEvents, RebootToOTAX, FileOpen, FileRead, FileWrite, FileClose, FileStat, FileList,
+    Calibrate, SetCalibration, GetCalibration, OtaBegin, OtaWrite, OtaEnd, OtaStatus,
+    0xFF // anything else
+};
+#define STATS_TYPES (sizeof(stats_types))
+static struct {
+    uint32_t count;
+    uint64_t total_us;
+    uint32_t max_us;
+} type_stats[STATS_TYPES];
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+// link counters for GetStats: the worker posts a request under stats_lock, spi_task copies (and resets) them
+// between two frames and gives stats_done
+typedef enum { StatsNone, StatsCopy, StatsCopyReset } stats_request_t;
+static stats_request_t stats_request;
+static spi_stats_t stats_copy;
+static SemaphoreHandle_t stats_done;
+#ifndef SPI_STATS_TIMEOUT_MS
+#define SPI_STATS_TIMEOUT_MS 100 // GetStats waits this long for spi_task to copy the link counters
+#endif
+
+// pins, peripheral and task placement come from menuconfig ("SPI command interface"), frame size and queue depth
+// are handed to the whole component as SPI_MAX_FRAME_SIZE and SPI_QUEUE_DEPTH by main/CMakeLists.txt
+#ifdef CONFIG_SPI_API_HOST_SPI2
+#define RCV_HOST    SPI2_HOST
+#else
+#define RCV_HOST    SPI3_HOST // connects to rp2350 spi1
+#endif
+#define GPIO_HANDSHAKE CONFIG_SPI_API_PIN_HANDSHAKE
+#define GPIO_MOSI CONFIG_SPI_API_PIN_MOSI
+#define GPIO_MISO CONFIG_SPI_API_PIN_MISO
+#define GPIO_SCLK CONFIG_SPI_API_PIN_SCLK
+#define GPIO_CS CONFIG_SPI_API_PIN_CS
+#ifdef CONFIG_SPI_API_QUAD
+#define GPIO_D2 CONFIG_SPI_API_PIN_D2
+#define GPIO_D3 CONFIG_SPI_API_PIN_D3
+#define SPI_DATA_LINES 4 // most Hello grants, the half duplex driver takes whatever the command code asks for
+#else
+#define GPIO_D2 -1
+#define GPIO_D3 -1
+#define SPI_DATA_LINES 1 // the full duplex driver clocks one line each way
+#endif
+#define SPI_TASK_PRIORITY CONFIG_SPI_API_TASK_PRIORITY
+#if CONFIG_SPI_API_TASK_CORE < 0
+#define SPI_TASK_CORE tskNO_AFFINITY
+#define SPI_ISR_CORE ESP_INTR_CPU_AFFINITY_AUTO
+#else
+#define SPI_TASK_CORE CONFIG_SPI_API_TASK_CORE
+#define SPI_ISR_CORE (ESP_INTR_CPU_AFFINITY_0 + CONFIG_SPI_API_TASK_CORE) // the SPI interrupt next to spi_task
+#endif
+
+#ifndef SPI_FILE_LIST_MAX
+#define SPI_FILE_LIST_MAX 8192 // FileList answers are cut at this size
+#endif
 
-static void boot_into_slot(int slot) { // slot 0 or 1
+// Reboot: the restart comes at the deadline at the latest, the last part of it is kept for the answer to go out
+#ifndef SPI_SHUTDOWN_DEADLINE_MS
+#define SPI_SHUTDOWN_DEADLINE_MS 3000
+#endif
+#ifndef SPI_SHUTDOWN_ACK_MS
+#define SPI_SHUTDOWN_ACK_MS 100
+#endif
+static const sdmmc_card_t* sd_card; // NULL for SPI flash storage
+
+// largest frame the slave sends, lowered by Hello to what the master can clock
+static uint16_t frame_size = SPI_MAX_FRAME_SIZE;
+
+// GetFirmwareInfo answers, built once by spi_start and again only when the link settings change (Hello,
+// SetCalibration). Answering is a copy, no formatting, partition lookups or logging.
+#define FIRMWARE_INFO_JSON_MAX 512
+static spi_firmware_info_t firmware_info;
+static char firmware_info_json[FIRMWARE_INFO_JSON_MAX];
+static uint16_t firmware_info_json_len;
+
+// slot 0 or 1, takes effect with the next restart
+static esp_err_t set_boot_slot(int slot){
     esp_partition_subtype_t st = (slot == 0)
         ? ESP_PARTITION_SUBTYPE_APP_OTA_0
         : ESP_PARTITION_SUBTYPE_APP_OTA_1;
     const esp_partition_t *p = esp_partition_find_first(ESP_PARTITION_TYPE_APP, st, NULL);
-    if (!p) return;
-    printf("Try to boot into %s\n", p->label);
-    if (esp_ota_set_boot_partition(p) == ESP_OK) esp_restart();
-    printf("Boot into %s\n not successful", p->label);
+    if (!p) return ESP_ERR_NOT_FOUND;
+    ESP_LOGI(TAG, "Next boot into %s", p->label);
+    return esp_ota_set_boot_partition(p);
 }
 
 static const char* esp_get_current_ota_label(void){
@@ -51,6 +200,43 @@ static const char* esp_get_current_ota_label(void){
     }
 }
 
+// fields that do not change while running
+static void firmware_info_init(const sdmmc_card_t* card){
+    spi_firmware_info_t* info = &firmware_info;
+    const esp_app_desc_t* app = esp_app_get_description();
+    snprintf(info->hw_version, sizeof(info->hw_version), "%s", "DADA");
+    snprintf(info->fw_version, sizeof(info->fw_version), "%s", "tusb_msc_1.1");
+    snprintf(info->ota, sizeof(info->ota), "%s", esp_get_current_ota_label());
+    snprintf(info->app_version, sizeof(info->app_version), "%s", app->version);
+    snprintf(info->project, sizeof(info->project), "%s", app->project_name);
+    snprintf(info->idf_version, sizeof(info->idf_version), "%s", app->idf_ver);
+    snprintf(info->build_date, sizeof(info->build_date), "%s", app->date);
+    snprintf(info->build_time, sizeof(info->build_time), "%s", app->time);
+    memcpy(info->app_sha256, app->app_elf_sha256, sizeof(info->app_sha256));
+    if (card){
+        memcpy(info->sd_name, card->cid.name, sizeof(info->sd_name) - 1);
+        info->sd_sectors = card->csd.capacity;
+        info->sd_sector_size = card->csd.sector_size;
+        info->sd_freq_khz = card->real_freq_khz;
+    }
+    info->usb_high_speed = TUD_OPT_HIGH_SPEED;
+}
+
+// link settings and json, after Hello or SetCalibration
+static void firmware_info_update(void){
+    spi_firmware_info_t* info = &firmware_info;
+    info->frame = frame_size;
+    info->spi_clock_hz = spi_calib_get()->clock_hz;
+    const int n = snprintf(firmware_info_json, sizeof(firmware_info_json),
+        "{\"HWV\": \"%s\", \"FWV\": \"%s\", \"OTA\": \"%s\", \"APP\": \"%s\", \"PROJECT\": \"%s\", "
+        "\"IDF\": \"%s\", \"BUILD\": \"%s %s\", \"SD\": {\"NAME\": \"%s\", \"SECTORS\": %lu, \"SECTOR_SIZE\": %u, "
+        "\"KHZ\": %lu}, \"USB_HS\": %u, \"SPI\": {\"FRAME\": %u, \"HZ\": %lu}}",
+        info->hw_version, info->fw_version, info->ota, info->app_version, info->project, info->idf_version,
+        info->build_date, info->build_time, info->sd_name, (unsigned long)info->sd_sectors, info->sd_sector_size,
+        (unsigned long)info->sd_freq_khz, info->usb_high_speed, info->frame, (unsigned long)info->spi_clock_hz);
+    firmware_info_json_len = (n < 0) ? 0 : (n < sizeof(firmware_info_json) ? n : sizeof(firmware_info_json) - 1);
+}
+
 static int count_bootable_ota_partitions(void) {
     int count = 0;
     esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, NULL);
@@ -68,129 +254,613 @@ static int count_bootable_ota_partitions(void) {
     return count;
 }
 
-static bool transmitCString(const RequestType reqType, const char* str){
-    uint32_t len = strlen(str);
-    // fields are: // 0xCA, 0xFE, request type, length (uint32_t), cstring
-    uint8_t* requestTypeField = send_buffer + 2;
-    *requestTypeField = (uint8_t)(reqType);
-    uint32_t* lengthField = (uint32_t*)(send_buffer + 3);
-    uint32_t bytes_to_send = 0;
-    uint32_t bytes_sent = 0;
-    while (len > 0){
-        *lengthField = len;
-        bytes_to_send = len > 2048 - 7 ? 2048 - 7 : len; // 7 bytes for header
-        const char* ptr_cstring_section = str + bytes_sent;
-        memcpy(send_buffer + 7, ptr_cstring_section, bytes_to_send);
-        len -= bytes_to_send;
-        bytes_sent += bytes_to_send;
-        spi_slave_transmit(RCV_HOST, &transaction, portMAX_DELAY);
-        // fingerprint check
-        if (receive_buffer[0] != 0xCA || receive_buffer[1] != 0xFE){
-            return false;
-        }
-        // check request type acknowledgment
-        const uint8_t requestType = receive_buffer[2];
-        if (requestType != (uint8_t)reqType){
-            return false;
-        }
+IRAM_ATTR static void handshake_update(void){
+    gpio_set_level(GPIO_HANDSHAKE, handshake_frames > 0 || handshake_work > 0 || handshake_events);
+}
+
+static void events_notify(void){
+    portENTER_CRITICAL(&handshake_lock);
+    events_gen++;
+    handshake_events = true;
+    handshake_update();
+    portEXIT_CRITICAL(&handshake_lock);
+}
+
+// ex went out, with SPI_STATUS_EVENTS the master knows about every event posted before it was armed. A GetEvents
+// can also empty the queue before any frame carried the bit, then nothing is left to announce.
+static void events_announced(const spi_exchange_t *ex){
+    const spi_frame_header_t* sent = (const spi_frame_header_t*)ex->tx;
+    portENTER_CRITICAL(&handshake_lock);
+    const uint32_t gen = events_gen;
+    portEXIT_CRITICAL(&handshake_lock);
+    const bool pending = spi_events_pending(); // a post after this bumps events_gen before it raises the handshake
+    portENTER_CRITICAL(&handshake_lock);
+    if (handshake_events && (((sent->status & SPI_STATUS_EVENTS) && armed_gen[ex - exchanges] == events_gen)
+            || (!pending && gen == events_gen))){
+        handshake_events = false;
+        handshake_update();
+    }
+    portEXIT_CRITICAL(&handshake_lock);
+}
+
+static void add_work(int delta){
+    portENTER_CRITICAL(&handshake_lock);
+    handshake_work += delta;
+    handshake_update();
+    portEXIT_CRITICAL(&handshake_lock);
+}
+
+// data frames live in the ring, idle and NAK frames in the exchange's own buffer
+IRAM_ATTR static bool is_data_frame(const spi_exchange_t *ex){
+    return ex->tx != ex->own;
+}
+
+// hand an exchange back to the driver with tx as the frame to clock out, it goes after the ones already queued
+static void requeue(spi_exchange_t *ex, const uint8_t* tx){
+    ex->tx = tx;
+    portENTER_CRITICAL(&handshake_lock);
+    armed_gen[ex - exchanges] = events_gen;
+    if (is_data_frame(ex)){
+        handshake_frames++;
+        handshake_update();
+    }
+    portEXIT_CRITICAL(&handshake_lock);
+#ifdef CONFIG_SPI_API_QUAD
+    ex->tx_trans.data = (uint8_t*)tx;
+    ESP_ERROR_CHECK(spi_slave_hd_queue_trans(RCV_HOST, SPI_SLAVE_CHAN_RX, &ex->rx_trans, portMAX_DELAY));
+    ESP_ERROR_CHECK(spi_slave_hd_queue_trans(RCV_HOST, SPI_SLAVE_CHAN_TX, &ex->tx_trans, portMAX_DELAY));
+#else
+    ex->trans.tx_buffer = tx;
+    ESP_ERROR_CHECK(spi_slave_queue_trans(RCV_HOST, &ex->trans, portMAX_DELAY));
+#endif
+}
+
+// the next exchange the master finished, rx gets the master's frame and rx_len the bytes that came in
+static spi_exchange_t* next_exchange(uint8_t** rx, size_t* rx_len){
+#ifdef CONFIG_SPI_API_QUAD
+    spi_slave_hd_data_t *received = NULL;
+    spi_slave_hd_data_t *sent = NULL;
+    ESP_ERROR_CHECK(spi_slave_hd_get_trans_res(RCV_HOST, SPI_SLAVE_CHAN_RX, &received, portMAX_DELAY));
+    // the master reads right after its write, the exchange is rearmed only once its frame went out
+    ESP_ERROR_CHECK(spi_slave_hd_get_trans_res(RCV_HOST, SPI_SLAVE_CHAN_TX, &sent, portMAX_DELAY));
+    assert(sent->arg == received->arg);
+    *rx = received->data;
+    *rx_len = received->trans_len;
+    return (spi_exchange_t*)received->arg;
+#else
+    spi_slave_transaction_t *trans = NULL;
+    ESP_ERROR_CHECK(spi_slave_get_trans_result(RCV_HOST, &trans, portMAX_DELAY));
+    *rx = (uint8_t*)trans->rx_buffer;
+    *rx_len = trans->trans_len / 8;
+    return (spi_exchange_t*)trans->user;
+#endif
+}
+
+static spi_class_t request_class(uint8_t type){
+    switch (type){
+        case FileOpen: case FileRead: case FileWrite: case FileClose: case FileStat: case FileList:
+        case OtaBegin: case OtaWrite: case OtaEnd: // in order on one worker, the image follows its OtaBegin
+            return SpiClassBulk;
+        default:
+            return SpiClassControl;
+    }
+}
+
+// hands a copy of the request to its worker, false if the worker has no room
+static bool dispatch(const spi_frame_header_t* hdr){
+    spi_worker_t* worker = &workers[request_class(hdr->type)];
+    uint8_t* request;
+    if (xQueueReceive(worker->free, &request, 0) != pdTRUE){
+        return false;
     }
+    memcpy(request, hdr, SPI_HEADER_SIZE + hdr->length);
+    add_work(1);
+    xQueueSend(worker->requests, &request, 0);
     return true;
 }
 
-static void api_task(void* pvParameters){
-    bool result = true;
-    ESP_LOGI("spi_api", "api_task()");
+// SPI_STATUS_* for the frame armed next: answers staged behind it, requests queued or running, room per worker
+static uint8_t flow_status(void){
+    uint8_t status = 0;
+    if (uxQueueMessagesWaiting(tx_ready) > 0) status |= SPI_STATUS_TX_PENDING;
+    const UBaseType_t control_free = uxQueueMessagesWaiting(workers[SpiClassControl].free);
+    const UBaseType_t bulk_free = uxQueueMessagesWaiting(workers[SpiClassBulk].free);
+    if (control_free + bulk_free < SPI_CLASS_COUNT * SPI_PENDING_REQUESTS) status |= SPI_STATUS_BUSY;
+    if (control_free > 0) status |= SPI_STATUS_CONTROL_READY;
+    if (spi_events_pending()) status |= SPI_STATUS_EVENTS;
+    status |= (bulk_free < 15 ? bulk_free : 15) << SPI_STATUS_BULK_SHIFT;
+    return status;
+}
+
+// serves a pending GetStats, the link counters never change while it is copied
+static void stats_serve(void){
+    portENTER_CRITICAL(&stats_lock);
+    const stats_request_t request = stats_request;
+    stats_request = StatsNone;
+    portEXIT_CRITICAL(&stats_lock);
+    if (request == StatsNone){
+        return;
+    }
+    stats_copy = link_state.stats;
+    if (request == StatsCopyReset){
+        memset(&link_state.stats, 0, sizeof(link_state.stats));
+    }
+    xSemaphoreGive(stats_done);
+}
+
+// Every frame the master clocks, whatever it carries itself, picks up the next staged answer frame. Answers show up
+// SPI_QUEUE_DEPTH - 1 frames after they were staged, the frames armed before them go out first.
+static void spi_task(void* pvParameters){
+    ESP_LOGI(TAG, "spi_task()");
     while (1){
-        if (result) spi_slave_transmit(RCV_HOST, &transaction, portMAX_DELAY);
-        // recycle last transaction, if previous was not successful, sometimes data gets stuck
-        const uint8_t* rcv_data = (uint8_t*)transaction.rx_buffer;
-
-        // check integrity of transaction
-        if (transaction.trans_len != 2048 * 8){
-            ESP_LOGE("spiapi", "Received transaction length %d, expected 2048 * 8", transaction.trans_len);
-            result = true;
+        uint8_t* rx;
+        size_t rx_len;
+        spi_exchange_t *ex = next_exchange(&rx, &rx_len);
+        events_announced(ex);
+        stats_serve();
+        const uint8_t* tx;
+        link_state.status = flow_status();
+        const spi_frame_header_t* hdr = spi_link_receive(&link_state, rx, rx_len, ex->own, &tx);
+        if (hdr == NULL){
+            requeue(ex, tx);
             continue;
         }
-        if (rcv_data[0] != 0xCA || rcv_data[1] != 0xFE){
-            ESP_LOGE("spiapi", "Received data %x %x, expected 0xCA 0xFE", rcv_data[0], rcv_data[1]);
-            result = true;
+        if (hdr->type != Idle && !dispatch(hdr)){
+            ESP_LOGD(TAG, "No room for request 0x%02x seq %d, NAK", hdr->type, hdr->seq);
+            requeue(ex, spi_link_reject(&link_state, ex->own, hdr));
             continue;
         }
+        if (hdr->type != Idle){
+            spi_link_accept(&link_state, hdr);
+        }
+        uint8_t* staged;
+        const bool answer = xQueueReceive(tx_ready, &staged, 0) == pdTRUE;
+        link_state.status = flow_status(); // with the request just dispatched and without the answer taken
+        if (answer){
+            requeue(ex, spi_link_answer(&link_state, staged));
+            xQueueSend(tx_free, &staged, 0);
+            add_work(-1); // counted as armed frame now
+        }else{
+            requeue(ex, spi_link_idle(&link_state, ex->own));
+        }
+    }
+}
 
-        // parse request
-        RequestType requestType = (RequestType)(rcv_data[2]);
-        const int uint8_param_0 = rcv_data[3]; // first request parameter, e.g. channel, favorite number, ...
-
-        // handle request
-        if (requestType == GetFirmwareInfo){
-            ESP_LOGI("SpiAPI", "GetFirmwareInfo");
-            {
-                char info[1024] = "{\"HWV\": \"DADA\", \"FWV\": \"tusb_msc_1.1\", \"OTA\": \"";
-                const char* ota_label = esp_get_current_ota_label();
-                strcat(info, ota_label);
-                strcat(info, "\"}");
-                ESP_LOGI("SpiAPI", "Firmware info: %s", info);
-                result = transmitCString(requestType, info);
-            }
-        }else if (requestType == Reboot){
-            ESP_LOGI("SpiAPI", "Rebooting device!");
-            // TODO: dismount sd-card, filesystem etc!
-            esp_restart();
-        }else if (requestType == RebootToOTAX){
-            int num_ota = count_bootable_ota_partitions();
-            if (uint8_param_0 >= num_ota){
-                ESP_LOGE("SpiAPI", "Requested OTA %d but only %d OTAs available!", uint8_param_0, num_ota);
-            }else{
-                // TODO: dismount sd-card, filesystem etc!
-                boot_into_slot(uint8_param_0);
-                ESP_LOGI("SpiAPI", "Rebooting device to OTA %d!", uint8_param_0);
-            }
+// staging buffer for the next answer frame, the payload can be built in place at + SPI_HEADER_SIZE.
+// Blocks while all of them wait to go out.
+static uint8_t* answer_begin(void){
+    uint8_t* staged;
+    xQueueReceive(tx_free, &staged, portMAX_DELAY);
+    return staged;
+}
+
+// queues the staged frame as answer to req, spi_task adds sequence numbers and crc
+static void answer_end(const spi_frame_header_t* req, uint8_t* staged, uint16_t length){
+    spi_frame_header_t* answer = (spi_frame_header_t*)staged;
+    answer->type = req->type;
+    answer->length = length;
+    answer->ref = req->seq;
+    add_work(1);
+    xQueueSend(tx_ready, &staged, portMAX_DELAY);
+}
+
+// sends one answer frame for req
+static void respond(const spi_frame_header_t* req, const void* payload, uint16_t length){
+    uint8_t* staged = answer_begin();
+    memcpy(staged + SPI_HEADER_SIZE, payload, length);
+    answer_end(req, staged, length);
+}
+
+// Chunks are built in place in the staging buffers, chunk N+1 while chunk N waits to go out, so copying (or FatFs
+// reading) overlaps the transfer. Requests of the other class are handled meanwhile.
+static void transmitStream(spi_stream_t* stream){
+    bool last = false;
+    while (!last){
+        uint8_t* staged = answer_begin();
+        const uint16_t length = spi_link_chunk(stream, staged + SPI_HEADER_SIZE, frame_size, &last);
+        answer_end(stream->req, staged, length);
+    }
+}
+
+// sends len bytes of binary data as chunks [spi_chunk_t + data], data has to stay valid until it returns
+static void transmitBuffer(const spi_frame_header_t* req, const void* data, uint32_t len){
+    spi_stream_t stream = { .req = req, .total = len, .source = spi_buffer_source, .ctx = (void*)data };
+    transmitStream(&stream);
+}
+
+static SpiStatus status_source(void* ctx, uint32_t offset, uint8_t* dst, uint32_t max, uint32_t* got){
+    *got = 0;
+    return (SpiStatus)(uintptr_t)ctx;
+}
+
+// ends a response before any data with a single [spi_chunk_t] carrying status
+static void transmitStatus(const spi_frame_header_t* req, SpiStatus status){
+    spi_stream_t stream = { .req = req, .total = 0, .source = status_source, .ctx = (void*)(uintptr_t)status };
+    transmitStream(&stream);
+}
+
+static SpiStatus file_source(void* ctx, uint32_t offset, uint8_t* dst, uint32_t max, uint32_t* got){
+    return spi_file_read((uint8_t)(uintptr_t)ctx, offset, dst, max, got);
+}
+
+// chunk offsets are file offsets, FatFs reads straight into the staging buffer
+static void transmitFile(const spi_frame_header_t* hdr, const spi_file_read_req_t req){
+    const uint8_t handle = hdr->arg;
+    const uint32_t end = (req.length && req.length <= UINT32_MAX - req.offset) ? req.offset + req.length : UINT32_MAX;
+    spi_stream_t stream = { .req = hdr, .offset = req.offset, .total = end, .source = file_source, .ctx = (void*)(uintptr_t)handle };
+    transmitStream(&stream);
+}
+
+// handles the file requests that are answered with a single frame
+static void handle_file(const spi_frame_header_t* hdr){
+    const char* payload = (const char*)hdr + SPI_HEADER_SIZE;
+    spi_file_rsp_t rsp = { .handle = hdr->arg };
+    uint8_t handle = hdr->arg;
+    uint32_t value = 0;
+    const RequestType requestType = (RequestType)hdr->type;
+    if (requestType == FileOpen){
+        rsp.status = spi_file_open(payload, hdr->length, (SpiFileMode)hdr->arg, &handle, &value);
+        rsp.handle = (rsp.status == SpiOk) ? handle : 0;
+    }else if (requestType == FileWrite){
+        spi_chunk_t chunk;
+        if (hdr->length < sizeof(chunk)){
+            rsp.status = SpiBadRequest;
+        }else{
+            memcpy(&chunk, payload, sizeof(chunk));
+            rsp.status = spi_file_write(hdr->arg, chunk.offset, payload + sizeof(chunk),
+                                        hdr->length - sizeof(chunk), &value);
+        }
+    }else if (requestType == FileClose){
+        rsp.status = spi_file_close(hdr->arg, &value);
+    }else{
+        rsp.status = spi_file_stat(payload, hdr->length, &rsp);
+        value = rsp.value;
+    }
+    rsp.value = value;
+    if (rsp.status != SpiOk){
+        ESP_LOGW(TAG, "File request 0x%02x failed with status %d", requestType, rsp.status);
+    }
+    respond(hdr, &rsp, sizeof(rsp));
+}
+
+static void handle_ota(const spi_frame_header_t* hdr){
+    const uint8_t* payload = (const uint8_t*)hdr + SPI_HEADER_SIZE;
+    spi_ota_rsp_t rsp = {0};
+    const RequestType requestType = (RequestType)hdr->type;
+    if (requestType == OtaBegin){
+        spi_ota_begin_req_t req = {0};
+        spi_link_args(hdr, &req, sizeof(req));
+        rsp.status = spi_ota_begin(&req, &rsp);
+    }else if (requestType == OtaWrite){
+        spi_chunk_t chunk;
+        if (hdr->length < sizeof(chunk)){
+            spi_ota_status(&rsp);
+            rsp.status = SpiBadRequest;
+        }else{
+            memcpy(&chunk, payload, sizeof(chunk));
+            rsp.status = spi_ota_write(chunk.offset, payload + sizeof(chunk), hdr->length - sizeof(chunk), &rsp);
+        }
+    }else if (requestType == OtaEnd){
+        rsp.status = spi_ota_end(hdr->arg == 1, &rsp);
+    }else{
+        spi_ota_status(&rsp);
+    }
+    if (rsp.status != SpiOk){
+        ESP_LOGW(TAG, "OTA request 0x%02x failed with status %d", requestType, rsp.status);
+    }
+    respond(hdr, &rsp, sizeof(rsp));
+}
+
+static void handle_hello(const spi_frame_header_t* hdr){
+    frame_size = spi_link_negotiate(hdr);
+    spi_hello_req_t req = { .lines = 1 };
+    spi_link_args(hdr, &req, sizeof(req));
+    const uint8_t lines = req.lines >= 4 ? 4 : (req.lines >= 2 ? 2 : 1);
+    const spi_calib_t* calib = spi_calib_get();
+    const spi_hello_rsp_t rsp = {
+        .version = SPI_PROTOCOL_VERSION,
+        .lines = lines < SPI_DATA_LINES ? lines : SPI_DATA_LINES,
+        .max_frame = SPI_MAX_FRAME_SIZE,
+        .frame = frame_size,
+        .clock_hz = calib->clock_hz,
+        .mode = calib->mode,
+        .sample_delay = calib->sample_delay,
+    };
+    ESP_LOGI(TAG, "Hello, using frame size %d, %d data line(s)", frame_size, rsp.lines);
+    firmware_info_update();
+    respond(hdr, &rsp, sizeof(rsp));
+}
+
+// one frame, built in place, the master asks again while pending is not 0
+static void handle_events(const spi_frame_header_t* hdr){
+    uint8_t* staged = answer_begin();
+    spi_events_rsp_t rsp;
+    spi_event_entry_t* events = (spi_event_entry_t*)(staged + SPI_HEADER_SIZE + sizeof(rsp));
+    const size_t n = spi_events_take(events, (frame_size - SPI_HEADER_SIZE - sizeof(rsp)) / sizeof(spi_event_entry_t), &rsp);
+    memcpy(staged + SPI_HEADER_SIZE, &rsp, sizeof(rsp));
+    answer_end(hdr, staged, sizeof(rsp) + n * sizeof(spi_event_entry_t));
+}
+
+static void handle_calibrate(const spi_frame_header_t* hdr){
+    uint8_t* staged = answer_begin();
+    answer_end(hdr, staged, spi_link_calibrate(hdr, staged + SPI_HEADER_SIZE, frame_size));
+}
+
+static void handle_calibration(const spi_frame_header_t* hdr){
+    if (hdr->type == SetCalibration){
+        spi_calib_t calib;
+        if (hdr->length >= sizeof(calib)){
+            memcpy(&calib, (const uint8_t*)hdr + SPI_HEADER_SIZE, sizeof(calib));
+            spi_calib_set(&calib); // on failure the answer shows the calibration still in place
+            firmware_info_update();
+        }else{
+            ESP_LOGE(TAG, "SetCalibration with %d bytes", hdr->length);
+        }
+    }
+    respond(hdr, spi_calib_get(), sizeof(spi_calib_t));
+}
+
+static int stats_slot(uint8_t type){
+    int i = 0;
+    while (i < STATS_TYPES - 1 && stats_types[i] != type) i++;
+    return i;
+}
+
+static void note_request(uint8_t type, uint32_t us){
+    const int i = stats_slot(type);
+    portENTER_CRITICAL(&stats_lock);
+    type_stats[i].count++;
+    type_stats[i].total_us += us;
+    if (us > type_stats[i].max_us) type_stats[i].max_us = us;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+static void handle_stats(const spi_frame_header_t* hdr){
+    struct __attribute__((packed)) {
+        spi_stats_t stats;
+        spi_stats_type_t types[STATS_TYPES];
+    } block = {0};
+    msc_stats_summary_t msc;
+    msc_stats_summary(&msc);
+
+    // the handshake is up while this request runs, so the master keeps clocking and spi_task comes by. A master that
+    // stopped clocking must not hold up the control worker, the request is withdrawn unless spi_task took it already.
+    portENTER_CRITICAL(&stats_lock);
+    stats_request = (hdr->arg == 1) ? StatsCopyReset : StatsCopy;
+    portEXIT_CRITICAL(&stats_lock);
+    if (xSemaphoreTake(stats_done, pdMS_TO_TICKS(SPI_STATS_TIMEOUT_MS)) != pdTRUE){
+        portENTER_CRITICAL(&stats_lock);
+        const bool withdrawn = stats_request != StatsNone;
+        stats_request = StatsNone;
+        portEXIT_CRITICAL(&stats_lock);
+        if (withdrawn){
+            ESP_LOGW(TAG, "GetStats: link counters not taken within %d ms", SPI_STATS_TIMEOUT_MS);
+            transmitStatus(hdr, SpiTimeout);
+            return;
+        }
+        xSemaphoreTake(stats_done, portMAX_DELAY); // spi_task is copying them, stats_done comes right away
+    }
+    block.stats = stats_copy;
+
+    portENTER_CRITICAL(&stats_lock);
+    for (int i = 0; i < STATS_TYPES; i++){
+        block.types[i].type = stats_types[i];
+        block.types[i].count = type_stats[i].count;
+        block.types[i].avg_us = type_stats[i].count ? type_stats[i].total_us / type_stats[i].count : 0;
+        block.types[i].max_us = type_stats[i].max_us;
+    }
+    if (hdr->arg == 1){
+        memset(type_stats, 0, sizeof(type_stats));
+    }
+    portEXIT_CRITICAL(&stats_lock);
+    if (hdr->arg == 1){
+        msc_stats_reset();
+    }
+
+    block.stats.types = STATS_TYPES;
+    block.stats.uptime_ms = esp_timer_get_time() / 1000;
+    block.stats.msc_commands = msc.commands;
+    block.stats.msc_reads = msc.reads;
+    block.stats.msc_writes = msc.writes;
+    block.stats.msc_read_bytes = msc.read_bytes;
+    block.stats.msc_write_bytes = msc.write_bytes;
+    block.stats.msc_max_read_us = msc.max_read_us;
+    block.stats.msc_max_write_us = msc.max_write_us;
+    block.stats.usb_suspends = msc.suspends;
+    block.stats.sd_errors = custom_sdmmc_error_count();
+    transmitBuffer(hdr, &block, sizeof(block));
+}
+
+static bool answers_pending(void){
+    portENTER_CRITICAL(&handshake_lock);
+    const int frames = handshake_frames;
+    portEXIT_CRITICAL(&handshake_lock);
+    return frames > 0 || uxQueueMessagesWaiting(tx_ready) > 0;
+}
+
+static void restart_cb(void* arg){
+    esp_restart();
+}
+
+// Runs in the control worker, spi_task keeps moving frames meanwhile: the answer with the shutdown times goes out
+// like any other, file requests arriving after the unmount answer SpiBusy.
+static void handle_reboot(const spi_frame_header_t* hdr){
+    spi_reboot_req_t req = {0};
+    spi_link_args(hdr, &req, sizeof(req));
+    const uint32_t deadline_ms = req.deadline_ms ? req.deadline_ms : SPI_SHUTDOWN_DEADLINE_MS;
+    spi_shutdown_rsp_t rsp = { .status = SpiOk };
+
+    if (hdr->type == RebootToOTAX){
+        const int num_ota = count_bootable_ota_partitions();
+        if (hdr->arg >= num_ota){
+            ESP_LOGE(TAG, "Requested OTA %d but only %d OTAs available!", hdr->arg, num_ota);
+            rsp.status = SpiBadRequest;
+        }else if (set_boot_slot(hdr->arg) != ESP_OK){
+            ESP_LOGE(TAG, "Could not select OTA %d", hdr->arg);
+            rsp.status = SpiIoError;
+        }
+        if (rsp.status != SpiOk){
+            respond(hdr, &rsp, sizeof(rsp));
+            return;
+        }
+    }
+    ESP_LOGI(TAG, "Rebooting device within %lu ms", (unsigned long)deadline_ms);
+
+    // whatever hangs below, the restart comes at the deadline
+    const int64_t deadline = esp_timer_get_time() + (int64_t)deadline_ms * 1000;
+    const esp_timer_create_args_t timer_args = { .callback = restart_cb, .name = "reboot" };
+    esp_timer_handle_t timer;
+    if (esp_timer_create(&timer_args, &timer) != ESP_OK || esp_timer_start_once(timer, (uint64_t)deadline_ms * 1000) != ESP_OK){
+        ESP_LOGE(TAG, "No reboot timer, deadline not enforced");
+    }
+    const uint32_t ack_ms = deadline_ms / 2 < SPI_SHUTDOWN_ACK_MS ? deadline_ms / 2 : SPI_SHUTDOWN_ACK_MS;
+    storage_shutdown(sd_card, deadline - (int64_t)ack_ms * 1000, &rsp);
+    respond(hdr, &rsp, sizeof(rsp));
+    while (answers_pending() && esp_timer_get_time() < deadline){
+        vTaskDelay(1);
+    }
+    esp_restart();
+}
+
+static void handle_request(const spi_frame_header_t* hdr){
+    // parse request
+    RequestType requestType = (RequestType)(hdr->type);
+    const int uint8_param_0 = hdr->arg; // first request parameter, e.g. channel, favorite number, ...
+
+    // handle request
+    if (requestType == Hello){
+        handle_hello(hdr);
+    }else if (requestType == GetFirmwareInfo){
+        if (uint8_param_0 == 1){
+            transmitBuffer(hdr, &firmware_info, sizeof(firmware_info));
+        }else{
+            transmitBuffer(hdr, firmware_info_json, firmware_info_json_len);
+        }
+    }else if (requestType == GetStats){
+        handle_stats(hdr);
+    }else if (requestType == GetEvents){
+        handle_events(hdr);
+    }else if (requestType == FileOpen || requestType == FileWrite || requestType == FileClose || requestType == FileStat){
+        handle_file(hdr);
+    }else if (requestType == FileRead){
+        spi_file_read_req_t req = {0};
+        spi_link_args(hdr, &req, sizeof(req));
+        transmitFile(hdr, req);
+    }else if (requestType == FileList){
+        char* listing = malloc(SPI_FILE_LIST_MAX);
+        const SpiStatus status = listing ? spi_file_list((const char*)hdr + SPI_HEADER_SIZE, hdr->length, listing, SPI_FILE_LIST_MAX) : SpiIoError;
+        if (listing == NULL){
+            ESP_LOGE(TAG, "No memory for file listing");
+        }
+        if (status == SpiOk){
+            transmitBuffer(hdr, listing, strlen(listing));
         }else{
-            ESP_LOGE("SpiAPI", "Unknown request type %d", (uint8_t)requestType);
-            result = true;
+            transmitStatus(hdr, status);
         }
+        free(listing);
+    }else if (requestType == OtaBegin || requestType == OtaWrite || requestType == OtaEnd || requestType == OtaStatus){
+        handle_ota(hdr);
+    }else if (requestType == Calibrate){
+        handle_calibrate(hdr);
+    }else if (requestType == SetCalibration || requestType == GetCalibration){
+        handle_calibration(hdr);
+    }else if (requestType == Reboot || requestType == RebootToOTAX){
+        handle_reboot(hdr);
+    }else{
+        ESP_LOGE(TAG, "Unknown request type %d", (uint8_t)requestType);
+        transmitStatus(hdr, SpiBadRequest);
     }
+
 }
 
-// Called after a transaction is queued and ready for pickup by master. We use this to set the handshake line high.
-IRAM_ATTR static void spi_post_setup_cb(spi_slave_transaction_t *trans){
-    gpio_set_level(GPIO_HANDSHAKE, 1);
+static void worker_task(void* pvParameters){
+    spi_worker_t* worker = (spi_worker_t*)pvParameters;
+    ESP_LOGI(TAG, "%s()", worker->name);
+    while (1){
+        uint8_t* request;
+        xQueueReceive(worker->requests, &request, portMAX_DELAY);
+        const spi_frame_header_t* hdr = (const spi_frame_header_t*)request;
+        const int64_t start = esp_timer_get_time();
+        handle_request(hdr);
+        note_request(hdr->type, esp_timer_get_time() - start);
+        xQueueSend(worker->free, &request, 0);
+        add_work(-1);
+    }
 }
 
-// Called after transaction is sent/received. We use this to set the handshake line low.
+// Called after the slave's frame went out. Handshake falls once the last data frame went out and nothing is in progress.
+IRAM_ATTR static void frame_sent(const spi_exchange_t *ex){
+    if (is_data_frame(ex)){
+        portENTER_CRITICAL_ISR(&handshake_lock);
+        handshake_frames--;
+        handshake_update();
+        portEXIT_CRITICAL_ISR(&handshake_lock);
+    }
+}
+
+#ifdef CONFIG_SPI_API_QUAD
+IRAM_ATTR static bool spi_sent_cb(void* arg, spi_slave_hd_event_t* event, BaseType_t* awoken){
+    frame_sent((const spi_exchange_t*)event->trans->arg);
+    return false;
+}
+#else
 IRAM_ATTR static void spi_post_trans_cb(spi_slave_transaction_t *trans){
-    gpio_set_level(GPIO_HANDSHAKE, 0);
+    frame_sent((const spi_exchange_t*)trans->user);
 }
+#endif
 
-void spi_start(){
-    ESP_LOGI("spi_api", "spi_start()");
+void spi_start(const char* base_path, const sdmmc_card_t* card){
+    ESP_LOGI(TAG, "spi_start()");
+    sd_card = card;
+    ESP_ERROR_CHECK(spi_file_init(base_path));
+    ESP_ERROR_CHECK(spi_ota_init());
+    if (spi_calib_init() != ESP_OK){
+        ESP_LOGE(TAG, "no link calibration, master has to fall back to its default clock");
+    }
+    firmware_info_init(card);
+    firmware_info_update();
+    ESP_LOGI(TAG, "Firmware info: %s", firmware_info_json);
     //Configuration for the SPI bus
     spi_bus_config_t buscfg = {
         .mosi_io_num = GPIO_MOSI,
         .miso_io_num = GPIO_MISO,
         .sclk_io_num = GPIO_SCLK,
-        .quadwp_io_num = -1,
-        .quadhd_io_num = -1,
+        .quadwp_io_num = GPIO_D2,
+        .quadhd_io_num = GPIO_D3,
         .data4_io_num = -1,
         .data5_io_num = -1,
         .data6_io_num = -1,
         .data7_io_num = -1,
         .data_io_default_level = false,
-        .max_transfer_sz = 2048,
-        .flags = 0,
-        .isr_cpu_id = ESP_INTR_CPU_AFFINITY_0,
+        .max_transfer_sz = SPI_MAX_FRAME_SIZE,
+        .flags = (SPI_DATA_LINES == 4) ? SPICOMMON_BUSFLAG_QUAD : 0, // bus init checks the quad pins
+        .isr_cpu_id = SPI_ISR_CORE,
         .intr_flags = 0
     };
 
+#ifdef CONFIG_SPI_API_QUAD
+    //Configuration for the half duplex slave, segment mode: 8 bit command, address and dummy, as the master sends them
+    spi_slave_hd_slot_config_t slotcfg = {
+        .spics_io_num = GPIO_CS,
+        .flags = 0,
+        .mode = 3,
+        .command_bits = 8,
+        .address_bits = 8,
+        .dummy_bits = 8,
+        .queue_size = SPI_QUEUE_DEPTH,
+        .dma_chan = SPI_DMA_CH_AUTO,
+        .cb_config = { .cb_sent = spi_sent_cb },
+    };
+#else
     //Configuration for the SPI slave interface
     spi_slave_interface_config_t slvcfg = {
         .spics_io_num = GPIO_CS,
         .flags = 0,
-        .queue_size = 1,
+        .queue_size = SPI_QUEUE_DEPTH,
         .mode = 3,
-        .post_setup_cb = spi_post_setup_cb,
         .post_trans_cb = spi_post_trans_cb
     };
+#endif
 
     //Configuration for the handshake line
     gpio_config_t io_conf = {
@@ -206,16 +876,62 @@ void spi_start(){
     gpio_config(&io_conf);
     gpio_set_level(GPIO_HANDSHAKE, 0);
 
-    send_buffer = (uint8_t*)spi_bus_dma_memory_alloc(RCV_HOST, 2048, 0);
-    send_buffer[0] = 0xCA;
-    send_buffer[1] = 0xFE;
-    receive_buffer = (uint8_t*)spi_bus_dma_memory_alloc(RCV_HOST, 2048, 0);
-    transaction.length = 2048 * 8;
-    transaction.tx_buffer = send_buffer;
-    transaction.rx_buffer = receive_buffer;
-
+#ifdef CONFIG_SPI_API_QUAD
+    esp_err_t ret = spi_slave_hd_init(RCV_HOST, &buscfg, &slotcfg);
+#else
     esp_err_t ret = spi_slave_initialize(RCV_HOST, &buscfg, &slvcfg, SPI_DMA_CH_AUTO);
+#endif
     assert(ret == ESP_OK);
 
-    xTaskCreatePinnedToCore(api_task, "spi_task", 4096 * 2, NULL, 10, &hTask, 1);
+    uint8_t* ring = (uint8_t*)spi_bus_dma_memory_alloc(RCV_HOST, SPI_MAX_FRAME_SIZE * SPI_RETX_FRAMES, 0);
+    assert(ring);
+    spi_link_init(&link_state, ring);
+
+    stats_done = xSemaphoreCreateBinary();
+    assert(stats_done);
+    tx_free = xQueueCreate(SPI_TX_BUFFERS, sizeof(uint8_t*));
+    tx_ready = xQueueCreate(SPI_TX_BUFFERS, sizeof(uint8_t*));
+    assert(tx_free && tx_ready);
+    for (int i = 0; i < SPI_TX_BUFFERS; i++){
+        uint8_t* staged = (uint8_t*)malloc(SPI_MAX_FRAME_SIZE);
+        assert(staged);
+        xQueueSend(tx_free, &staged, 0);
+    }
+    for (int c = 0; c < SPI_CLASS_COUNT; c++){
+        spi_worker_t* worker = &workers[c];
+        worker->requests = xQueueCreate(SPI_PENDING_REQUESTS, sizeof(uint8_t*));
+        worker->free = xQueueCreate(SPI_PENDING_REQUESTS, sizeof(uint8_t*));
+        assert(worker->requests && worker->free);
+        for (int i = 0; i < SPI_PENDING_REQUESTS; i++){
+            uint8_t* request = (uint8_t*)malloc(SPI_MAX_FRAME_SIZE);
+            assert(request);
+            xQueueSend(worker->free, &request, 0);
+        }
+        xTaskCreatePinnedToCore(worker_task, worker->name, 4096 * 2, worker, worker->priority, NULL, worker->core);
+    }
+
+    // arm all exchanges up front, spi_task re-queues each one as soon as it is parsed
+    spi_events_set_notify(events_notify);
+    link_state.status = flow_status();
+    for (int i = 0; i < SPI_QUEUE_DEPTH; i++){
+        // idle frames are short, but the DMA reads as far as the master clocks
+        uint8_t *send_buffer = (uint8_t*)spi_bus_dma_memory_alloc(RCV_HOST, SPI_MAX_FRAME_SIZE, 0);
+        uint8_t *receive_buffer = (uint8_t*)spi_bus_dma_memory_alloc(RCV_HOST, SPI_MAX_FRAME_SIZE, 0);
+        assert(send_buffer && receive_buffer);
+        // armed for the largest frame, the master ends the transaction early, trans_len tells how much came in
+        spi_exchange_t* ex = &exchanges[i];
+        ex->own = send_buffer;
+#ifdef CONFIG_SPI_API_QUAD
+        ex->rx_trans = (spi_slave_hd_data_t){ .data = receive_buffer, .len = SPI_MAX_FRAME_SIZE, .arg = ex };
+        ex->tx_trans = (spi_slave_hd_data_t){ .len = SPI_MAX_FRAME_SIZE, .arg = ex };
+#else
+        ex->trans.length = SPI_MAX_FRAME_SIZE * 8;
+        ex->trans.user = ex;
+        ex->trans.rx_buffer = receive_buffer;
+#endif
+        requeue(ex, spi_link_idle(&link_state, send_buffer));
+    }
+
+    // core 0 by default, next to the SPI interrupt, away from the TinyUSB task on core 1
+    xTaskCreatePinnedToCore(spi_task, "spi_task", 4096, NULL, SPI_TASK_PRIORITY, &hTask, SPI_TASK_CORE);
 }
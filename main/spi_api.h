@@ -1,7 +1,9 @@
 #pragma once
 
+#include "sdmmc_cmd.h"
 
 
-void spi_start();
-
-
+// base_path is where the application mounts the storage, the file requests work below it.
+// card goes into the firmware info and is taken down with the storage before a reboot, NULL when the storage is not
+// an SD card.
+void spi_start(const char* base_path, const sdmmc_card_t* card);
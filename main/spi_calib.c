@@ -0,0 +1,60 @@
+/* Persisted SPI link calibration
+ *
+ * The master finds the highest error free clock with Calibrate frames (see spi_proto.h) and stores the result here,
+ * so production units come up at their real link speed after every boot instead of a conservative default.
+ */
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_check.h"
+#include "nvs.h"
+#include "spi_calib.h"
+
+static const char *TAG = "spi_calib";
+
+#define CALIB_NAMESPACE "spi_api"
+#define CALIB_KEY "calib"
+
+static spi_calib_t s_calib;
+
+esp_err_t spi_calib_init(void)
+{
+    nvs_handle_t nvs;
+    ESP_RETURN_ON_ERROR(nvs_open(CALIB_NAMESPACE, NVS_READWRITE, &nvs), TAG, "could not open NVS namespace");
+    size_t size = sizeof(s_calib);
+    esp_err_t err = nvs_get_blob(nvs, CALIB_KEY, &s_calib, &size);
+    nvs_close(nvs);
+    if (err == ESP_ERR_NVS_NOT_FOUND || (err == ESP_OK && size != sizeof(s_calib))) {
+        memset(&s_calib, 0, sizeof(s_calib));
+        ESP_LOGI(TAG, "link not calibrated yet");
+        return ESP_OK;
+    }
+    ESP_RETURN_ON_ERROR(err, TAG, "could not read calibration");
+    ESP_LOGI(TAG, "link calibrated to %lu Hz, mode %d, sample delay %d", (unsigned long)s_calib.clock_hz,
+             s_calib.mode, s_calib.sample_delay);
+    return ESP_OK;
+}
+
+const spi_calib_t* spi_calib_get(void)
+{
+    return &s_calib;
+}
+
+esp_err_t spi_calib_set(const spi_calib_t *calib)
+{
+    if (memcmp(calib, &s_calib, sizeof(s_calib)) == 0) {
+        return ESP_OK; // nothing changed, spare the flash
+    }
+    nvs_handle_t nvs;
+    ESP_RETURN_ON_ERROR(nvs_open(CALIB_NAMESPACE, NVS_READWRITE, &nvs), TAG, "could not open NVS namespace");
+    esp_err_t err = nvs_set_blob(nvs, CALIB_KEY, calib, sizeof(*calib));
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    ESP_RETURN_ON_ERROR(err, TAG, "could not store calibration");
+    s_calib = *calib;
+    ESP_LOGI(TAG, "stored link calibration %lu Hz (first failure at %lu Hz), mode %d, sample delay %d",
+             (unsigned long)calib->clock_hz, (unsigned long)calib->margin_hz, calib->mode, calib->sample_delay);
+    return ESP_OK;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "esp_err.h"
+#include "spi_proto.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// loads the stored link calibration from NVS, which the application initialized. A unit that was never calibrated
+// reports all zero.
+esp_err_t spi_calib_init(void);
+const spi_calib_t* spi_calib_get(void);
+esp_err_t spi_calib_set(const spi_calib_t *calib);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,91 @@
+/* Event queue for the SPI master
+ *
+ * Storage mount changes, OTA results and SD card errors are posted here from wherever they happen, the master
+ * fetches them with GetEvents instead of polling GetFirmwareInfo or GetStats. Posting only takes a spinlock, so the
+ * MSC callbacks and the sd card code can post from their own tasks without waiting on the SPI side.
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "spi_events.h"
+
+static const char *TAG = "spi_events";
+
+#ifndef SPI_EVENT_QUEUE
+#define SPI_EVENT_QUEUE 16
+#endif
+_Static_assert(SPI_EVENT_QUEUE <= 255, "count and pending of spi_events_rsp_t are 8 bit");
+
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static spi_event_entry_t s_events[SPI_EVENT_QUEUE];
+static size_t s_head; // oldest queued event
+static size_t s_count;
+static uint16_t s_seq;
+static uint16_t s_dropped;
+static spi_events_notify_t s_notify;
+
+void spi_events_set_notify(spi_events_notify_t notify)
+{
+    s_notify = notify;
+    if (notify && spi_events_pending()) {
+        notify(); // posted before the SPI interface was up
+    }
+}
+
+void spi_event_post(uint8_t type, uint8_t arg, uint32_t value)
+{
+    const uint32_t time_ms = (uint32_t)(esp_timer_get_time() / 1000);
+    bool dropped = false;
+
+    portENTER_CRITICAL(&s_lock);
+    spi_event_entry_t *newest = s_count ? &s_events[(s_head + s_count - 1) % SPI_EVENT_QUEUE] : NULL;
+    if (newest && newest->type == type && newest->arg == arg) {
+        newest->value = value;
+        newest->time_ms = time_ms;
+    } else {
+        if (s_count == SPI_EVENT_QUEUE) {
+            s_head = (s_head + 1) % SPI_EVENT_QUEUE;
+            s_count--;
+            s_dropped++;
+            dropped = true;
+        }
+        s_events[(s_head + s_count) % SPI_EVENT_QUEUE] = (spi_event_entry_t) {
+            .type = type, .arg = arg, .seq = s_seq++, .value = value, .time_ms = time_ms,
+        };
+        s_count++;
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    if (dropped) {
+        ESP_LOGW(TAG, "queue full, oldest event dropped");
+    }
+    if (s_notify) {
+        s_notify();
+    }
+}
+
+bool spi_events_pending(void)
+{
+    portENTER_CRITICAL(&s_lock);
+    const bool pending = s_count > 0;
+    portEXIT_CRITICAL(&s_lock);
+    return pending;
+}
+
+size_t spi_events_take(spi_event_entry_t *dst, size_t max, spi_events_rsp_t *rsp)
+{
+    portENTER_CRITICAL(&s_lock);
+    const size_t n = s_count < max ? s_count : max;
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = s_events[(s_head + i) % SPI_EVENT_QUEUE];
+    }
+    s_head = (s_head + n) % SPI_EVENT_QUEUE;
+    s_count -= n;
+    rsp->count = (uint8_t)n;
+    rsp->pending = (uint8_t)s_count;
+    rsp->dropped = s_dropped;
+    s_dropped = 0;
+    portEXIT_CRITICAL(&s_lock);
+    return n;
+}
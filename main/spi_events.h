@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "spi_proto.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// called after every post, spi_api raises the handshake with it
+typedef void (*spi_events_notify_t)(void);
+
+void spi_events_set_notify(spi_events_notify_t notify);
+// queues an event for the SPI master (SpiEventType), from any task or esp_timer callback, never blocks
+void spi_event_post(uint8_t type, uint8_t arg, uint32_t value);
+bool spi_events_pending(void);
+// moves up to max queued events to dst, oldest first, and fills rsp. Returns the number moved.
+size_t spi_events_take(spi_event_entry_t *dst, size_t max, spi_events_rsp_t *rsp);
+
+#ifdef __cplusplus
+}
+#endif
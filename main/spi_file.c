@@ -0,0 +1,290 @@
+/* File access for the SPI master
+ *
+ * Gives the RP2350 the files below the application's mount point while the storage is not exposed over USB.
+ * spi_api.c does the framing, this file only deals with FatFs. Handles are closed before the storage is handed to
+ * the USB host (premount callback), writes to a handle that went away that way answer SpiBadHandle.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_check.h"
+#include "tusb_msc_storage.h"
+#include "spi_file.h"
+
+static const char *TAG = "spi_file";
+
+#ifndef SPI_FILE_MAX_OPEN
+#define SPI_FILE_MAX_OPEN 4
+#endif
+#ifndef SPI_FILE_BUFFER_SIZE
+#define SPI_FILE_BUFFER_SIZE (16 * 1024) // stdio buffer per handle, FatFs sees whole clusters instead of frame sized pieces
+#endif
+#define SPI_FILE_PATH_MAX 256
+
+typedef struct {
+    FILE *f;
+    char *buffer;
+    uint32_t position; // where the next read/write happens without seeking
+    uint32_t written;
+} spi_file_t;
+
+static const char *s_base_path;
+static SemaphoreHandle_t s_lock; // serialises the SPI task against the premount callback
+static spi_file_t s_files[SPI_FILE_MAX_OPEN];
+
+static bool storage_busy(void)
+{
+    return tinyusb_msc_storage_in_use_by_usb_host();
+}
+
+// base_path + '/' + path, rejects paths climbing out of the base path
+static bool full_path(const char *path, uint16_t path_len, char *dst)
+{
+    while (path_len > 0 && path[path_len - 1] == '\0') {
+        path_len--;
+    }
+    while (path_len > 0 && path[0] == '/') {
+        path++;
+        path_len--;
+    }
+    const size_t base_len = strlen(s_base_path);
+    if (base_len + 1 + path_len + 1 > SPI_FILE_PATH_MAX || memchr(path, '\0', path_len)) {
+        return false;
+    }
+    memcpy(dst, s_base_path, base_len);
+    dst[base_len] = '/';
+    memcpy(dst + base_len + 1, path, path_len);
+    dst[base_len + 1 + path_len] = '\0';
+    if (strstr(dst + base_len, "/../") || (path_len >= 2 && strcmp(dst + base_len + 1 + path_len - 2, "..") == 0)) {
+        return false;
+    }
+    // no trailing '/', FatFs does not stat "dir/"
+    if (path_len > 0 && dst[base_len + path_len] == '/') {
+        dst[base_len + path_len] = '\0';
+    } else if (path_len == 0) {
+        dst[base_len] = '\0';
+    }
+    return true;
+}
+
+static spi_file_t *get_file(uint8_t handle)
+{
+    if (handle == 0 || handle > SPI_FILE_MAX_OPEN || s_files[handle - 1].f == NULL) {
+        return NULL;
+    }
+    return &s_files[handle - 1];
+}
+
+static void close_file(spi_file_t *file)
+{
+    fclose(file->f);
+    free(file->buffer);
+    memset(file, 0, sizeof(*file));
+}
+
+// storage is about to change hands, nothing may stay open across that
+static void premount_cb(tinyusb_msc_event_t *event)
+{
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < SPI_FILE_MAX_OPEN; i++) {
+        if (s_files[i].f) {
+            ESP_LOGW(TAG, "storage changes owner, closing handle %d", i + 1);
+            close_file(&s_files[i]);
+        }
+    }
+    xSemaphoreGive(s_lock);
+}
+
+esp_err_t spi_file_init(const char *base_path)
+{
+    s_base_path = base_path;
+    s_lock = xSemaphoreCreateMutex();
+    ESP_RETURN_ON_FALSE(s_lock, ESP_ERR_NO_MEM, TAG, "could not create lock");
+    return tinyusb_msc_register_callback(TINYUSB_MSC_EVENT_PREMOUNT_CHANGED, premount_cb);
+}
+
+SpiStatus spi_file_open(const char *path, uint16_t path_len, SpiFileMode mode, uint8_t *handle, uint32_t *size)
+{
+    char name[SPI_FILE_PATH_MAX];
+    // not "ab": that writes every chunk at the end, a resent chunk has to land at its offset like in SpiFileWrite
+    static const char *const modes[] = { [SpiFileRead] = "rb", [SpiFileWrite] = "wb", [SpiFileAppend] = "r+b" };
+    if (mode > SpiFileAppend || !full_path(path, path_len, name)) {
+        return SpiBadRequest;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    SpiStatus status = SpiTooManyOpen;
+    for (int i = 0; i < SPI_FILE_MAX_OPEN; i++) {
+        spi_file_t *file = &s_files[i];
+        if (file->f) {
+            continue;
+        }
+        if (storage_busy()) {
+            status = SpiBusy;
+            break;
+        }
+        file->f = fopen(name, modes[mode]);
+        if (file->f == NULL && mode == SpiFileAppend) {
+            file->f = fopen(name, "w+b"); // appending to a file that does not exist yet creates it
+        }
+        if (file->f == NULL) {
+            ESP_LOGE(TAG, "Could not open %s", name);
+            status = (mode == SpiFileRead) ? SpiNotFound : SpiIoError;
+            break;
+        }
+        file->buffer = malloc(SPI_FILE_BUFFER_SIZE);
+        if (file->buffer) {
+            setvbuf(file->f, file->buffer, _IOFBF, SPI_FILE_BUFFER_SIZE);
+        }
+        struct stat st;
+        *size = (fstat(fileno(file->f), &st) == 0) ? (uint32_t)st.st_size : 0;
+        file->position = (mode == SpiFileAppend && fseek(file->f, *size, SEEK_SET) == 0) ? *size : 0;
+        *handle = i + 1;
+        status = SpiOk;
+        break;
+    }
+    xSemaphoreGive(s_lock);
+    return status;
+}
+
+static SpiStatus seek(spi_file_t *file, uint32_t offset)
+{
+    if (offset == file->position) {
+        return SpiOk;
+    }
+    if (fseek(file->f, offset, SEEK_SET) != 0) {
+        return SpiIoError;
+    }
+    file->position = offset;
+    return SpiOk;
+}
+
+SpiStatus spi_file_read(uint8_t handle, uint32_t offset, void *dst, uint32_t len, uint32_t *got)
+{
+    *got = 0;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    spi_file_t *file = get_file(handle);
+    SpiStatus status = file ? (storage_busy() ? SpiBusy : seek(file, offset)) : SpiBadHandle;
+    if (status == SpiOk) {
+        *got = fread(dst, 1, len, file->f);
+        file->position += *got;
+        if (*got < len && ferror(file->f)) {
+            clearerr(file->f);
+            status = SpiIoError;
+        }
+    }
+    xSemaphoreGive(s_lock);
+    return status;
+}
+
+SpiStatus spi_file_write(uint8_t handle, uint32_t offset, const void *src, uint32_t len, uint32_t *position)
+{
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    spi_file_t *file = get_file(handle);
+    SpiStatus status = SpiBadHandle;
+    if (file) {
+        if (storage_busy()) {
+            status = SpiBusy;
+        } else if ((status = seek(file, offset)) == SpiOk) {
+            if (fwrite(src, 1, len, file->f) != len) {
+                status = SpiIoError;
+            } else {
+                file->position += len;
+                file->written += len;
+            }
+        }
+        *position = file->position;
+    }
+    xSemaphoreGive(s_lock);
+    return status;
+}
+
+SpiStatus spi_file_close(uint8_t handle, uint32_t *written)
+{
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    spi_file_t *file = get_file(handle);
+    SpiStatus status = SpiBadHandle;
+    if (file) {
+        *written = file->written;
+        // fflush reports write errors that stdio buffering held back so far
+        status = (fflush(file->f) == 0) ? SpiOk : SpiIoError;
+        close_file(file);
+    }
+    xSemaphoreGive(s_lock);
+    return status;
+}
+
+SpiStatus spi_file_stat(const char *path, uint16_t path_len, spi_file_rsp_t *rsp)
+{
+    char name[SPI_FILE_PATH_MAX];
+    if (!full_path(path, path_len, name)) {
+        return SpiBadRequest;
+    }
+    // held for the whole stat so the premount callback can not pull the storage away in between
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    struct stat st;
+    SpiStatus status = SpiOk;
+    if (storage_busy()) {
+        status = SpiBusy;
+    } else if (stat(name, &st) != 0) {
+        status = SpiNotFound;
+    } else {
+        rsp->value = (uint32_t)st.st_size;
+        rsp->mtime = (uint32_t)st.st_mtime;
+        rsp->flags = S_ISDIR(st.st_mode) ? SPI_FILE_FLAG_DIR : 0;
+    }
+    xSemaphoreGive(s_lock);
+    return status;
+}
+
+// writes the listing of the opened directory name to dst, s_lock has to be held
+static void list_dir(DIR *dh, char *name, char *dst, uint32_t max)
+{
+    const size_t dir_len = strlen(name);
+    uint32_t used = 0;
+    struct dirent *d;
+    while ((d = readdir(dh)) != NULL) {
+        struct stat st = {0};
+        if (dir_len + 1 + strlen(d->d_name) < SPI_FILE_PATH_MAX) {
+            name[dir_len] = '/';
+            strcpy(name + dir_len + 1, d->d_name);
+            stat(name, &st);
+            name[dir_len] = '\0';
+        }
+        const int n = snprintf(dst + used, max - used, "%s%s\t%lu\n", d->d_name,
+                               d->d_type == DT_DIR ? "/" : "", (unsigned long)st.st_size);
+        if (n < 0 || used + n >= max) {
+            dst[used] = '\0';
+            ESP_LOGW(TAG, "listing of %s cut at %lu bytes", name, (unsigned long)used);
+            break;
+        }
+        used += n;
+    }
+}
+
+SpiStatus spi_file_list(const char *path, uint16_t path_len, char *dst, uint32_t max)
+{
+    char name[SPI_FILE_PATH_MAX];
+    dst[0] = '\0';
+    if (!full_path(path, path_len, name)) {
+        return SpiBadRequest;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    SpiStatus status = SpiOk;
+    DIR *dh = NULL;
+    if (storage_busy()) {
+        status = SpiBusy;
+    } else if ((dh = opendir(name)) == NULL) {
+        status = SpiNotFound;
+    } else {
+        list_dir(dh, name, dst, max);
+        closedir(dh);
+    }
+    xSemaphoreGive(s_lock);
+    return status;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "spi_proto.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// file access for the SPI master, paths are relative to base_path. Every call checks that the storage is mounted
+// to the application and answers SpiBusy while it is exposed over USB.
+esp_err_t spi_file_init(const char *base_path);
+
+SpiStatus spi_file_open(const char *path, uint16_t path_len, SpiFileMode mode, uint8_t *handle, uint32_t *size);
+// reads up to len bytes at offset, *got < len means end of file
+SpiStatus spi_file_read(uint8_t handle, uint32_t offset, void *dst, uint32_t len, uint32_t *got);
+// chunks may come out of order when the link resends one, each is written at its offset.
+// *position is where the next chunk is expected.
+SpiStatus spi_file_write(uint8_t handle, uint32_t offset, const void *src, uint32_t len, uint32_t *position);
+SpiStatus spi_file_close(uint8_t handle, uint32_t *written);
+SpiStatus spi_file_stat(const char *path, uint16_t path_len, spi_file_rsp_t *rsp);
+// one "name\tsize\n" line per entry, directories end in '/'. Listing is cut at max bytes, dst is always terminated.
+SpiStatus spi_file_list(const char *path, uint16_t path_len, char *dst, uint32_t max);
+
+#ifdef __cplusplus
+}
+#endif
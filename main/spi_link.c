@@ -0,0 +1,230 @@
+#include <string.h>
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "spi_link.h"
+
+static const char *TAG = "spi_link";
+
+static uint32_t frame_crc(spi_frame_header_t* hdr){
+    hdr->crc = 0;
+    return esp_rom_crc32_le(0, (const uint8_t*)hdr, SPI_HEADER_SIZE + hdr->length);
+}
+
+static void stamp(const spi_link_t* link, uint8_t* frame, const RequestType type, uint16_t length, uint8_t flags, uint8_t seq, uint8_t ack, uint8_t ref){
+    spi_frame_header_t* hdr = (spi_frame_header_t*)frame;
+    hdr->magic[0] = SPI_MAGIC_0;
+    hdr->magic[1] = SPI_MAGIC_1;
+    hdr->type = (uint8_t)type;
+    hdr->arg = 0;
+    hdr->length = length;
+    hdr->flags = flags;
+    hdr->status = link->status;
+    hdr->seq = seq;
+    hdr->ack = ack;
+    hdr->ref = ref;
+    hdr->reserved = 0;
+    hdr->crc = frame_crc(hdr);
+}
+
+static uint8_t* frame_slot(spi_link_t* link, uint8_t seq){
+    return link->ring + (seq % SPI_RETX_FRAMES) * SPI_MAX_FRAME_SIZE;
+}
+
+static const uint8_t* nak(spi_link_t* link, uint8_t* own, uint8_t seq){
+    stamp(link, own, Idle, 0, SPI_FLAG_NAK, link->tx_seq, seq, 0);
+    return own;
+}
+
+// the master missed data frame seq, it goes out again unchanged if it is still in the ring. Slots that never
+// held a frame have no fingerprint.
+static const uint8_t* resend(spi_link_t* link, uint8_t* own, uint8_t seq){
+    const uint8_t age = link->tx_seq - seq;
+    const spi_frame_header_t* hdr = (const spi_frame_header_t*)frame_slot(link, seq);
+    if (age >= SPI_RETX_FRAMES - SPI_QUEUE_DEPTH || hdr->seq != seq || hdr->magic[0] != SPI_MAGIC_0){
+        ESP_LOGE(TAG, "Master asks for frame %d, which is gone (last sent %d)", seq, link->tx_seq);
+        link->stats.resends_gone++;
+        return spi_link_idle(link, own);
+    }
+    link->stats.resends++;
+    return frame_slot(link, seq);
+}
+
+static bool rx_is_seen(const spi_link_t* link, uint8_t seq){
+    return link->rx_seen[seq / 32] & (1u << (seq % 32));
+}
+
+static void rx_mark(spi_link_t* link, uint8_t seq){
+    link->rx_seen[seq / 32] |= 1u << (seq % 32);
+    const uint8_t ahead = seq + 128;
+    link->rx_seen[ahead / 32] &= ~(1u << (ahead % 32));
+    if ((int8_t)(seq - link->rx_last) > 0) link->rx_last = seq;
+}
+
+static void rx_unmark(spi_link_t* link, uint8_t seq){
+    link->rx_seen[seq / 32] &= ~(1u << (seq % 32));
+}
+
+// master (re)started with Hello: everything before its sequence number counts as handled
+static void rx_reset(spi_link_t* link, uint8_t seq){
+    memset(link->rx_seen, 0xFF, sizeof(link->rx_seen));
+    for (int i = 1; i <= 128; i++){
+        const uint8_t ahead = seq + i;
+        link->rx_seen[ahead / 32] &= ~(1u << (ahead % 32));
+    }
+    link->rx_last = seq;
+}
+
+// oldest master frame that did not arrive intact, the one a corrupted frame most likely was
+static uint8_t rx_first_missing(const spi_link_t* link){
+    for (int i = 15; i >= 0; i--){
+        const uint8_t seq = link->rx_last - i;
+        if (!rx_is_seen(link, seq)) return seq;
+    }
+    return link->rx_last + 1;
+}
+
+// header of a received frame, NULL if the frame is too short, has no fingerprint, announces more payload than
+// was clocked or fails the crc
+static const spi_frame_header_t* frame_header(spi_link_t* link, uint8_t* rx, size_t received){
+    spi_frame_header_t* hdr = (spi_frame_header_t*)rx;
+    if (received < SPI_HEADER_SIZE){
+        ESP_LOGE(TAG, "Received %d bytes, shorter than the header", (int)received);
+        link->stats.length_errors++;
+        return NULL;
+    }
+    if (hdr->magic[0] != SPI_MAGIC_0 || hdr->magic[1] != SPI_MAGIC_1){
+        ESP_LOGE(TAG, "Received data %x %x, expected 0xCA 0xFE", hdr->magic[0], hdr->magic[1]);
+        link->stats.magic_errors++;
+        return NULL;
+    }
+    if (SPI_HEADER_SIZE + hdr->length > received){
+        ESP_LOGE(TAG, "Received %d bytes, header announces %d payload bytes", (int)received, hdr->length);
+        link->stats.length_errors++;
+        return NULL;
+    }
+    const uint32_t crc = hdr->crc;
+    if (frame_crc(hdr) != crc){
+        ESP_LOGE(TAG, "crc mismatch in frame type 0x%02x seq %d", hdr->type, hdr->seq);
+        link->stats.crc_errors++;
+        return NULL;
+    }
+    return hdr;
+}
+
+void spi_link_init(spi_link_t* link, uint8_t* ring){
+    memset(link, 0, sizeof(*link));
+    link->ring = ring;
+    memset(ring, 0, SPI_MAX_FRAME_SIZE * SPI_RETX_FRAMES);
+    rx_reset(link, 0);
+}
+
+const spi_frame_header_t* spi_link_receive(spi_link_t* link, uint8_t* rx, size_t received, uint8_t* own, const uint8_t** tx){
+    link->stats.frames++;
+    const spi_frame_header_t* hdr = frame_header(link, rx, received);
+    if (hdr == NULL){
+        *tx = nak(link, own, rx_first_missing(link));
+        return NULL;
+    }
+    if (hdr->flags & SPI_FLAG_NAK){
+        *tx = resend(link, own, hdr->ack);
+        return NULL;
+    }
+    if (hdr->type == Idle){
+        link->stats.idle_frames++;
+        return hdr;
+    }
+    if (hdr->type == Hello){
+        rx_reset(link, hdr->seq);
+    }else if (rx_is_seen(link, hdr->seq)){
+        link->stats.duplicates++;
+        *tx = spi_link_idle(link, own);
+        return NULL;
+    }else{
+        rx_mark(link, hdr->seq);
+    }
+    return hdr;
+}
+
+const uint8_t* spi_link_idle(spi_link_t* link, uint8_t* own){
+    stamp(link, own, Idle, 0, 0, link->tx_seq, link->rx_last, 0);
+    return own;
+}
+
+const uint8_t* spi_link_reject(spi_link_t* link, uint8_t* own, const spi_frame_header_t* hdr){
+    link->stats.busy_naks++;
+    rx_unmark(link, hdr->seq);
+    return nak(link, own, hdr->seq);
+}
+
+void spi_link_accept(spi_link_t* link, const spi_frame_header_t* hdr){
+    link->stats.rx_bytes += hdr->length;
+}
+
+const uint8_t* spi_link_answer(spi_link_t* link, const uint8_t* staged){
+    const spi_frame_header_t* answer = (const spi_frame_header_t*)staged;
+    const uint16_t length = answer->length <= SPI_MAX_PAYLOAD ? answer->length : SPI_MAX_PAYLOAD;
+    link->tx_seq++;
+    uint8_t* slot = frame_slot(link, link->tx_seq);
+    memcpy(slot + SPI_HEADER_SIZE, staged + SPI_HEADER_SIZE, length);
+    stamp(link, slot, (RequestType)answer->type, length, 0, link->tx_seq, link->rx_last, answer->ref);
+    link->stats.tx_bytes += length;
+    return slot;
+}
+
+void spi_link_args(const spi_frame_header_t* hdr, void* dst, size_t size){
+    memcpy(dst, (const uint8_t*)hdr + SPI_HEADER_SIZE, hdr->length < size ? hdr->length : size);
+}
+
+uint16_t spi_link_negotiate(const spi_frame_header_t* hdr){
+    spi_hello_req_t req = { .max_frame = SPI_MAX_FRAME_SIZE };
+    spi_link_args(hdr, &req, sizeof(req));
+    uint16_t negotiated = req.max_frame < SPI_MAX_FRAME_SIZE ? req.max_frame : SPI_MAX_FRAME_SIZE;
+    if (negotiated < SPI_MIN_FRAME_SIZE) negotiated = SPI_MIN_FRAME_SIZE;
+    return negotiated;
+}
+
+// Compares the master's pattern with the one for its seed and answers with the pattern for the same seed.
+// Frames damaged on the wire never get here (crc, NAK), mismatches only show up if the crc misses them.
+uint16_t spi_link_calibrate(const spi_frame_header_t* hdr, uint8_t* payload, uint16_t frame_size){
+    spi_calib_req_t req = {0};
+    spi_calib_rsp_t rsp = {0};
+    if (hdr->length < sizeof(req)){
+        rsp.mismatches = UINT16_MAX;
+        memcpy(payload, &rsp, sizeof(rsp));
+        return sizeof(rsp);
+    }
+    memcpy(&req, (const uint8_t*)hdr + SPI_HEADER_SIZE, sizeof(req));
+    const uint8_t* received = (const uint8_t*)hdr + SPI_HEADER_SIZE + sizeof(req);
+    const uint16_t rx_len = hdr->length - sizeof(req);
+    const uint16_t max_len = frame_size - SPI_HEADER_SIZE - sizeof(rsp);
+    rsp.seed = req.seed;
+    rsp.length = req.length < max_len ? req.length : max_len;
+    // the pattern to send back is generated in place and doubles as reference for the received one
+    uint8_t* pattern = payload + sizeof(rsp);
+    spi_calib_pattern(req.seed, pattern, rx_len > rsp.length ? rx_len : rsp.length);
+    for (uint16_t i = 0; i < rx_len; i++){
+        if (received[i] != pattern[i]) rsp.mismatches++;
+    }
+    memcpy(payload, &rsp, sizeof(rsp));
+    return sizeof(rsp) + rsp.length;
+}
+
+uint16_t spi_link_chunk(spi_stream_t* stream, uint8_t* payload, uint16_t frame_size, bool* last){
+    spi_chunk_t chunk = { .offset = stream->offset, .total = stream->total, .seq = stream->seq++ };
+    const uint32_t max_data = frame_size - SPI_HEADER_SIZE - sizeof(chunk);
+    const uint32_t remaining = stream->total - stream->offset;
+    const uint32_t want = remaining < max_data ? remaining : max_data;
+    uint32_t got = 0;
+    chunk.status = stream->source(stream->ctx, stream->offset, payload + sizeof(chunk), want, &got);
+    stream->offset += got;
+    *last = chunk.status != SpiOk || got < want || stream->offset == stream->total;
+    chunk.flags = *last ? SPI_CHUNK_LAST : 0;
+    memcpy(payload, &chunk, sizeof(chunk));
+    return sizeof(chunk) + got;
+}
+
+SpiStatus spi_buffer_source(void* ctx, uint32_t offset, uint8_t* dst, uint32_t max, uint32_t* got){
+    memcpy(dst, (const uint8_t*)ctx + offset, max);
+    *got = max;
+    return SpiOk;
+}
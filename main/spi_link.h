@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "spi_proto.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Link layer of the SPI command interface: frame checks, sequence numbers, NAK/resend and chunk streams.
+ * Plain C without driver or RTOS calls, spi_api.c runs it on the slave, host_test/spi_link runs it against
+ * a simulated master. All calls for one link come from one task.
+ */
+
+// number of transactions armed in the driver at any time, so the next frame is already waiting in DMA
+// while the previous one is parsed. Every transaction has its own tx/rx buffers.
+#ifndef SPI_QUEUE_DEPTH
+#define SPI_QUEUE_DEPTH 3
+#endif
+
+// Data frames go out from a ring that keeps the last SPI_RETX_FRAMES of them for selective resend.
+// Idle and NAK frames use the transaction's own tx buffer. A slot must not be rebuilt while it may
+// still be queued, so only frames more than SPI_QUEUE_DEPTH back from being overwritten are resent.
+#ifndef SPI_RETX_FRAMES
+#define SPI_RETX_FRAMES 8
+#endif
+#if SPI_RETX_FRAMES <= SPI_QUEUE_DEPTH
+#error "SPI_RETX_FRAMES has to be larger than SPI_QUEUE_DEPTH"
+#endif
+// the slot is seq % SPI_RETX_FRAMES, a mask, and the last frames stay in distinct slots when seq wraps at 256
+#if SPI_RETX_FRAMES & (SPI_RETX_FRAMES - 1)
+#error "SPI_RETX_FRAMES has to be a power of two"
+#endif
+
+typedef struct {
+    uint8_t *ring;      // SPI_RETX_FRAMES * SPI_MAX_FRAME_SIZE, DMA capable on the slave
+    uint8_t tx_seq;     // sequence number of the last data frame sent
+    uint8_t rx_last;    // newest master sequence number accepted
+    uint32_t rx_seen[256 / 32]; // master sequence numbers handled, half the number space ahead of rx_last is kept clear
+    uint8_t status;     // SPI_STATUS_* stamped into every frame, kept up to date by the caller
+    spi_stats_t stats;  // link counters, the rest of spi_stats_t stays 0
+} spi_link_t;
+
+void spi_link_init(spi_link_t *link, uint8_t *ring);
+
+/* Takes a frame the master clocked in (received bytes at rx) and returns the idle frame or new request it carries.
+ * Link level traffic is answered right here and NULL returned, *tx is then what goes out next: a NAK in own for a
+ * corrupted frame, the frame the master NAKed from the ring, or an idle frame in own for a request handled before.
+ * own is the transaction's own tx buffer, at least SPI_HEADER_SIZE bytes.
+ */
+const spi_frame_header_t *spi_link_receive(spi_link_t *link, uint8_t *rx, size_t received, uint8_t *own,
+                                           const uint8_t **tx);
+
+// frames going out next, each returns the buffer to clock out
+const uint8_t *spi_link_idle(spi_link_t *link, uint8_t *own);
+// request could not be taken (no room), NAKed so the master sends it again. hdr must not point into own.
+const uint8_t *spi_link_reject(spi_link_t *link, uint8_t *own, const spi_frame_header_t *hdr);
+// request was taken, counts its payload (a rejected one is counted when it comes again)
+void spi_link_accept(spi_link_t *link, const spi_frame_header_t *hdr);
+// staged answer: header fields type, length and ref set, payload behind the header. Copied into the ring.
+const uint8_t *spi_link_answer(spi_link_t *link, const uint8_t *staged);
+
+// copies a request's fixed size arguments to dst, arguments the master left out keep the values in dst
+void spi_link_args(const spi_frame_header_t *hdr, void *dst, size_t size);
+
+// frame size for a Hello from the master
+uint16_t spi_link_negotiate(const spi_frame_header_t *hdr);
+
+// Calibrate answer [spi_calib_rsp_t + pattern] at payload, returns its length. payload has room for
+// SPI_MAX_PAYLOAD bytes, the pattern sent back is cut to frame_size.
+uint16_t spi_link_calibrate(const spi_frame_header_t *hdr, uint8_t *payload, uint16_t frame_size);
+
+// source of a multi-frame response, copies up to max bytes found at offset to dst
+typedef SpiStatus (*spi_chunk_source_t)(void *ctx, uint32_t offset, uint8_t *dst, uint32_t max, uint32_t *got);
+
+typedef struct {
+    const spi_frame_header_t *req;
+    uint32_t offset;    // next byte to send
+    uint32_t total;     // end of the response, UINT32_MAX when only the source knows (files stop at their end)
+    uint16_t seq;
+    spi_chunk_source_t source;
+    void *ctx;
+} spi_stream_t;
+
+// builds the next chunk [spi_chunk_t + data] of the stream at payload, returns the payload length
+uint16_t spi_link_chunk(spi_stream_t *stream, uint8_t *payload, uint16_t frame_size, bool *last);
+
+// chunk source for data in memory, ctx points to it
+SpiStatus spi_buffer_source(void *ctx, uint32_t offset, uint8_t *dst, uint32_t max, uint32_t *got);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,417 @@
+/* Application update over SPI
+ *
+ * The RP2350 streams a new app image into the slot that is not running, so the main firmware can be updated without
+ * USB. Image data is double buffered: the bulk worker fills one buffer from OtaWrite frames while the writer task
+ * programs the other, so flash erase and program overlap the next SPI transfers. Erasing runs one 64 KB block ahead
+ * of the received data, a buffer that arrives finds its flash erased already. OtaWrite answers as soon as the data is
+ * copied, a flash error is sticky and reported by the following answers.
+ * Buffers cover SPI_OTA_BUFFER_SIZE aligned windows of the image, in order they are written as whole windows. A chunk
+ * that comes out of order (resent by the link) ends the current buffer and starts a new one at its offset.
+ * The parts of the image received so far are kept as ranges: a chunk that comes twice is only counted and programmed
+ * once, and OtaEnd finds a hole even if duplicates make up for its size.
+ * The slot is programmed with esp_partition_write, not through an esp_ota handle: esp_ota_write erases on its own and
+ * takes the data in order only. Every byte lands in flash the writer erased before, so the order does not matter.
+ * With flash encryption the master has to send chunks 16 byte aligned. OtaEnd checks the image (esp_image_verify)
+ * and the SHA-256 of what is in flash. Flash writes stall the caches, the SPI slave driver keeps its queued
+ * transactions going meanwhile.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_check.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_image_format.h"
+#include "mbedtls/sha256.h"
+#include "spi_ota.h"
+#include "spi_events.h"
+
+static const char *TAG = "spi_ota";
+
+#ifndef SPI_OTA_BUFFER_SIZE
+#define SPI_OTA_BUFFER_SIZE (16 * 1024) // multiple of the 4 KB flash sector
+#endif
+#define SPI_OTA_ERASE_BLOCK (64 * 1024)
+#define SPI_OTA_SECTOR 4096
+#ifndef SPI_OTA_RANGES
+#define SPI_OTA_RANGES 16 // every chunk the link still has to resend leaves a hole between two ranges
+#endif
+
+typedef struct {
+    uint8_t *data;
+    uint32_t offset; // of data[0] in the image
+    uint32_t len;
+} ota_buffer_t;
+
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+} ota_range_t;
+
+static ota_buffer_t s_buffers[2];
+static QueueHandle_t s_empty; // buffers the worker can fill
+static QueueHandle_t s_full;  // buffers waiting for the writer, NULL restarts it for a new update
+static ota_buffer_t *s_fill;  // held by the worker while an update runs
+
+static const esp_partition_t *s_part;
+static uint32_t s_size;
+static uint8_t s_expected[32];
+static uint8_t s_result[32];
+// written by the worker
+static volatile SpiOtaState s_state;
+static volatile uint32_t s_received; // bytes of the image covered by s_ranges
+static ota_range_t s_ranges[SPI_OTA_RANGES]; // received parts of the image, sorted, neither overlapping nor touching
+static uint32_t s_range_count;
+static volatile uint32_t s_received_end; // highest image offset received, erasing runs ahead of it
+// written by the writer task only, it may be erasing ahead at any time while an update is received
+static volatile uint32_t s_written;
+static volatile uint32_t s_erased;
+static volatile esp_err_t s_error;
+
+// end of the slot area the image needs, sector aligned
+static uint32_t erase_limit(void)
+{
+    const uint32_t end = (s_size + SPI_OTA_SECTOR - 1) & ~(SPI_OTA_SECTOR - 1);
+    return end < s_part->size ? end : s_part->size;
+}
+
+static uint32_t erase_target(void)
+{
+    const uint32_t ahead = s_received_end + SPI_OTA_ERASE_BLOCK;
+    return ahead < erase_limit() ? ahead : erase_limit();
+}
+
+static esp_err_t erase_block(void)
+{
+    const uint32_t len = erase_limit() - s_erased < SPI_OTA_ERASE_BLOCK ? erase_limit() - s_erased : SPI_OTA_ERASE_BLOCK;
+    esp_err_t err = esp_partition_erase_range(s_part, s_erased, len);
+    if (err == ESP_OK) {
+        s_erased += len;
+    }
+    return err;
+}
+
+static void writer_task(void *arg)
+{
+    while (1) {
+        ota_buffer_t *buf;
+        const bool ahead = s_state == SpiOtaReceiving && s_error == ESP_OK && s_erased < erase_target();
+        if (xQueueReceive(s_full, &buf, ahead ? 0 : portMAX_DELAY) != pdTRUE) {
+            s_error = erase_block();
+            continue;
+        }
+        if (buf == NULL) {
+            // OtaBegin, nothing of the update before is erased or written after this point
+            s_written = 0;
+            s_erased = 0;
+            s_error = ESP_OK;
+            xQueueSend(s_empty, &buf, portMAX_DELAY);
+            continue;
+        }
+        esp_err_t err = s_error;
+        while (err == ESP_OK && s_erased < buf->offset + buf->len) {
+            err = erase_block();
+        }
+        if (err == ESP_OK) {
+            err = esp_partition_write(s_part, buf->offset, buf->data, buf->len);
+        }
+        if (err == ESP_OK) {
+            s_written += buf->len;
+        } else if (s_error == ESP_OK) {
+            ESP_LOGE(TAG, "writing %lu bytes at 0x%lx failed: %s", (unsigned long)buf->len,
+                     (unsigned long)buf->offset, esp_err_to_name(err));
+            s_error = err;
+        }
+        buf->len = 0;
+        xQueueSend(s_empty, &buf, portMAX_DELAY);
+    }
+}
+
+// hands the filled buffer to the writer and takes the other one, waits while the writer still has it
+static void submit(void)
+{
+    if (s_fill->len == 0) {
+        return;
+    }
+    xQueueSend(s_full, &s_fill, portMAX_DELAY);
+    xQueueReceive(s_empty, &s_fill, portMAX_DELAY);
+}
+
+// everything received is in flash (or failed) afterwards
+static void drain(void)
+{
+    submit();
+    ota_buffer_t *other;
+    xQueueReceive(s_empty, &other, portMAX_DELAY);
+    xQueueSend(s_empty, &other, portMAX_DELAY);
+}
+
+// waits until the writer is done with the update before, including an erase ahead it may be in the middle of, and
+// has cleared its bookkeeping. s_state must not be SpiOtaReceiving, so the writer does not start erasing again.
+static void restart_writer(void)
+{
+    submit();
+    ota_buffer_t *other;
+    xQueueReceive(s_empty, &other, portMAX_DELAY);
+    ota_buffer_t *restart = NULL;
+    xQueueSend(s_full, &restart, portMAX_DELAY);
+    xQueueReceive(s_empty, &restart, portMAX_DELAY); // both buffers are here, this is the writer's NULL
+    xQueueSend(s_empty, &other, portMAX_DELAY);
+}
+
+void spi_ota_status(spi_ota_rsp_t *rsp)
+{
+    rsp->state = s_state;
+    rsp->slot = s_part ? s_part->subtype - ESP_PARTITION_SUBTYPE_APP_OTA_MIN : 0;
+    rsp->size = s_size;
+    rsp->received = s_received;
+    rsp->written = s_written;
+    rsp->erased = s_erased;
+    memcpy(rsp->sha256, s_result, sizeof(rsp->sha256));
+}
+
+static SpiStatus fail(spi_ota_rsp_t *rsp)
+{
+    s_state = SpiOtaFailed;
+    spi_event_post(SpiEventOta, 0, s_state);
+    spi_ota_status(rsp);
+    return SpiIoError;
+}
+
+esp_err_t spi_ota_init(void)
+{
+    s_empty = xQueueCreate(2, sizeof(ota_buffer_t *));
+    s_full = xQueueCreate(2, sizeof(ota_buffer_t *));
+    ESP_RETURN_ON_FALSE(s_empty && s_full, ESP_ERR_NO_MEM, TAG, "could not create queues");
+    // below the SPI workers, flash programming only has to keep up on average
+    ESP_RETURN_ON_FALSE(xTaskCreatePinnedToCore(writer_task, "spi_ota", 4096, NULL, 4, NULL, tskNO_AFFINITY) == pdPASS,
+                        ESP_ERR_NO_MEM, TAG, "could not create writer task");
+    return ESP_OK;
+}
+
+SpiStatus spi_ota_begin(const spi_ota_begin_req_t *req, spi_ota_rsp_t *rsp)
+{
+    if (s_state == SpiOtaReceiving) {
+        ESP_LOGW(TAG, "update restarted, dropping the one before");
+    }
+    s_state = SpiOtaIdle;
+    if (s_fill != NULL) {
+        restart_writer();
+    }
+    if (s_buffers[0].data == NULL) {
+        // allocated with the first update, most boots never need them
+        for (int i = 0; i < 2; i++) {
+            s_buffers[i].data = malloc(SPI_OTA_BUFFER_SIZE);
+            if (s_buffers[i].data == NULL) {
+                ESP_LOGE(TAG, "no memory for the image buffers");
+                free(s_buffers[0].data);
+                s_buffers[0].data = NULL;
+                return fail(rsp);
+            }
+        }
+        ota_buffer_t *second = &s_buffers[1];
+        xQueueSend(s_empty, &second, 0);
+        s_fill = &s_buffers[0];
+    }
+
+    s_part = esp_ota_get_next_update_partition(NULL);
+    if (s_part == NULL) {
+        ESP_LOGE(TAG, "no app slot to update");
+        spi_ota_status(rsp);
+        return SpiNotFound;
+    }
+    if (req->size == 0 || req->size > s_part->size) {
+        ESP_LOGE(TAG, "image of %lu bytes does not fit %s (%lu bytes)", (unsigned long)req->size, s_part->label,
+                 (unsigned long)s_part->size);
+        spi_ota_status(rsp);
+        return SpiBadRequest;
+    }
+    s_size = req->size;
+    memcpy(s_expected, req->sha256, sizeof(s_expected));
+    memset(s_result, 0, sizeof(s_result));
+    s_received = 0;
+    s_received_end = 0;
+    s_range_count = 0;
+    s_fill->len = 0;
+    // no erase up front, the writer task erases block by block ahead of the data
+    ESP_LOGI(TAG, "receiving %lu byte image for %s", (unsigned long)s_size, s_part->label);
+    s_state = SpiOtaReceiving;
+    spi_ota_status(rsp);
+    return SpiOk;
+}
+
+// copies image data into the fill buffer, it goes to the writer when its window is full or the data jumps
+static void fill(uint32_t offset, const uint8_t *data, uint32_t len)
+{
+    while (len > 0) {
+        if (s_fill->len && offset != s_fill->offset + s_fill->len) {
+            submit(); // out of order
+        }
+        if (s_fill->len == 0) {
+            s_fill->offset = offset;
+        }
+        const uint32_t window_end = (s_fill->offset / SPI_OTA_BUFFER_SIZE + 1) * SPI_OTA_BUFFER_SIZE;
+        const uint32_t room = window_end - offset;
+        const uint32_t n = len < room ? len : room;
+        memcpy(s_fill->data + s_fill->len, data, n);
+        s_fill->len += n;
+        offset += n;
+        data += n;
+        len -= n;
+        if (offset == window_end || offset == s_size) {
+            submit();
+        }
+    }
+}
+
+// [start, end) can be added without a new range or there is room for one
+static bool range_fits(uint32_t start, uint32_t end)
+{
+    for (uint32_t i = 0; i < s_range_count; i++) {
+        if (s_ranges[i].start <= end && s_ranges[i].end >= start) {
+            return true;
+        }
+    }
+    return s_range_count < SPI_OTA_RANGES;
+}
+
+// merges [start, end) with the ranges it overlaps or touches, s_received grows by the bytes that are new
+static void add_range(uint32_t start, uint32_t end)
+{
+    if (start == end) {
+        return;
+    }
+    uint32_t i = 0;
+    while (i < s_range_count && s_ranges[i].end < start) {
+        i++;
+    }
+    uint32_t j = i;
+    uint32_t merged = 0;
+    while (j < s_range_count && s_ranges[j].start <= end) {
+        merged += s_ranges[j].end - s_ranges[j].start;
+        start = s_ranges[j].start < start ? s_ranges[j].start : start;
+        end = s_ranges[j].end > end ? s_ranges[j].end : end;
+        j++;
+    }
+    if (j == i) {
+        memmove(&s_ranges[i + 1], &s_ranges[i], (s_range_count - i) * sizeof(s_ranges[0]));
+        s_range_count++;
+    } else {
+        memmove(&s_ranges[i + 1], &s_ranges[j], (s_range_count - j) * sizeof(s_ranges[0]));
+        s_range_count -= j - i - 1;
+    }
+    s_ranges[i] = (ota_range_t){ .start = start, .end = end };
+    s_received += (end - start) - merged;
+}
+
+SpiStatus spi_ota_write(uint32_t offset, const void *src, uint32_t len, spi_ota_rsp_t *rsp)
+{
+    if (s_state != SpiOtaReceiving) {
+        spi_ota_status(rsp);
+        return s_state == SpiOtaFailed ? SpiIoError : SpiBadRequest;
+    }
+    if (s_error != ESP_OK) {
+        return fail(rsp);
+    }
+    if (offset > s_size || len > s_size - offset) {
+        ESP_LOGE(TAG, "chunk at %lu of %lu bytes is beyond the image", (unsigned long)offset, (unsigned long)len);
+        spi_ota_status(rsp);
+        return SpiBadRequest;
+    }
+    const uint32_t end = offset + len;
+    if (!range_fits(offset, end)) {
+        // not taken at all, so it is neither programmed nor counted. OtaEnd reports the image incomplete.
+        ESP_LOGW(TAG, "too many holes in the image, dropping the chunk at %lu", (unsigned long)offset);
+        spi_ota_status(rsp);
+        return SpiOk;
+    }
+    // only what did not come before, programming it again would write flash that is not erased any more
+    uint32_t pos = offset;
+    for (uint32_t i = 0; i < s_range_count && pos < end && s_ranges[i].start < end; i++) {
+        if (s_ranges[i].end <= pos) {
+            continue;
+        }
+        if (s_ranges[i].start > pos) {
+            fill(pos, (const uint8_t *)src + (pos - offset), s_ranges[i].start - pos);
+        }
+        pos = s_ranges[i].end;
+    }
+    if (pos < end) {
+        fill(pos, (const uint8_t *)src + (pos - offset), end - pos);
+    }
+    add_range(offset, end);
+    if (end > s_received_end) {
+        s_received_end = end;
+    }
+    spi_ota_status(rsp);
+    return SpiOk;
+}
+
+// SHA-256 of the image as it is in flash
+static esp_err_t flash_sha256(uint8_t *sha256)
+{
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+    esp_err_t err = ESP_OK;
+    for (uint32_t offset = 0; offset < s_size && err == ESP_OK; offset += SPI_OTA_BUFFER_SIZE) {
+        const uint32_t n = s_size - offset < SPI_OTA_BUFFER_SIZE ? s_size - offset : SPI_OTA_BUFFER_SIZE;
+        err = esp_partition_read(s_part, offset, s_fill->data, n);
+        if (err == ESP_OK) {
+            mbedtls_sha256_update(&ctx, s_fill->data, n);
+        }
+    }
+    mbedtls_sha256_finish(&ctx, sha256);
+    mbedtls_sha256_free(&ctx);
+    return err;
+}
+
+SpiStatus spi_ota_end(bool activate, spi_ota_rsp_t *rsp)
+{
+    if (s_state != SpiOtaReceiving) {
+        spi_ota_status(rsp);
+        return s_state == SpiOtaFailed ? SpiIoError : SpiBadRequest;
+    }
+    drain();
+    if (s_received < s_size) {
+        ESP_LOGE(TAG, "image incomplete, %lu of %lu bytes", (unsigned long)s_received, (unsigned long)s_size);
+        spi_ota_status(rsp);
+        return SpiBadRequest; // still receiving, the master can send what is missing
+    }
+    if (s_error != ESP_OK) {
+        return fail(rsp);
+    }
+    const esp_partition_pos_t pos = { .offset = s_part->address, .size = s_part->size };
+    esp_image_metadata_t image;
+    esp_err_t err = esp_image_verify(ESP_IMAGE_VERIFY, &pos, &image);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "image check failed: %s", esp_err_to_name(err));
+        return fail(rsp);
+    }
+    err = flash_sha256(s_result);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "could not read the image back: %s", esp_err_to_name(err));
+        return fail(rsp);
+    }
+    static const uint8_t unset[32] = {0};
+    if (memcmp(s_expected, unset, sizeof(unset)) != 0 && memcmp(s_expected, s_result, sizeof(s_result)) != 0) {
+        ESP_LOGE(TAG, "SHA-256 of the image in flash does not match");
+        return fail(rsp);
+    }
+    if (activate) {
+        err = esp_ota_set_boot_partition(s_part);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "could not select %s for boot: %s", s_part->label, esp_err_to_name(err));
+            return fail(rsp);
+        }
+    }
+    ESP_LOGI(TAG, "image in %s verified%s", s_part->label, activate ? ", boots next" : "");
+    s_state = SpiOtaVerified;
+    spi_event_post(SpiEventOta, 0, s_state);
+    spi_ota_status(rsp);
+    return SpiOk;
+}
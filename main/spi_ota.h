@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "spi_proto.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// application update for the SPI master, into the app slot that is not running. Begin, write and end are called
+// from one task (the bulk worker), status from any.
+esp_err_t spi_ota_init(void);
+
+SpiStatus spi_ota_begin(const spi_ota_begin_req_t *req, spi_ota_rsp_t *rsp);
+// data at offset within the image, chunks may come out of order when the link resends one
+SpiStatus spi_ota_write(uint32_t offset, const void *src, uint32_t len, spi_ota_rsp_t *rsp);
+// waits for the flash, checks the image, activate selects it for the next boot
+SpiStatus spi_ota_end(bool activate, spi_ota_rsp_t *rsp);
+void spi_ota_status(spi_ota_rsp_t *rsp);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,352 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* SPI command interface framing, shared by the slave (spi_api.c) and host side tools
+ *
+ * Every transaction starts with a fixed header followed by `length` payload bytes (little endian).
+ * The master clocks the header first and then, within the same CS assertion, as many bytes as the longer of
+ * its own payload and the response payload announced in the slave's header, rounded up to a multiple of 4.
+ * Small requests are therefore only a few bytes on the bus, the largest frame is negotiated with Hello.
+ *
+ * With CONFIG_SPI_API_QUAD the slave runs the half duplex driver (spi_slave_hd, 8 bit command, address and dummy)
+ * and one exchange is two transactions carrying the same frames: the master writes its frame (WRDMA 0x03, then WR_END
+ * 0x07), then reads the slave's header and announced payload, rounded up to 4 (RDDMA 0x04, ended with 0x08).
+ * Hello grants the data lines, from then on the master may use the DIO (0x53/0x54) or QIO (0xA3/0xA4) variants.
+ *
+ * Integrity: every frame carries a crc32 (zlib polynomial) over header and payload, computed with the crc field 0.
+ * Frames other than idle frames are numbered per direction (seq, wrapping at 256); idle frames repeat the last one.
+ * - the master NAKs a slave frame that failed the crc by clocking an idle frame with SPI_FLAG_NAK and ack = seq,
+ *   the slave sends just that frame again (its last few frames are kept)
+ * - the slave answers a corrupted master frame with an idle frame with SPI_FLAG_NAK and ack = seq to resend,
+ *   its other frames carry ack = newest master frame accepted. Frames it handled before are not handled again.
+ * - Hello restarts the master's numbering, the master sends it first after its own reset.
+ *
+ * Pipelining: the master does not wait for an answer before sending its next request, every frame it clocks carries
+ * a new request or an idle frame and picks up the next answer frame. Answers carry ref = seq of their request.
+ * Requests are queued to a worker per class (control or file requests, up to 4 each), beyond that they are NAKed.
+ * The handshake line is high while the slave has answer frames armed or a request in progress, the status byte of
+ * every slave frame tells more (SPI_STATUS_*).
+ *
+ * Events: storage, OTA and SD card state changes are queued on the slave (SpiEventType). A new event raises the
+ * handshake until a frame with SPI_STATUS_EVENTS went out or the queue is empty, so an idle master needs no polling, it
+ * clocks one frame and drains the queue with GetEvents.
+ */
+
+#define SPI_MAGIC_0 0xCA
+#define SPI_MAGIC_1 0xFE
+#define SPI_PROTOCOL_VERSION 14
+
+// the slave build sets it from CONFIG_SPI_API_FRAME_SIZE, host tools use the default unless they are told otherwise
+#ifndef SPI_MAX_FRAME_SIZE
+#define SPI_MAX_FRAME_SIZE 2048 // header + payload, size of the slave's DMA buffers
+#endif
+#define SPI_MIN_FRAME_SIZE 64
+#if (SPI_MAX_FRAME_SIZE % 4) || SPI_MAX_FRAME_SIZE < SPI_MIN_FRAME_SIZE || SPI_MAX_FRAME_SIZE > 0xFFFF
+#error "SPI_MAX_FRAME_SIZE has to be a multiple of 4 between SPI_MIN_FRAME_SIZE and 65535 (u16 length)"
+#endif
+
+typedef enum{
+    Idle = 0x00, // nothing to say, clocked by the master while it waits for a response
+    Hello = 0x01, // negotiates the frame size and data lines, args [spi_hello_req_t], returns [spi_hello_rsp_t]
+    Reboot = 0x13, // args [spi_reboot_req_t] or none, takes the storage down, returns [spi_shutdown_rsp_t], then reboots
+    GetFirmwareInfo = 0x19, // arg [0: json, 1: spi_firmware_info_t], returns chunks. json has "HWV" hardware version,
+                            // "FWV" firmware version, "OTA" active ota partition and the other spi_firmware_info_t fields
+    GetStats = 0x1A, // arg [1: reset the counters afterwards], returns [spi_stats_t + spi_stats_type_t x types] as chunks,
+                     // or a single chunk with SpiTimeout when the link counters could not be taken
+    GetEvents = 0x1B, // returns [spi_events_rsp_t + spi_event_entry_t x count], oldest first, as many as fit in one frame
+    RebootToOTAX = 0x22, // reboots the device to OTAX, arg [X], args and answer like Reboot
+    FileOpen = 0x30, // opens a file below the base path, arg [SpiFileMode], args [path], returns [spi_file_rsp_t] with the handle
+    FileRead = 0x31, // arg [handle], args [spi_file_read_req_t], returns a stream of [spi_chunk_t + data]
+    FileWrite = 0x32, // arg [handle], args [spi_chunk_t + data], every frame is answered with [spi_file_rsp_t]
+    FileClose = 0x33, // arg [handle], returns [spi_file_rsp_t]
+    FileStat = 0x34, // args [path], returns [spi_file_rsp_t] with size, mtime and flags
+    FileList = 0x35, // args [path], returns text as chunks, one "name\tsize\n" line per entry, directories end in '/',
+                     // a missing directory, busy storage or no memory on the slave end the stream with the chunk status
+    OtaBegin = 0x40, // args [spi_ota_begin_req_t], starts an update of the inactive app slot, returns [spi_ota_rsp_t]
+    OtaWrite = 0x41, // args [spi_chunk_t + data], offset within the image, every frame is answered with [spi_ota_rsp_t]
+    OtaEnd = 0x42, // arg [1: boot the new image with the next restart], verifies the image, returns [spi_ota_rsp_t]
+    OtaStatus = 0x43, // returns [spi_ota_rsp_t], progress of the running update
+    Calibrate = 0x50, // args [spi_calib_req_t + pattern], returns [spi_calib_rsp_t + pattern], link self-test
+    SetCalibration = 0x51, // args [spi_calib_t], persisted on the slave, returns [spi_calib_t] as stored
+    GetCalibration = 0x52, // returns [spi_calib_t], also part of the Hello answer
+} RequestType; // other types are answered with a single [spi_chunk_t] with status SpiBadRequest
+
+typedef enum{
+    SpiOk = 0x00,
+    SpiBusy = 0x01, // storage is exposed over USB, the application side (and so the SPI master) must not touch it
+    SpiBadRequest = 0x02,
+    SpiNotFound = 0x03,
+    SpiBadHandle = 0x04,
+    SpiTooManyOpen = 0x05,
+    SpiIoError = 0x06,
+    SpiTimeout = 0x07, // the slave gave up waiting, e.g. GetStats when the master stopped clocking
+} SpiStatus;
+
+typedef struct __attribute__((packed)) {
+    uint8_t magic[2];   // SPI_MAGIC_0, SPI_MAGIC_1
+    uint8_t type;       // RequestType, responses carry the type of the request they answer
+    uint8_t arg;        // first request parameter, e.g. OTA slot
+    uint16_t length;    // payload bytes following the header
+    uint8_t flags;      // SPI_FLAG_*
+    uint8_t status;     // slave frames: SPI_STATUS_* flow control, master frames: 0
+    uint8_t seq;
+    uint8_t ack;
+    uint8_t ref;        // answer frames: seq of the request they answer
+    uint8_t reserved;
+    uint32_t crc;
+} spi_frame_header_t;
+
+#define SPI_FLAG_NAK 0x01 // ack is the sequence number of a frame that has to be sent again
+
+/* Flow control: every slave frame carries the slave's state from when it was armed, up to SPI_QUEUE_DEPTH - 1 frames
+ * before the master clocks it (a resent frame keeps its old status). Requests the master sent after the frame's ack
+ * are not in it yet, the master takes them off the credits.
+ * - TX_PENDING: more answer frames are staged behind this one, keep clocking
+ * - BUSY: requests are queued or running, their answers follow. Without TX_PENDING the master waits for the
+ *   handshake line instead of polling with idle frames.
+ * - CONTROL_READY: the control worker takes another request
+ * - EVENTS: events are queued, the master fetches them with GetEvents
+ * - bits 4-7: requests the bulk worker takes before it NAKs, the master can send that many file frames in a burst
+ */
+#define SPI_STATUS_TX_PENDING 0x01
+#define SPI_STATUS_BUSY 0x02
+#define SPI_STATUS_CONTROL_READY 0x04
+#define SPI_STATUS_EVENTS 0x08
+#define SPI_STATUS_BULK_SHIFT 4
+#define SPI_STATUS_BULK_FREE(status) ((status) >> SPI_STATUS_BULK_SHIFT)
+
+#define SPI_HEADER_SIZE sizeof(spi_frame_header_t)
+#define SPI_MAX_PAYLOAD (SPI_MAX_FRAME_SIZE - SPI_HEADER_SIZE)
+
+typedef struct __attribute__((packed)) {
+    uint16_t max_frame; // largest frame the master can clock
+    uint8_t lines;      // data lines the master can use: 1, 2 or 4, left out means 1
+} spi_hello_req_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t version;    // SPI_PROTOCOL_VERSION
+    uint8_t lines;      // data lines granted, never more than asked for, more than 1 only with CONFIG_SPI_API_QUAD
+    uint16_t max_frame; // largest frame the slave can take
+    uint16_t frame;     // negotiated frame size, the slave never sends more than this
+    uint32_t clock_hz;  // calibrated link clock (spi_calib_t), 0 before the first calibration
+    uint8_t mode;
+    uint8_t sample_delay;
+} spi_hello_rsp_t;
+
+typedef enum{
+    SpiFileRead = 0x00,
+    SpiFileWrite = 0x01, // create or truncate
+    SpiFileAppend = 0x02,
+} SpiFileMode;
+
+#define SPI_FILE_FLAG_DIR 0x01
+
+typedef struct __attribute__((packed)) {
+    uint8_t status;     // SpiStatus
+    uint8_t handle;
+    uint8_t flags;      // SPI_FILE_FLAG_*
+    uint8_t reserved;
+    uint32_t value;     // FileOpen/FileStat: file size, FileWrite/FileClose: bytes written so far
+    uint32_t mtime;     // FileStat only, unix time
+} spi_file_rsp_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t offset;
+    uint32_t length;    // 0 reads up to the end of the file
+} spi_file_read_req_t;
+
+#define SPI_CHUNK_LAST 0x01
+
+// Multi-frame responses (GetFirmwareInfo, FileRead, FileList) are a stream of frames with this in front of the data,
+// FileWrite request frames carry it as well. The master puts chunks together by offset, so a resent chunk may
+// arrive after later ones.
+typedef struct __attribute__((packed)) {
+    uint32_t offset;    // of the data within the response, FileRead/FileWrite: file offset
+    uint32_t total;     // end of the response, 0xFFFFFFFF when not known up front (FileRead up to the end of file)
+    uint16_t seq;       // counts up from 0 for every response
+    uint8_t status;     // SpiStatus, an error ends the stream
+    uint8_t flags;      // SPI_CHUNK_*
+} spi_chunk_t;
+
+// GetFirmwareInfo arg 1, strings are zero terminated (cut if longer)
+typedef struct __attribute__((packed)) {
+    char hw_version[8];
+    char fw_version[16];
+    char ota[8];            // running partition, "ota0", "ota1" or "factory"
+    char app_version[32];   // from the app description
+    char project[32];
+    char idf_version[32];
+    char build_date[16];
+    char build_time[16];
+    uint8_t app_sha256[8];  // first bytes of the app's elf sha256
+    char sd_name[8];        // card product name, empty without SD card
+    uint32_t sd_sectors;
+    uint16_t sd_sector_size;
+    uint16_t reserved;
+    uint32_t sd_freq_khz;   // card clock after init
+    uint8_t usb_high_speed;
+    uint8_t reserved2;
+    uint16_t frame;         // negotiated SPI frame size
+    uint32_t spi_clock_hz;  // calibrated link clock, 0 before the first calibration
+} spi_firmware_info_t;
+
+/* Statistics since boot (or the last reset with GetStats arg 1), for polling the device health without parsing json.
+ * Byte counts are payload bytes of data frames, idle frames and headers are not counted.
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t type;       // RequestType, 0xFF for types the slave does not know
+    uint8_t reserved[3];
+    uint32_t count;
+    uint32_t avg_us;    // handling time in the worker, without queueing and transfer
+    uint32_t max_us;
+} spi_stats_type_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t types;      // spi_stats_type_t entries following
+    uint8_t reserved[3];
+    uint32_t uptime_ms;
+    // link
+    uint32_t frames;        // transactions completed, including idle frames
+    uint32_t idle_frames;
+    uint32_t length_errors; // shorter than the header or announcing more payload than was clocked
+    uint32_t magic_errors;
+    uint32_t crc_errors;
+    uint32_t duplicates;    // requests that came again although they were handled
+    uint32_t resends;       // frames sent again on a NAK from the master
+    uint32_t resends_gone;  // NAKs for frames no longer in the resend ring
+    uint32_t busy_naks;     // requests NAKed because their worker was full
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+    // USB mass storage and SD card
+    uint32_t msc_commands;
+    uint32_t msc_reads;     // READ10
+    uint32_t msc_writes;    // WRITE10
+    uint64_t msc_read_bytes;
+    uint64_t msc_write_bytes;
+    uint32_t msc_max_read_us;
+    uint32_t msc_max_write_us;
+    uint32_t usb_suspends;
+    uint32_t sd_errors;     // failed card reads and writes
+} spi_stats_t;
+
+/* Reboot: the slave detaches USB, unmounts FatFs, flushes the card and stops the sd host before it restarts, the
+ * answer goes out in between. Steps that would start after the deadline are skipped, the restart comes at the
+ * deadline at the latest, answered or not.
+ */
+typedef struct __attribute__((packed)) {
+    uint16_t deadline_ms; // 0: slave default (SPI_SHUTDOWN_DEADLINE_MS)
+    uint16_t reserved;
+} spi_reboot_req_t;
+
+#define SPI_SHUTDOWN_USB 0x01
+#define SPI_SHUTDOWN_UNMOUNT 0x02 // not set if the storage was exposed over USB, the host had it
+#define SPI_SHUTDOWN_FLUSH 0x04
+#define SPI_SHUTDOWN_SD_HOST 0x08
+
+typedef struct __attribute__((packed)) {
+    uint8_t status;     // SpiStatus: SpiOk, SpiIoError if a step failed or was skipped, SpiBadRequest for a bad OTA slot
+    uint8_t steps;      // SPI_SHUTDOWN_* that ran
+    uint16_t reserved;
+    uint32_t total_us;  // shutdown time measured on the slave
+    uint32_t usb_us;
+    uint32_t unmount_us;
+    uint32_t flush_us;
+    uint32_t sd_host_us;
+} spi_shutdown_rsp_t;
+
+/* Application update: OtaBegin, OtaWrite frames with the image, OtaEnd, then Reboot. The image goes to the app slot
+ * that is not running. Written chunks are answered right away, flash erase and programming run behind (written and
+ * erased lag received), a flash error shows up in the status of a later answer. OtaEnd waits for the flash, checks
+ * the image and the SHA-256 of what is in flash against the one from OtaBegin.
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t size;      // image size in bytes
+    uint8_t sha256[32]; // of the image, all zero: not checked, only reported
+} spi_ota_begin_req_t;
+
+typedef enum{
+    SpiOtaIdle = 0x00,
+    SpiOtaReceiving = 0x01,
+    SpiOtaVerified = 0x02, // OtaEnd passed, image checked
+    SpiOtaFailed = 0x03,   // flash error, bad image or SHA-256 mismatch, OtaBegin starts over
+} SpiOtaState;
+
+typedef struct __attribute__((packed)) {
+    uint8_t status;     // SpiStatus of this request: SpiBadRequest for chunks beyond the image, SpiIoError once failed
+    uint8_t state;      // SpiOtaState
+    uint8_t slot;       // app slot being written, 0 or 1
+    uint8_t reserved;
+    uint32_t size;
+    uint32_t received;  // image bytes taken from the master, a chunk that came twice counts once
+    uint32_t written;   // image bytes programmed to flash
+    uint32_t erased;    // bytes of the slot erased, runs ahead of written
+    uint8_t sha256[32]; // OtaEnd: of the image as read back from flash
+} spi_ota_rsp_t;
+
+typedef enum{
+    SpiEventStorage = 0x01, // arg [1: storage mounted by the application (SPI file requests work), 0: exposed over USB]
+    SpiEventOta = 0x02,     // arg [0: application image (OtaEnd), 1: C6 firmware from the card], value: SpiOtaState
+    SpiEventSdError = 0x03, // value: failed card reads and writes since boot, like spi_stats_t.sd_errors
+} SpiEventType;
+
+// An event of the same type and arg as the newest queued one replaces its value and time instead of taking a slot,
+// an error burst stays one event. When the queue is full the oldest event goes, dropped counts them.
+typedef struct __attribute__((packed)) {
+    uint8_t type;       // SpiEventType
+    uint8_t arg;
+    uint16_t seq;       // counts up per event, a gap means events were dropped
+    uint32_t value;
+    uint32_t time_ms;   // since boot
+} spi_event_entry_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t count;      // spi_event_entry_t following
+    uint8_t pending;    // events still queued, the master asks again
+    uint16_t dropped;   // events lost to a full queue since the last GetEvents
+} spi_events_rsp_t;
+
+/* Calibration: the master sweeps clock rates and its sample points. At every setting it sends Calibrate frames carrying
+ * the pattern for seed, the slave compares them and answers with the pattern for the same seed. Master counts NAKs
+ * (MOSI errors), crc failures of the answers (MISO errors) and pattern mismatches, then stores the highest error free
+ * setting with SetCalibration. The slave keeps it in NVS and reports it with Hello after every boot.
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t seed;
+    uint16_t length;    // pattern bytes the slave sends back, cut to the negotiated frame size
+    uint16_t reserved;
+} spi_calib_req_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t seed;
+    uint16_t length;    // pattern bytes following
+    uint16_t mismatches; // bytes of the request's pattern that differed
+} spi_calib_rsp_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t clock_hz;  // highest error free clock
+    uint8_t mode;       // SPI mode the sweep ran with
+    uint8_t sample_delay; // master's rx sample delay at that clock, in master system clock cycles
+    uint16_t frames;    // frames exchanged per setting
+    uint32_t margin_hz; // first clock that failed, 0 if none in the sweep did
+} spi_calib_t;
+
+// xorshift32 calibration pattern, both sides generate it from the seed
+static inline void spi_calib_pattern(uint32_t seed, uint8_t *dst, uint32_t len)
+{
+    uint32_t x = seed ? seed : 0x2545F491;
+    for (uint32_t i = 0; i < len; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        dst[i] = (uint8_t)x;
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
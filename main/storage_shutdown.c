@@ -0,0 +1,110 @@
+/* Storage shutdown before a reboot
+ *
+ * A reboot straight out of a request handler loses the writes the coalescing still holds back and leaves FatFs
+ * dirty, the next mount may then run a slow repair. The order matters:
+ * 1. USB detach: the host sees the medium go away and sends nothing more. A command already in the TinyUSB task
+ *    finishes on its own, the card access it does is serialised with the flush below.
+ * 2. FatFs unmount if the application has the storage: the premount callback closes the SPI file handles first
+ *    (fclose writes their buffers and directory entries), afterwards SPI file requests answer SpiBusy.
+ * 3. Flush the coalesced writes to the card.
+ * 4. Stop the sd host, so no transfer is cut by the reset.
+ * Every step is timed. One that would start after the deadline is skipped, the reboot must not hang on a card
+ * that stopped answering.
+ * The detach and the unmount make esp_tinyusb report mount changes, storage_shutdown_started() tells the mount
+ * change callback to leave those alone instead of starting the C6 update or switching the boot slot.
+ */
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "tinyusb.h"
+#include "tusb_msc_storage.h"
+#include "custom_sdmmc_cmd.h"
+#include "storage_shutdown.h"
+
+static const char *TAG = "shutdown";
+
+static volatile bool s_started;
+
+#ifndef SHUTDOWN_USB_SETTLE_MS
+#define SHUTDOWN_USB_SETTLE_MS 20 // lets the TinyUSB task finish the MSC command it is in
+#endif
+
+static bool step_begin(int64_t deadline_us, spi_shutdown_rsp_t *rsp, const char *name)
+{
+    if (esp_timer_get_time() < deadline_us) {
+        return true;
+    }
+    ESP_LOGW(TAG, "deadline passed, skipping %s", name);
+    rsp->status = SpiIoError;
+    return false;
+}
+
+// marks the step as done, returns its time
+static uint32_t step_end(spi_shutdown_rsp_t *rsp, uint8_t step, int64_t start)
+{
+    rsp->steps |= step;
+    return (uint32_t)(esp_timer_get_time() - start);
+}
+
+esp_err_t storage_shutdown(const sdmmc_card_t *card, int64_t deadline_us, spi_shutdown_rsp_t *rsp)
+{
+    const int64_t begin = esp_timer_get_time();
+    esp_err_t ret = ESP_OK;
+    int64_t start;
+    s_started = true;
+
+    if (step_begin(deadline_us, rsp, "usb detach")) {
+        start = esp_timer_get_time();
+        tud_disconnect();
+        vTaskDelay(pdMS_TO_TICKS(SHUTDOWN_USB_SETTLE_MS));
+        rsp->usb_us = step_end(rsp, SPI_SHUTDOWN_USB, start);
+    }
+
+    if (!tinyusb_msc_storage_in_use_by_usb_host() && step_begin(deadline_us, rsp, "unmount")) {
+        start = esp_timer_get_time();
+        esp_err_t err = tinyusb_msc_storage_unmount();
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "unmount failed: %s", esp_err_to_name(err));
+            rsp->status = SpiIoError;
+            ret = err;
+        }
+        rsp->unmount_us = step_end(rsp, SPI_SHUTDOWN_UNMOUNT, start);
+    }
+
+    if (step_begin(deadline_us, rsp, "flush")) {
+        start = esp_timer_get_time();
+        esp_err_t err = custom_sdmmc_flush();
+        if (err == ESP_OK) {
+            err = custom_sdmmc_take_deferred_error(); // data the host was told is written
+        }
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "flush failed: %s", esp_err_to_name(err));
+            rsp->status = SpiIoError;
+            ret = err;
+        }
+        rsp->flush_us = step_end(rsp, SPI_SHUTDOWN_FLUSH, start);
+    }
+
+    if (card && step_begin(deadline_us, rsp, "sd host")) {
+        start = esp_timer_get_time();
+        if (card->host.flags & SDMMC_HOST_FLAG_DEINIT_ARG) {
+            card->host.deinit_p(card->host.slot);
+        } else {
+            card->host.deinit();
+        }
+        rsp->sd_host_us = step_end(rsp, SPI_SHUTDOWN_SD_HOST, start);
+    }
+
+    rsp->total_us = (uint32_t)(esp_timer_get_time() - begin);
+    ESP_LOGI(TAG, "storage down in %lu us (usb %lu, unmount %lu, flush %lu, sd host %lu), steps 0x%02x",
+             (unsigned long)rsp->total_us, (unsigned long)rsp->usb_us, (unsigned long)rsp->unmount_us,
+             (unsigned long)rsp->flush_us, (unsigned long)rsp->sd_host_us, rsp->steps);
+    return ret;
+}
+
+bool storage_shutdown_started(void)
+{
+    return s_started;
+}
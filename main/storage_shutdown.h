@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "sdmmc_cmd.h"
+#include "spi_proto.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Takes the storage down for a reboot: USB detach, FatFs unmount (closes the SPI file handles), coalesced writes
+// flushed, sd host stopped. Steps that would start after deadline_us (esp_timer time) are skipped, rsp reports the
+// time of every step and which ones ran. card is NULL when the storage is not an SD card.
+// Nothing may use the storage afterwards, the caller restarts.
+esp_err_t storage_shutdown(const sdmmc_card_t *card, int64_t deadline_us, spi_shutdown_rsp_t *rsp);
+
+// true once storage_shutdown() began, the mount change callback then must not start anything on the storage
+bool storage_shutdown_started(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -14,21 +14,31 @@
 #include <errno.h>
 #include <dirent.h>
 #include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
 #include "sdkconfig.h"
 #include "esp_console.h"
 #include "esp_check.h"
 #include "esp_partition.h"
+#include "esp_mac.h"
 #include "driver/gpio.h"
 #include "tinyusb.h"
 #include "tusb_msc_storage.h"
 #include "esp_ota_ops.h"
+#include "nvs_flash.h"
 #include "spi_api.h"
+#include "spi_events.h"
 #include "ota_c6_sdcard.h"
+#include "msc_stats.h"
+#include "custom_sdmmc_cmd.h"
+#include "usb_power.h"
+#include "storage_shutdown.h"
 
 #ifdef CONFIG_EXAMPLE_STORAGE_MEDIA_SDMMC
 #include "sdmmc_cmd.h"
 #include "diskio_impl.h"
 #include "diskio_sdmmc.h"
+#include "tusb_raw_stream.h"
 #if CONFIG_EXAMPLE_SD_PWR_CTRL_LDO_INTERNAL_IO
 #include "sd_pwr_ctrl_by_on_chip_ldo.h"
 #endif // CONFIG_EXAMPLE_SD_PWR_CTRL_LDO_INTERNAL_IO
@@ -53,10 +63,22 @@ static SemaphoreHandle_t _wait_console_smp = NULL;
 /* TinyUSB descriptors
    ********************************************************************* */
 #define EPNUM_MSC       1
+#define EPNUM_VENDOR    2
+
+// raw block streaming interface next to MSC, needs the sd card and CONFIG_TINYUSB_VENDOR_COUNT > 0
+#if CFG_TUD_VENDOR && defined(CONFIG_EXAMPLE_STORAGE_MEDIA_SDMMC)
+#define RAW_STREAM_ENABLED 1
+#define TUSB_DESC_TOTAL_LEN (TUD_CONFIG_DESC_LEN + TUD_MSC_DESC_LEN + TUD_VENDOR_DESC_LEN)
+#else
+#define RAW_STREAM_ENABLED 0
 #define TUSB_DESC_TOTAL_LEN (TUD_CONFIG_DESC_LEN + TUD_MSC_DESC_LEN)
+#endif
 
 enum {
     ITF_NUM_MSC = 0,
+#if RAW_STREAM_ENABLED
+    ITF_NUM_VENDOR,
+#endif
     ITF_NUM_TOTAL
 };
 
@@ -66,6 +88,9 @@ enum {
 
     EDPT_MSC_OUT  = 0x01,
     EDPT_MSC_IN   = 0x81,
+
+    EDPT_VENDOR_OUT = EPNUM_VENDOR,
+    EDPT_VENDOR_IN  = 0x80 | EPNUM_VENDOR,
 };
 
 static tusb_desc_device_t descriptor_config = {
@@ -91,6 +116,10 @@ static uint8_t const msc_fs_configuration_desc[] = {
 
     // Interface number, string index, EP Out & EP In address, EP size
     TUD_MSC_DESCRIPTOR(ITF_NUM_MSC, 0, EDPT_MSC_OUT, EDPT_MSC_IN, 64),
+#if RAW_STREAM_ENABLED
+    // Interface number, string index, EP Out & EP In address, EP size
+    TUD_VENDOR_DESCRIPTOR(ITF_NUM_VENDOR, 5, EDPT_VENDOR_OUT, EDPT_VENDOR_IN, 64),
+#endif
 };
 
 #if (TUD_OPT_HIGH_SPEED)
@@ -112,6 +141,10 @@ static uint8_t const msc_hs_configuration_desc[] = {
 
     // Interface number, string index, EP Out & EP In address, EP size
     TUD_MSC_DESCRIPTOR(ITF_NUM_MSC, 0, EDPT_MSC_OUT, EDPT_MSC_IN, 512),
+#if RAW_STREAM_ENABLED
+    // Interface number, string index, EP Out & EP In address, EP size
+    TUD_VENDOR_DESCRIPTOR(ITF_NUM_VENDOR, 5, EDPT_VENDOR_OUT, EDPT_VENDOR_IN, 512),
+#endif
 };
 #endif // TUD_OPT_HIGH_SPEED
 
@@ -119,9 +152,13 @@ static char const *string_desc_arr[] = {
     (const char[]) { 0x09, 0x04 },  // 0: is supported language is English (0x0409)
     "CTAG",                      // 1: Manufacturer
     "CTAG-TBD",               // 2: Product
-    "123456",                       // 3: Serials
+    "123456",                       // 3: Serials, replaced at startup by usb_serial_init()
     "TBDDISK",                  // 4. MSC
+    "TBDRAW",                   // 5. Raw block streaming (vendor)
 };
+
+// serial number string descriptor, factory MAC and, with sd card storage, the card's CID serial
+static char serial_str[24];
 /*********************************************************************** TinyUSB descriptors*/
 
 #define BASE_PATH "/data" // base path to mount the partition
@@ -132,6 +169,7 @@ static int console_read(int argc, char **argv);
 static int console_write(int argc, char **argv);
 static int console_size(int argc, char **argv);
 static int console_status(int argc, char **argv);
+static int console_mscstats(int argc, char **argv);
 static int console_exit(int argc, char **argv);
 const esp_console_cmd_t cmds[] = {
     {
@@ -164,6 +202,12 @@ const esp_console_cmd_t cmds[] = {
         .hint = NULL,
         .func = &console_status,
     },
+    {
+        .command = "mscstats",
+        .help = "show MSC per opcode counts, transfer sizes and CBW to CSW times",
+        .hint = "[reset]",
+        .func = &console_mscstats,
+    },
     {
         .command = "exit",
         .help = "exit from application",
@@ -274,6 +318,18 @@ static int console_status(int argc, char **argv)
     return 0;
 }
 
+// Show or reset MSC statistics
+static int console_mscstats(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+        msc_stats_reset();
+        printf("MSC statistics reset\n");
+        return 0;
+    }
+    msc_stats_print();
+    return 0;
+}
+
 // Exit from application
 static int console_exit(int argc, char **argv)
 {
@@ -304,6 +360,11 @@ static void storage_mount_changed_cb(tinyusb_msc_event_t *event)
 {
     static bool first_time = false;
     ESP_LOGI(TAG, "Storage mounted to application: %s", event->mount_changed_data.is_mounted ? "Yes" : "No");
+    if (storage_shutdown_started()) {
+        return; // the reboot takes the storage down, nothing may start on it now
+    }
+    spi_event_post(SpiEventStorage, event->mount_changed_data.is_mounted, 0);
+    usb_power_wake();
     // when storage is dismounted for the first time, boot into ota_0
     if (!first_time && tinyusb_msc_storage_in_use_by_usb_host()){
         first_time = true;
@@ -313,10 +374,29 @@ static void storage_mount_changed_cb(tinyusb_msc_event_t *event)
         ESP_ERROR_CHECK(tinyusb_msc_storage_mount(BASE_PATH));
         ota_c6_sd_perform(true, BASE_PATH "/c6_fw");
         ESP_ERROR_CHECK(tinyusb_msc_storage_unmount());
+        custom_sdmmc_flush();
         boot_into_slot(0);
     }
 }
 
+// give every unit its own stable serial number, so hosts with several units attached can tell them apart and
+// keep their per device state instead of re-probing
+static void usb_serial_init(const uint32_t *card_serial)
+{
+    uint8_t mac[6];
+    if (esp_efuse_mac_get_default(mac) != ESP_OK) {
+        ESP_LOGW(TAG, "Could not read factory MAC, keeping default serial number");
+        return;
+    }
+    int len = snprintf(serial_str, sizeof(serial_str), "%02X%02X%02X%02X%02X%02X",
+                       mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    if (card_serial) {
+        snprintf(serial_str + len, sizeof(serial_str) - len, "-%08" PRIX32, *card_serial);
+    }
+    string_desc_arr[3] = serial_str;
+    ESP_LOGI(TAG, "USB serial number %s", serial_str);
+}
+
 #ifdef CONFIG_EXAMPLE_STORAGE_MEDIA_SPIFLASH
 static esp_err_t storage_init_spiflash(wl_handle_t *wl_handle)
 {
@@ -457,6 +537,15 @@ void app_main(void)
         return;
     }
 
+    // NVS holds the SPI link calibration, spi_start() reads it
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_LOGW(TAG, "NVS partition was truncated or has a new version, erasing");
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        err = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK(err);
+
 #ifdef CONFIG_EXAMPLE_STORAGE_MEDIA_SPIFLASH
     static wl_handle_t wl_handle = WL_INVALID_HANDLE;
     ESP_ERROR_CHECK(storage_init_spiflash(&wl_handle));
@@ -468,6 +557,7 @@ void app_main(void)
     };
     ESP_ERROR_CHECK(tinyusb_msc_storage_init_spiflash(&config_spi));
     ESP_ERROR_CHECK(tinyusb_msc_register_callback(TINYUSB_MSC_EVENT_MOUNT_CHANGED, storage_mount_changed_cb)); /* Other way to register the callback i.e. registering using separate API. If the callback had been already registered, it will be overwritten. */
+    usb_serial_init(NULL);
 #else // CONFIG_EXAMPLE_STORAGE_MEDIA_SPIFLASH
     static sdmmc_card_t *card = NULL;
     ESP_ERROR_CHECK(storage_init_sdmmc(&card));
@@ -479,6 +569,9 @@ void app_main(void)
     };
     ESP_ERROR_CHECK(tinyusb_msc_storage_init_sdmmc(&config_sdmmc));
     ESP_ERROR_CHECK(tinyusb_msc_register_callback(TINYUSB_MSC_EVENT_MOUNT_CHANGED, storage_mount_changed_cb)); /* Other way to register the callback i.e. registering using separate API. If the callback had been already registered, it will be overwritten. */
+    ESP_ERROR_CHECK(usb_power_init(card));
+    const uint32_t card_serial = (uint32_t)card->cid.serial;
+    usb_serial_init(&card_serial);
 #endif  // CONFIG_EXAMPLE_STORAGE_MEDIA_SPIFLASH
 
     //mounted in the app by default
@@ -501,8 +594,16 @@ void app_main(void)
     ESP_ERROR_CHECK(tinyusb_driver_install(&tusb_cfg));
     ESP_LOGI(TAG, "USB MSC initialization DONE");
 
+#if RAW_STREAM_ENABLED
+    ESP_ERROR_CHECK(tusb_raw_stream_start(card));
+#endif
+
     // start spi_api
-    spi_start();
+#ifdef CONFIG_EXAMPLE_STORAGE_MEDIA_SPIFLASH
+    spi_start(BASE_PATH, NULL);
+#else
+    spi_start(BASE_PATH, card);
+#endif
 
     esp_console_repl_config_t repl_config = ESP_CONSOLE_REPL_CONFIG_DEFAULT();
     /* Prompt to be printed before each line.
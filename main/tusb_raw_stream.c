@@ -0,0 +1,282 @@
+/* Raw block streaming over a vendor specific bulk interface
+ *
+ * Gives factory/field tools sector level access to the sd card without SCSI framing and without
+ * the host file system stack. The interface sits next to the MSC interface in the same configuration
+ * and is only served while the storage is exposed over USB (tinyusb_msc_storage_in_use_by_usb_host()),
+ * so it never races the application's FatFs mount.
+ *
+ * Protocol (all fields little endian):
+ *  command  host -> device, raw_cmd_t {magic "TBDV", op, lba, count}
+ *  INFO     device answers with raw_status_t, sectors = card capacity
+ *  READ     device sends chunks of up to RAW_CHUNK_SECTORS sectors, each followed by its crc32,
+ *           then a final raw_status_t. If the read fails midway the status arrives as a short transfer
+ *           in place of the next chunk.
+ *  WRITE    host sends chunks of up to RAW_CHUNK_SECTORS sectors, each followed by its crc32, every chunk
+ *           is answered with a raw_status_t. On RawCrcError the host resends just that chunk, any other
+ *           status than RawOk terminates the command.
+ * crc32 is the standard (zlib) crc32 of the chunk payload.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_check.h"
+#include "esp_heap_caps.h"
+#include "esp_rom_crc.h"
+#include "tinyusb.h"
+#include "tusb_msc_storage.h"
+#include "tusb_raw_stream.h"
+#include "custom_sdmmc_cmd.h"
+
+#if CFG_TUD_VENDOR
+
+static const char *TAG = "raw_stream";
+
+#define RAW_MAGIC 0x56444254 // "TBDV"
+#ifndef RAW_CHUNK_SECTORS
+#define RAW_CHUNK_SECTORS 64 // 32KB payload per chunk
+#endif
+#define RAW_TIMEOUT_MS 1000 // host has to keep the stream going, otherwise the command is dropped
+
+typedef enum {
+    RawInfo = 0x01,
+    RawRead = 0x02,
+    RawWrite = 0x03,
+} RawOp;
+
+typedef enum {
+    RawOk = 0x00,
+    RawBadCommand = 0x01,
+    RawBusy = 0x02, // storage is mounted by the application
+    RawOutOfRange = 0x03,
+    RawCrcError = 0x04,
+    RawIoError = 0x05,
+    RawTimeout = 0x06,
+} RawStatus;
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint8_t op;
+    uint8_t reserved[3];
+    uint32_t lba;
+    uint32_t count; // sectors
+} raw_cmd_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint8_t op;
+    uint8_t status;
+    uint16_t chunk_sectors;
+    uint32_t sectors; // sectors transferred so far, INFO: card capacity in sectors
+    uint32_t sector_size;
+} raw_status_t;
+
+static TaskHandle_t hTask;
+static sdmmc_card_t *s_card;
+static uint8_t *chunk_buffer; // RAW_CHUNK_SECTORS sectors + crc32
+
+// TinyUSB callbacks, both just wake up the stream task
+void tud_vendor_rx_cb(uint8_t itf, uint8_t const *buffer, uint16_t bufsize)
+{
+    if (hTask) xTaskNotifyGive(hTask);
+}
+
+void tud_vendor_tx_cb(uint8_t itf, uint32_t sent_bytes)
+{
+    if (hTask) xTaskNotifyGive(hTask);
+}
+
+static bool raw_read_exact(uint8_t *dst, uint32_t len, TickType_t timeout)
+{
+    uint32_t got = 0;
+    while (got < len) {
+        uint32_t n = tud_vendor_read(dst + got, len - got);
+        if (n == 0) {
+            if (ulTaskNotifyTake(pdTRUE, timeout) == 0 && tud_vendor_available() == 0) {
+                return false;
+            }
+            continue;
+        }
+        got += n;
+    }
+    return true;
+}
+
+static bool raw_write_all(const uint8_t *src, uint32_t len)
+{
+    uint32_t sent = 0;
+    while (sent < len) {
+        if (!tud_mounted()) {
+            return false;
+        }
+        uint32_t n = tud_vendor_write(src + sent, len - sent);
+        tud_vendor_write_flush();
+        if (n == 0) {
+            if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(RAW_TIMEOUT_MS)) == 0 && tud_vendor_write_available() == 0) {
+                return false;
+            }
+            continue;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+static void raw_send_status(uint8_t op, RawStatus status, uint32_t sectors)
+{
+    const raw_status_t st = {
+        .magic = RAW_MAGIC,
+        .op = op,
+        .status = status,
+        .chunk_sectors = RAW_CHUNK_SECTORS,
+        .sectors = sectors,
+        .sector_size = s_card->csd.sector_size,
+    };
+    raw_write_all((const uint8_t *)&st, sizeof(st));
+}
+
+// throw away whatever is left in the fifo after a broken command, so the next command header lines up again
+static void raw_drain(void)
+{
+    uint8_t scratch[64];
+    while (tud_vendor_read(scratch, sizeof(scratch)) > 0 ||
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(20)) != 0) {
+    }
+}
+
+static RawStatus raw_do_read(const raw_cmd_t *cmd, uint32_t *done)
+{
+    const size_t sector_size = s_card->csd.sector_size;
+    while (*done < cmd->count) {
+        if (!tinyusb_msc_storage_in_use_by_usb_host()) {
+            return RawBusy;
+        }
+        const uint32_t n = (cmd->count - *done > RAW_CHUNK_SECTORS) ? RAW_CHUNK_SECTORS : cmd->count - *done;
+        const size_t bytes = n * sector_size;
+        esp_err_t err = sdmmc_read_sectors(s_card, chunk_buffer, cmd->lba + *done, n);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Error 0x%x reading %lu sectors at %lu", err, n, cmd->lba + *done);
+            return RawIoError;
+        }
+        const uint32_t crc = esp_rom_crc32_le(0, chunk_buffer, bytes);
+        memcpy(chunk_buffer + bytes, &crc, sizeof(crc));
+        if (!raw_write_all(chunk_buffer, bytes + sizeof(crc))) {
+            return RawTimeout;
+        }
+        *done += n;
+    }
+    return RawOk;
+}
+
+static RawStatus raw_do_write(const raw_cmd_t *cmd, uint32_t *done)
+{
+    const size_t sector_size = s_card->csd.sector_size;
+    const uint32_t card_errors = custom_sdmmc_error_count();
+    while (*done < cmd->count) {
+        const uint32_t n = (cmd->count - *done > RAW_CHUNK_SECTORS) ? RAW_CHUNK_SECTORS : cmd->count - *done;
+        const size_t bytes = n * sector_size;
+        if (!raw_read_exact(chunk_buffer, bytes + sizeof(uint32_t), pdMS_TO_TICKS(RAW_TIMEOUT_MS))) {
+            return RawTimeout;
+        }
+        if (!tinyusb_msc_storage_in_use_by_usb_host()) {
+            return RawBusy;
+        }
+        uint32_t crc;
+        memcpy(&crc, chunk_buffer + bytes, sizeof(crc));
+        if (crc != esp_rom_crc32_le(0, chunk_buffer, bytes)) {
+            ESP_LOGW(TAG, "crc mismatch in chunk at sector %lu, requesting resend", cmd->lba + *done);
+            raw_send_status(cmd->op, RawCrcError, *done);
+            continue;
+        }
+        esp_err_t err = sdmmc_write_sectors(s_card, chunk_buffer, cmd->lba + *done, n);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Error 0x%x writing %lu sectors at %lu", err, n, cmd->lba + *done);
+            return RawIoError;
+        }
+        *done += n;
+        if (*done < cmd->count) {
+            raw_send_status(cmd->op, RawOk, *done);
+        }
+    }
+    // the final RawOk must mean the data is on the card, not in the write coalescing buffer. A part that was
+    // flushed on the way failed without telling us, the error count shows it and the whole command is redone.
+    custom_sdmmc_flush();
+    if (custom_sdmmc_error_count() != card_errors) {
+        ESP_LOGE(TAG, "card write failed behind the write coalescing, %lu sectors at %lu", cmd->count, cmd->lba);
+        *done = 0;
+        return RawIoError;
+    }
+    return RawOk;
+}
+
+static void raw_stream_task(void *pvParameters)
+{
+    raw_cmd_t cmd;
+    ESP_LOGI(TAG, "raw_stream_task()");
+    while (1) {
+        if (!raw_read_exact((uint8_t *)&cmd, sizeof(cmd), portMAX_DELAY)) {
+            continue;
+        }
+        if (cmd.magic != RAW_MAGIC) {
+            ESP_LOGE(TAG, "Received magic 0x%08lx, expected 0x%08x", cmd.magic, RAW_MAGIC);
+            raw_drain();
+            raw_send_status(cmd.op, RawBadCommand, 0);
+            continue;
+        }
+
+        // same ownership rule as for the application: only whoever has the storage mounted may touch it
+        if (!tinyusb_msc_storage_in_use_by_usb_host()) {
+            raw_drain();
+            raw_send_status(cmd.op, RawBusy, 0);
+            continue;
+        }
+
+        const uint64_t capacity = (uint64_t)s_card->csd.capacity;
+        if (cmd.op == RawInfo) {
+            raw_send_status(cmd.op, RawOk, (uint32_t)capacity);
+            continue;
+        }
+        if (cmd.op != RawRead && cmd.op != RawWrite) {
+            ESP_LOGE(TAG, "Unknown raw op %d", cmd.op);
+            raw_drain();
+            raw_send_status(cmd.op, RawBadCommand, 0);
+            continue;
+        }
+        if ((uint64_t)cmd.lba + cmd.count > capacity) {
+            ESP_LOGE(TAG, "Request %lu+%lu exceeds card capacity %llu", cmd.lba, cmd.count, capacity);
+            raw_drain();
+            raw_send_status(cmd.op, RawOutOfRange, 0);
+            continue;
+        }
+
+        uint32_t done = 0;
+        const RawStatus status = (cmd.op == RawRead) ? raw_do_read(&cmd, &done) : raw_do_write(&cmd, &done);
+        if (status != RawOk) {
+            ESP_LOGE(TAG, "raw op %d at %lu stopped after %lu of %lu sectors, status %d",
+                     cmd.op, cmd.lba, done, cmd.count, status);
+            raw_drain();
+        }
+        raw_send_status(cmd.op, status, done);
+    }
+}
+
+esp_err_t tusb_raw_stream_start(sdmmc_card_t *card)
+{
+    ESP_RETURN_ON_FALSE(card, ESP_ERR_INVALID_ARG, TAG, "no card");
+    s_card = card;
+
+    chunk_buffer = (uint8_t *)heap_caps_malloc(RAW_CHUNK_SECTORS * card->csd.sector_size + sizeof(uint32_t),
+                   MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL | MALLOC_CAP_32BIT);
+    ESP_RETURN_ON_FALSE(chunk_buffer, ESP_ERR_NO_MEM, TAG, "could not allocate chunk buffer");
+
+    if (xTaskCreatePinnedToCore(raw_stream_task, "raw_stream", 4096, NULL, 5, &hTask, 0) != pdPASS) {
+        free(chunk_buffer);
+        chunk_buffer = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+#endif // CFG_TUD_VENDOR
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "esp_err.h"
+#include "sdmmc_cmd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// starts the vendor bulk interface task which serves raw sector reads/writes of the sd card,
+// the interface itself has to be part of the configuration descriptor (see tusb_msc_main.c)
+esp_err_t tusb_raw_stream_start(sdmmc_card_t *card);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,71 @@
+/* USB suspend/resume handling
+ *
+ * While the host has the bus suspended nothing can reach the storage over USB, so pending coalesced writes are
+ * flushed and the sd card clock is dropped to SDMMC_FREQ_PROBING. On resume the negotiated clock is restored
+ * before TinyUSB processes the next MSC command, both callbacks run in the TinyUSB task. A bus reset or unplug
+ * while suspended ends without resume callback, so the MSC read/write path and the mount change callback
+ * call usb_power_wake() as well. The parked state lives next to the card lock in custom_sdmmc_cmd.c, so
+ * parking and waking from different tasks can not race.
+ * The card is only parked while the storage is exposed over USB, if the application has it mounted it keeps
+ * full speed. The SPI slave needs no handling, its clock comes from the RP2350.
+ */
+
+#include "esp_log.h"
+#include "esp_check.h"
+#include "esp_timer.h"
+#include "tinyusb.h"
+#include "tusb_msc_storage.h"
+#include "custom_sdmmc_cmd.h"
+#include "msc_stats.h"
+#include "usb_power.h"
+
+static const char *TAG = "usb_power";
+
+static sdmmc_card_t *s_card;
+
+void tud_suspend_cb(bool remote_wakeup_en)
+{
+    if (s_card == NULL || !tinyusb_msc_storage_in_use_by_usb_host()) {
+        return;
+    }
+    const int64_t start = esp_timer_get_time();
+    bool changed;
+    esp_err_t err = custom_sdmmc_park_card_clk(s_card, true, &changed);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Could not park sd card clock: %s", esp_err_to_name(err));
+        return;
+    }
+    if (!changed) {
+        return;
+    }
+    msc_stats_note_suspend((uint32_t)(esp_timer_get_time() - start));
+}
+
+void tud_resume_cb(void)
+{
+    usb_power_wake();
+}
+
+void usb_power_wake(void)
+{
+    if (s_card == NULL) {
+        return;
+    }
+    const int64_t start = esp_timer_get_time();
+    bool changed;
+    esp_err_t err = custom_sdmmc_park_card_clk(s_card, false, &changed);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Could not restore sd card clock %d kHz: %s", s_card->real_freq_khz, esp_err_to_name(err));
+    }
+    if (!changed) {
+        return;
+    }
+    msc_stats_note_resume((uint32_t)(esp_timer_get_time() - start));
+}
+
+esp_err_t usb_power_init(sdmmc_card_t *card)
+{
+    ESP_RETURN_ON_FALSE(card, ESP_ERR_INVALID_ARG, TAG, "no card");
+    s_card = card;
+    return ESP_OK;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "esp_err.h"
+#include "sdmmc_cmd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// enables USB suspend/resume handling: while the bus is suspended the sd card is parked at a low clock
+esp_err_t usb_power_init(sdmmc_card_t *card);
+
+// restores the negotiated sd card clock if it is parked, cheap if it is not
+void usb_power_wake(void);
+
+#ifdef __cplusplus
+}
+#endif